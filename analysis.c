@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <complex.h>
+#include <time.h>
+
+#include "analysis.h"
+#include "fft.h"
+#include "pool.h"
+#include "kernels.h"
+
+// Everything an analysis needs lives in here, so any number of them can
+// be run at the same time, sharing (or not sharing) a worker pool.
+struct analysis {
+   int point_count;
+   unsigned int rate;
+   double max_rms;
+   struct pool *pool;
+   const struct kernels *k;
+   struct fft_plan *plan;
+   double *window;
+   double *s_table;
+   double *c_table;
+   double complex *spectrum;
+   double *signal;
+
+   // Bins being notched out around the fundamental
+   int notch_max;
+   int notch_count;
+   int    *notch_bin;
+   double *notch_st;
+   double *notch_ct;
+   double *points;
+   int notch_mode;
+   struct analysis_timing *timing;
+
+   // Only allocated for analysis_new_float()
+   float *window_f;
+   float complex *spectrum_f;
+   float *points_f;
+};
+
+static struct analysis *analysis_alloc(int point_count, unsigned int rate, struct pool *pool, int is_float) {
+   struct analysis *a;
+
+   if(point_count < 2 || rate == 0)
+      return NULL;
+
+   a = calloc(1, sizeof(struct analysis));
+   if(a == NULL)
+      return NULL;
+
+   a->point_count = point_count;
+   a->rate        = rate;
+   a->pool        = pool;
+   a->k           = kernels_select();
+   a->notch_mode  = ANALYSIS_NOTCH_BAND;
+   a->notch_max   = 2*(int)(50.0*point_count/rate)+1;
+
+   a->plan      = fft_plan_new(point_count);
+   a->window    = malloc(sizeof(double)*point_count);
+   a->s_table   = malloc(sizeof(double)*point_count);
+   a->c_table   = malloc(sizeof(double)*point_count);
+   a->signal    = malloc(sizeof(double)*(point_count/2));
+   a->notch_bin = malloc(sizeof(int)*a->notch_max);
+   a->notch_st  = malloc(sizeof(double)*a->notch_max);
+   a->notch_ct  = malloc(sizeof(double)*a->notch_max);
+   if(is_float) {
+      a->window_f   = malloc(sizeof(float)*point_count);
+      a->spectrum_f = malloc(sizeof(float complex)*point_count);
+   } else {
+      a->spectrum   = malloc(sizeof(double complex)*point_count);
+   }
+   if(a->plan == NULL || a->window == NULL || a->s_table == NULL || a->c_table == NULL ||
+      (is_float ? a->window_f == NULL || a->spectrum_f == NULL : a->spectrum == NULL) ||
+      a->signal == NULL || a->notch_bin == NULL || a->notch_st == NULL || a->notch_ct == NULL) {
+      analysis_free(a);
+      return NULL;
+   }
+
+   for(int i = 0; i < point_count; i++) {
+      double phase = i/((float)point_count)*2*M_PI;
+      a->s_table[i] = sin(phase);
+      a->c_table[i] = cos(phase);
+      a->window[i]  = 0.42 - 0.5 * cos(2*M_PI*i/point_count) + 0.08 * cos(4*M_PI*i/point_count);
+      if(is_float)
+         a->window_f[i] = a->window[i];
+   }
+
+   // The RMS of a full scale signal after windowing, used as the 0dB reference
+   double rms = 0.0;
+   for(int i = 0; i < point_count; i++) {
+      double p = 32767*a->window[i];
+      rms += p*p;
+   }
+   a->max_rms = sqrt(rms/point_count);
+   return a;
+}
+
+struct analysis *analysis_new(int point_count, unsigned int rate, struct pool *pool) {
+   return analysis_alloc(point_count, rate, pool, 0);
+}
+
+// Runs the same pipeline on float points with analysis_window_float() and
+// analysis_run_float(), halving the memory traffic
+struct analysis *analysis_new_float(int point_count, unsigned int rate, struct pool *pool) {
+   return analysis_alloc(point_count, rate, pool, 1);
+}
+
+void analysis_free(struct analysis *a) {
+   if(a == NULL)
+      return;
+   fft_plan_free(a->plan);
+   free(a->window);
+   free(a->s_table);
+   free(a->c_table);
+   free(a->spectrum);
+   free(a->window_f);
+   free(a->spectrum_f);
+   free(a->signal);
+   free(a->notch_bin);
+   free(a->notch_st);
+   free(a->notch_ct);
+   free(a);
+}
+
+double *analysis_signal(struct analysis *a) {
+   return a->signal;
+}
+
+int analysis_bins(struct analysis *a) {
+   return a->point_count/2;
+}
+
+void analysis_set_notch(struct analysis *a, int mode) {
+   a->notch_mode = mode;
+}
+
+// NULL turns the timing off again
+void analysis_set_timing(struct analysis *a, struct analysis_timing *timing) {
+   a->timing = timing;
+}
+
+static double stage_clock(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Only reads the clock when timing is on
+#define STAGE_START(a)         ((a)->timing != NULL ? stage_clock() : 0.0)
+#define STAGE_END(a, field, t) do { if((a)->timing != NULL) { double now = stage_clock(); (a)->timing->field += now-(t); (t) = now; } } while(0)
+
+//=========================================================================================
+void find_s_c(struct analysis *a, double *points, double bin, double *st, double *ct) {
+   int point_count = a->point_count;
+   double s, c;
+
+   // The table index only ever advanced by the whole part of 'bin'
+   a->k->dot_sc(points, a->s_table, a->c_table, point_count, (int)bin % point_count, &s, &c);
+   if(bin == 0) {
+      *st = s/(point_count);
+      *ct = c/(point_count);
+   } else {
+      *st = s/(point_count/2.0);
+      *ct = c/(point_count/2.0);
+   }
+}
+
+double calc_rms(struct analysis *a, double *points, int point_count) {
+   double rms = a->k->sum_sq(points, point_count);
+   rms /= point_count;
+   return sqrt(rms);
+}
+
+void remove_bin(struct analysis *a, double *points, int point_count, double bin, double st, double ct) {
+   if(bin == floor(bin)) {
+      a->k->remove_sc(points, 0, point_count, point_count, (long long)bin % point_count, st, ct);
+      return;
+   }
+   for(int i = 0; i < point_count; i++) {
+      double phase = i*bin/((double)point_count)*2*M_PI;
+      double f = st*sin(phase) + ct*cos(phase);
+      points[i] -= f;
+   }
+}
+
+//=========================================================================================
+// The fit passes generate the sine with an oscillator, reseeded from the
+// exact phase every OSC_RESEED samples so rounding can't build up.
+#define OSC_RESEED  1024
+
+// Solve m.x = v by Gaussian elimination with partial pivoting
+static int solve3(double m[3][3], double v[3], double x[3]) {
+   for(int c = 0; c < 3; c++) {
+      int pivot = c;
+      for(int r = c+1; r < 3; r++)
+         if(fabs(m[r][c]) > fabs(m[pivot][c]))
+            pivot = r;
+      if(m[pivot][c] == 0.0)
+         return 0;
+      for(int k = 0; k < 3; k++) {
+         double t = m[c][k]; m[c][k] = m[pivot][k]; m[pivot][k] = t;
+      }
+      double t = v[c]; v[c] = v[pivot]; v[pivot] = t;
+      for(int r = c+1; r < 3; r++) {
+         double f = m[r][c]/m[c][c];
+         for(int k = c; k < 3; k++)
+            m[r][k] -= f*m[c][k];
+         v[r] -= f*v[c];
+      }
+   }
+   for(int r = 2; r >= 0; r--) {
+      double sum = v[r];
+      for(int k = r+1; k < 3; k++)
+         sum -= m[r][k]*x[k];
+      x[r] = sum/m[r][r];
+   }
+   return 1;
+}
+
+//=========================================================================================
+// The float versions of the inner loops that are simple enough for the
+// compiler to vectorise. The notch, which needs its sine generated in
+// double, is in the kernels.
+static void multiply_float(float *points, const float *window, int n) {
+   for(int i = 0; i < n; i++)
+      points[i] *= window[i];
+}
+
+// Pairwise, so the rounding error grows with log(n) rather than n. The
+// leaves keep eight partial sums so they can still be vectorised.
+#define PAIRWISE_LEAF 256
+static double sum_sq_float(const float *points, int n) {
+   if(n > PAIRWISE_LEAF) {
+      int half = n/2;
+      return sum_sq_float(points, half) + sum_sq_float(points+half, n-half);
+   }
+
+   float acc[8] = {0};
+   int i;
+   for(i = 0; i+8 <= n; i += 8)
+      for(int j = 0; j < 8; j++)
+         acc[j] += points[i+j]*points[i+j];
+   for(; i < n; i++)
+      acc[0] += points[i]*points[i];
+   return ((double)acc[0]+acc[1]+acc[2]+acc[3]) + ((double)acc[4]+acc[5]+acc[6]+acc[7]);
+}
+
+#define SAMPLE           double
+#define SAMPLE_COMPLEX   double complex
+#define NAME(x)          x
+#define A_WINDOW         a->window
+#define A_SPECTRUM       a->spectrum
+#define A_POINTS         a->points
+#define FFT_REAL_FN      fft_forward_real
+#define MULTIPLY(a, points, window, n)  (a)->k->multiply(points, window, n)
+#define SUM_SQ(a, points, n)            (a)->k->sum_sq(points, n)
+#define REMOVE_SC(a, points, begin, end, n, bin, st, ct)  (a)->k->remove_sc(points, begin, end, n, bin, st, ct)
+#include "analysis_impl.h"
+
+#define SAMPLE           float
+#define SAMPLE_COMPLEX   float complex
+#define NAME(x)          x##_float
+#define A_WINDOW         a->window_f
+#define A_SPECTRUM       a->spectrum_f
+#define A_POINTS         a->points_f
+#define FFT_REAL_FN      fft_forward_real_float
+#define MULTIPLY(a, points, window, n)  multiply_float(points, window, n)
+#define SUM_SQ(a, points, n)            sum_sq_float(points, n)
+#define REMOVE_SC(a, points, begin, end, n, bin, st, ct)  (a)->k->remove_sc_f(points, begin, end, n, bin, st, ct)
+#include "analysis_impl.h"
+
+//=========================================================================================
+// Measure just the fundamental and its harmonics with a bank of Goertzel
+// filters, all run in one pass over the (unwindowed) points. The window is
+// applied on the fly so the points are left untouched. Harmonics above
+// Nyquist are dropped, the number actually measured is returned.
+int analysis_harmonics(struct analysis *a, const double *points, double fundamental_hz, int count, struct harmonic *harmonics, double *thd) {
+   double coeff[MAX_HARMONICS];
+   double s1[MAX_HARMONICS];
+   double s2[MAX_HARMONICS];
+   double w[MAX_HARMONICS];
+   int point_count = a->point_count;
+   int k;
+
+   if(count > MAX_HARMONICS)
+      count = MAX_HARMONICS;
+   for(k = 0; k < count; k++) {
+      if(fundamental_hz*(k+1) >= a->rate/2.0)
+         break;
+      w[k]     = 2*M_PI*fundamental_hz*(k+1)/a->rate;
+      coeff[k] = 2*cos(w[k]);
+      s1[k]    = 0.0;
+      s2[k]    = 0.0;
+   }
+   count = k;
+   if(count == 0)
+      return 0;
+
+   double window_sum = 0.0;
+   for(int i = 0; i < point_count; i++) {
+      double x = points[i] * a->window[i];
+      window_sum += a->window[i];
+      for(k = 0; k < count; k++) {
+         double s = x + coeff[k]*s1[k] - s2[k];
+         s2[k] = s1[k];
+         s1[k] = s;
+      }
+   }
+
+   double distortion = 0.0;
+   for(k = 0; k < count; k++) {
+      // y[N-1] = s1 - e^-jw s2, which is X(w) rotated by w(N-1)
+      double complex y = s1[k] - cexp(-I*w[k])*s2[k];
+      double complex x = y * cexp(-I*w[k]*(point_count-1));
+      double amplitude = 2*cabs(x)/window_sum;
+
+      harmonics[k].hz       = fundamental_hz*(k+1);
+      harmonics[k].level    = amplitude/sqrt(2);
+      harmonics[k].level_db = log(amplitude/32767)/log(10)*20;
+      harmonics[k].phase    = carg(x) + M_PI/2;
+      if(harmonics[k].phase > M_PI)
+         harmonics[k].phase -= 2*M_PI;
+      if(k > 0)
+         distortion += harmonics[k].level*harmonics[k].level;
+   }
+   *thd = sqrt(distortion)/harmonics[0].level;
+   return count;
+}
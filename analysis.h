@@ -0,0 +1,54 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+struct pool;
+struct analysis;
+
+struct analysis_result {
+   int    max_bin;
+   double peak_hz;
+   double signal;       // RMS of the notched out fundamental
+   double signal_db;    // Peak bin relative to full scale
+   double rms;          // RMS of what is left (THD+N)
+};
+
+// How the fundamental is removed before measuring what is left
+#define ANALYSIS_NOTCH_BAND  0   // Every bin within 50Hz of the peak
+#define ANALYSIS_NOTCH_FIT   1   // A sine fitted at the estimated frequency
+
+#define MAX_HARMONICS 32
+
+// Seconds spent in each stage, added to on every call once set with
+// analysis_set_timing(). Zero it to start again.
+struct analysis_timing {
+   double window;
+   double spectrum;     // FFT, spectrum in dB and the peak search
+   double notch;
+   double rms;
+};
+
+struct harmonic {
+   double hz;
+   double level;        // RMS
+   double level_db;     // Relative to a full scale sine
+   double phase;        // Radians, relative to the first sample
+};
+
+struct analysis *analysis_new(int point_count, unsigned int rate, struct pool *pool);
+struct analysis *analysis_new_float(int point_count, unsigned int rate, struct pool *pool);
+void analysis_set_notch(struct analysis *a, int mode);
+void analysis_set_timing(struct analysis *a, struct analysis_timing *timing);
+void analysis_window(struct analysis *a, double *points);
+int analysis_run(struct analysis *a, double *points, struct analysis_result *result);
+void analysis_window_float(struct analysis *a, float *points);
+int analysis_run_float(struct analysis *a, float *points, struct analysis_result *result);
+int analysis_harmonics(struct analysis *a, const double *points, double fundamental_hz, int count, struct harmonic *harmonics, double *thd);
+double *analysis_signal(struct analysis *a);
+int analysis_bins(struct analysis *a);
+void analysis_free(struct analysis *a);
+
+void find_s_c(struct analysis *a, double *points, double bin, double *st, double *ct);
+// With the kernels the analysis picked when it was created
+double calc_rms(struct analysis *a, double *points, int point_count);
+void remove_bin(struct analysis *a, double *points, int point_count, double bin, double st, double ct);
+#endif
@@ -0,0 +1,199 @@
+// The window -> spectrum -> notch -> rms pipeline of analysis.c, for one
+// sample type. Included once per type with these defined:
+//   SAMPLE, SAMPLE_COMPLEX   the point and spectrum types
+//   NAME(x)                  the name to use for x
+//   A_WINDOW, A_SPECTRUM, A_POINTS   the analysis' buffers of that type
+//   FFT_REAL_FN              the real input FFT for that type
+//   MULTIPLY, SUM_SQ, REMOVE_SC      the inner loops, as in struct kernels
+// STAGE_START() and STAGE_END() come from analysis.c.
+// The arithmetic on each point is in double whatever the storage type.
+
+// Same scaling and sign convention as find_s_c(), taken from an FFT of the points
+static void NAME(spectrum_s_c)(const SAMPLE_COMPLEX *spectrum, int point_count, int bin, double *st, double *ct) {
+   double scale = (bin == 0) ? point_count : point_count/2.0;
+   *st = -cimag(spectrum[bin])/scale;
+   *ct =  creal(spectrum[bin])/scale;
+}
+
+void NAME(analysis_window)(struct analysis *a, SAMPLE *points) {
+   double t = STAGE_START(a);
+   MULTIPLY(a, points, A_WINDOW, a->point_count);
+   STAGE_END(a, window, t);
+}
+
+//=========================================================================================
+static void NAME(signal_slice)(void *arg, int begin, int end) {
+   struct analysis *a = arg;
+   double st, ct;
+
+   for(int i = begin; i < end; i++) {
+      NAME(spectrum_s_c)(A_SPECTRUM, a->point_count, i, &st, &ct);
+      a->signal[i] = log(sqrt(st*st+ct*ct)/a->max_rms)/log(10)*20;
+   }
+}
+
+static void NAME(notch_slice)(void *arg, int begin, int end) {
+   struct analysis *a = arg;
+
+   for(int j = 0; j < a->notch_count; j++) {
+      REMOVE_SC(a, A_POINTS, begin, end, a->point_count, a->notch_bin[j], a->notch_st[j], a->notch_ct[j]);
+   }
+}
+
+static double NAME(notch_band)(struct analysis *a, SAMPLE *points, int max_bin) {
+   int point_count = a->point_count;
+
+   // Whole bins are orthogonal over the capture, so the amplitude of each
+   // bin in the notch can be taken from the spectrum up front and they can
+   // all be removed together, with the samples split across the pool.
+   double s = 0.0;
+   int notch_width = 50.0*point_count/a->rate;
+   a->notch_count = 0;
+   for(int bin = max_bin-notch_width; bin < max_bin+notch_width; bin++) {
+      if(bin >= 0 && bin <= point_count/2 && a->notch_count < a->notch_max) {
+         double st, ct;
+         NAME(spectrum_s_c)(A_SPECTRUM, point_count, bin, &st, &ct);
+         a->notch_bin[a->notch_count] = bin;
+         a->notch_st[a->notch_count]  = st;
+         a->notch_ct[a->notch_count]  = ct;
+         a->notch_count++;
+         s += sqrt(st*st+ct*ct)/sqrt(2);
+      }
+   }
+   A_POINTS = points;
+   pool_for(a->pool, point_count, NAME(notch_slice), a);
+   A_POINTS = NULL;
+   return s;
+}
+
+//=========================================================================================
+// Least squares fit of a windowed sine at a frequency that need not be a
+// whole bin. Each pass runs an oscillator at 'w' radians per sample. The
+// sums are of the basis functions w*sin, w*cos and, when 'fit_freq' is
+// set, the derivative with respect to frequency w*n*(A*cos - B*sin).
+static void NAME(fit_pass)(struct analysis *a, const SAMPLE *points, double w, double A, double B, int fit_freq, double m[3][3], double v[3]) {
+   double zr = 1.0, zi = 0.0;
+   double rr = cos(w), ri = sin(w);
+
+   for(int r = 0; r < 3; r++) {
+      v[r] = 0.0;
+      for(int c = 0; c < 3; c++)
+         m[r][c] = 0.0;
+   }
+
+   for(int i = 0; i < a->point_count; i++) {
+      double u[3];
+      if(i % OSC_RESEED == 0) {
+         double phase = fmod(w*i, 2*M_PI);
+         zr = cos(phase);
+         zi = sin(phase);
+      }
+      u[0] = A_WINDOW[i]*zi;
+      u[1] = A_WINDOW[i]*zr;
+      u[2] = fit_freq ? A_WINDOW[i]*i*(A*zr - B*zi) : 0.0;
+      for(int r = 0; r < 3; r++) {
+         v[r] += points[i]*u[r];
+         for(int c = 0; c <= r; c++)
+            m[r][c] += u[r]*u[c];
+      }
+      double t = zr*rr - zi*ri;
+      zi = zr*ri + zi*rr;
+      zr = t;
+   }
+   for(int r = 0; r < 3; r++)
+      for(int c = r+1; c < 3; c++)
+         m[r][c] = m[c][r];
+   if(!fit_freq)
+      m[2][2] = 1.0;
+}
+
+static double NAME(notch_fit)(struct analysis *a, SAMPLE *points, int max_bin, double *peak_hz) {
+   int point_count = a->point_count;
+   double m[3][3], v[3], x[3];
+   double A = 0.0, B = 0.0;
+
+   // Start from the peak bin, interpolated on the log magnitude
+   double delta = 0.0;
+   if(max_bin > 0 && max_bin < point_count/2-1) {
+      double l = a->signal[max_bin-1], c = a->signal[max_bin], r = a->signal[max_bin+1];
+      if(l-2*c+r != 0.0)
+         delta = 0.5*(l-r)/(l-2*c+r);
+   }
+   double w = 2*M_PI*(max_bin+delta)/point_count;
+
+   for(int iter = 0; iter < 4; iter++) {
+      NAME(fit_pass)(a, points, w, A, B, iter > 0, m, v);
+      if(!solve3(m, v, x))
+         break;
+      A = x[0];
+      B = x[1];
+      if(iter > 0)
+         w += x[2];
+   }
+   NAME(fit_pass)(a, points, w, 0.0, 0.0, 0, m, v);
+   if(solve3(m, v, x)) {
+      A = x[0];
+      B = x[1];
+   }
+
+   double zr = 1.0, zi = 0.0;
+   double rr = cos(w), ri = sin(w);
+   for(int i = 0; i < point_count; i++) {
+      if(i % OSC_RESEED == 0) {
+         double phase = fmod(w*i, 2*M_PI);
+         zr = cos(phase);
+         zi = sin(phase);
+      }
+      points[i] -= A_WINDOW[i]*(A*zi + B*zr);
+      double t = zr*rr - zi*ri;
+      zi = zr*ri + zi*rr;
+      zr = t;
+   }
+   *peak_hz = w*a->rate/(2*M_PI);
+   return sqrt(A*A+B*B)/sqrt(2);
+}
+
+// 'points' should already be windowed, and will have the fundamental removed
+int NAME(analysis_run)(struct analysis *a, SAMPLE *points, struct analysis_result *result) {
+   int point_count = a->point_count;
+   double t = STAGE_START(a);
+   int i;
+
+   FFT_REAL_FN(a->plan, points, A_SPECTRUM);
+   pool_for(a->pool, point_count/2, NAME(signal_slice), a);
+
+   int max_bin = 0;
+   for(i = 0;i < point_count/2; i++) {
+      if(a->signal[i] > a->signal[max_bin]) {
+         max_bin = i;
+      }
+   }
+
+   STAGE_END(a, spectrum, t);
+
+   double s;
+   result->peak_hz = (double)max_bin * a->rate/point_count;
+   if(a->notch_mode == ANALYSIS_NOTCH_FIT)
+      s = NAME(notch_fit)(a, points, max_bin, &result->peak_hz);
+   else
+      s = NAME(notch_band)(a, points, max_bin);
+   STAGE_END(a, notch, t);
+
+   result->max_bin   = max_bin;
+   result->signal    = s;
+   result->signal_db = a->signal[max_bin];
+   result->rms       = sqrt(SUM_SQ(a, points, point_count)/point_count);
+   STAGE_END(a, rms, t);
+   return 1;
+}
+
+#undef SAMPLE
+#undef SAMPLE_COMPLEX
+#undef NAME
+#undef A_WINDOW
+#undef A_SPECTRUM
+#undef A_POINTS
+#undef FFT_REAL_FN
+#undef MULTIPLY
+#undef SUM_SQ
+#undef REMOVE_SC
@@ -1,13 +1,29 @@
 #include <stdint.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <math.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 #include "image.h"
-
-static int frequency_hz = 1000;
-static unsigned int desired_rate = 48000;
-static unsigned int actual_rate;  
+#include "audio_thread.h"
+#include "analysis.h"
+#include "pool.h"
+#include "monitor.h"
+#include "levels.h"
+#include "input.h"
+#include "plot.h"
+#include "batch.h"
+#include "nco.h"
+#include "kernels.h"
+#include "multichannel.h"
+#include "libaudiodistortion.h"
+#include "stats.h"
+#include "latency.h"
+#include "multitone.h"
+#include "fft.h"
 
 
 
@@ -86,620 +102,1251 @@ static int SetLevels(char *device_pb, char *device_cap, long master, long captur
 }
 
 
-static int init_pb(snd_pcm_t **snddev_pb, const char *name)
-{
-  int err;
-  snd_pcm_hw_params_t *hw_params;
+// Waits for the loopback to settle before anything is kept. Channel 0's
+// fundamental is measured over blocks of whole cycles against the
+// reference oscillator. It has settled once the amplitude holds steady,
+// and the phase moves by the same step each block, for SETTLE_BLOCKS
+// blocks in a row. A steady phase step rather than a steady phase copes
+// with playback and capture on different clocks. Each block is Hann
+// windowed, so the other tones of a multitone test don't leak in.
+#define SETTLE_BLOCK_RATE 50       // blocks are at least 1/50 s
+#define SETTLE_BLOCKS     3
+#define SETTLE_DB         0.02
+#define SETTLE_RAD        0.005
+
+struct settle {
+   int block;               // samples per block, a whole number of cycles
+   int min;                 // always skipped, the audio still in the ALSA buffers
+   int timeout;             // skipped at most
+   int n;                   // samples into the current block
+   double s, c;
+   int blocks;
+   double amplitude;        // of the last block
+   double phase;
+   double step;             // phase change over the last block
+   int stable;              // blocks in a row that matched
+   int done;
+   int timed_out;
+};
 
-  if( name == NULL ) {
-      name = "plughw:0,0";
-      printf("USING %s\n",name);
-  }
-  err = snd_pcm_open(snddev_pb, name, SND_PCM_STREAM_PLAYBACK, 0);
+// Tone generation and capture state. play_tone() runs on the audio thread,
+// the capture callbacks on the thread reading the ring.
+struct capture {
+   struct nco tone[MAX_CHANNELS];
+   atomic_ullong step[MAX_CHANNELS];  // tone frequencies, set by the capture side
+   struct nco ref;                    // channel 0's frequency, for the level measurement
+   struct nco multi[MULTITONE_MAX_TONES];    // with -t, played on every channel instead
+   double multi_amplitude[MULTITONE_MAX_TONES];
+   atomic_int multi_count;            // set once the above are, by the capture side
+   const struct kernels *k;
+   struct run_stats *stats;
+   double settled;                    // when the first sample that is kept came in
+
+   struct settle settle;
+   int samples_read;
+   int skip;                          // set once settled
+   int count;
+   double setup_power;
+   double setup_sin;
+   double setup_cos;
+   double *points[MAX_CHANNELS];
+};
 
-  if( err < 0 ) {
-      printf("Init: cannot open audio playback device %s (%s)\n", name, snd_strerror(err));
-      return 0;
-  }
-  printf("Audio playback device opened successfully.\n");
+#define TONE_AMPLITUDE  (3*8192)
+#define CROSSTALK_SPACING 0.1     // channel n plays the tone * (1 + n*0.1)
+
+// The sum of the -t tones, the same on every channel
+static void play_multitone(struct capture *c, int16_t *out, int frames, int channels, int count) {
+   double s[NCO_BLOCK], co[NCO_BLOCK], sum[NCO_BLOCK];
+
+   for(int i = 0; i < frames; i += NCO_BLOCK) {
+      int n = frames-i;
+      if(n > NCO_BLOCK)
+         n = NCO_BLOCK;
+      memset(sum, 0, sizeof(double)*n);
+      for(int t = 0; t < count; t++) {
+         nco_sincos(&c->multi[t], s, co, n);
+         for(int j = 0; j < n; j++)
+            sum[j] += c->multi_amplitude[t]*s[j];
+      }
+      for(int j = 0; j < n; j++) {
+         int16_t v = lrint(sum[j]);
+         for(int ch = 0; ch < channels; ch++)
+            out[(i+j)*channels+ch] = v;
+      }
+   }
+}
 
-  if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
-      printf("Init: cannot allocate hardware parameter structure (%s)\n", snd_strerror(err));
-      return 0;
-  }
- 
-  if ((err = snd_pcm_hw_params_any (*snddev_pb, hw_params)) < 0) {
-      printf("Init: cannot initialize hardware parameter structure (%s)\n", snd_strerror (err));
-      return 0;
-  }
+static void play_tone(void *arg, int16_t *out, int frames, int channels) {
+   struct capture *c = arg;
+   int count = atomic_load_explicit(&c->multi_count, memory_order_acquire);
 
-  unsigned int resample = 1;
-  err = snd_pcm_hw_params_set_rate_resample(*snddev_pb, hw_params, resample);
-  if (err < 0) {
-      printf("Init: Resampling setup failed for playback: %s\n", snd_strerror(err));
-      return 0;
-  }
+   if(count > 0) {
+      play_multitone(c, out, frames, channels, count);
+      return;
+   }
+   for(int ch = 0; ch < channels; ch++) {
+      uint64_t step = atomic_load_explicit(&c->step[ch], memory_order_relaxed);
+      if(step != c->tone[ch].step)
+         nco_set_step(&c->tone[ch], step);
+      nco_tone(&c->tone[ch], out+ch, frames, channels, TONE_AMPLITUDE);
+   }
+}
 
-  // Set access to RW interleaved.
-  if ((err = snd_pcm_hw_params_set_access (*snddev_pb, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-      printf("Init: cannot set access type (%s)\n", snd_strerror (err));
-      return 0;
-  }
+// A tone for each channel
+static void set_tones(struct capture *c, const double *frequency_hz, unsigned int rate) {
+   for(int ch = 0; ch < MAX_CHANNELS; ch++)
+      atomic_store(&c->step[ch], nco_step(frequency_hz[ch], rate));
+   nco_set_step(&c->ref, atomic_load(&c->step[0]));
+}
 
-  if ((err = snd_pcm_hw_params_set_format (*snddev_pb, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-      printf("Init: cannot set sample format (%s)\n", snd_strerror (err));
-      return 0;
-  }
+// The same tone on every channel
+static void set_tone(struct capture *c, double frequency_hz, unsigned int rate) {
+   double hz[MAX_CHANNELS];
+   for(int ch = 0; ch < MAX_CHANNELS; ch++)
+      hz[ch] = frequency_hz;
+   set_tones(c, hz, rate);
+}
 
-  // Set channels to stereo (2).
-  if ((err = snd_pcm_hw_params_set_channels (*snddev_pb, hw_params, 2)) < 0) {
-      printf("Init: cannot set channel count (%s)\n", snd_strerror (err));
-      return 0;
-  }
+// The -t tones, played together on every channel
+struct tone_set {
+   int count;
+   double hz[MULTITONE_MAX_TONES];
+   double weight[MULTITONE_MAX_TONES];     // relative amplitudes
+};
 
-  // Set sample rate.
-  actual_rate = desired_rate;
-  if ((err = snd_pcm_hw_params_set_rate_near (*snddev_pb, hw_params, &actual_rate, 0)) < 0) {
-      printf("Init: cannot set sample rate to %i. (%s)\n",desired_rate, snd_strerror(err));
-      return 0;
-  }
-  if( actual_rate < desired_rate ) {
-      printf("Init: sample rate does not match requested rate. (%i)\n", actual_rate);
-  }
+// Their peaks add up to the calibrated tone's. Only done once, the audio
+// thread reads them without a lock. Returns the loudest, which the
+// loopback settles on.
+static double set_multitone(struct capture *c, const struct tone_set *ts, unsigned int rate) {
+   double total = 0.0;
+   int loudest = 0;
+
+   for(int t = 0; t < ts->count; t++) {
+      total += ts->weight[t];
+      if(ts->weight[t] > ts->weight[loudest])
+         loudest = t;
+   }
+   for(int t = 0; t < ts->count; t++) {
+      nco_init(&c->multi[t], nco_step(ts->hz[t], rate));
+      c->multi_amplitude[t] = TONE_AMPLITUDE*ts->weight[t]/total;
+   }
+   set_tone(c, ts->hz[loudest], rate);
+   atomic_store_explicit(&c->multi_count, ts->count, memory_order_release);
+   return ts->hz[loudest];
+}
 
-  if(snd_pcm_nonblock(*snddev_pb, 1) < 0) {
-      printf("Init: cannot set non-blocking (%s)\n", snd_strerror (err));
-  }
+//=========================================================================================
+// Start waiting for the loopback to settle on 'hz', and flush what was
+// captured before now. Waits for at most 'timeout' samples.
+static void settle_start(struct capture *c, struct audio_thread *audio, double hz, int timeout) {
+   struct settle *st = &c->settle;
+   double period = audio->io.rate/hz;
+
+   memset(st, 0, sizeof(*st));
+   st->block   = ceil(audio->io.rate/SETTLE_BLOCK_RATE/period)*period + 0.5;
+   st->min     = 2*audio->io.buffer_size;
+   st->timeout = timeout;
+   if(st->min > timeout)
+      st->min = timeout;
+   c->samples_read = 0;
+   c->skip         = timeout;
+   audio_thread_flush(audio);
+}
 
-  if ((err = snd_pcm_hw_params (*snddev_pb, hw_params)) < 0) {
-      printf("Init: cannot set parameters (%s)\n", snd_strerror (err));
-      return 0;
-  } else {
-     printf("Audio device parameters have been set successfully.\n");
-  }
-
-  snd_pcm_uframes_t bufferSize;
-  snd_pcm_hw_params_get_buffer_size( hw_params, &bufferSize );
-  printf("Init: Buffer size = %lu frames.\n", bufferSize);
-  printf("Init: Significant bits for linear samples = %i\n", snd_pcm_hw_params_get_sbits(hw_params));
-  snd_pcm_hw_params_free (hw_params);
-
-  if ((err = snd_pcm_prepare(*snddev_pb)) < 0) {
-      printf("Init: cannot prepare audio interface for use (%s)\n", snd_strerror(err));
-      return 0;
-  } else {
-      printf("Audio device has been prepared for use.\n");
-  }
+static void settle_report(struct capture *c, unsigned int rate) {
+   printf("Settled after %.0f ms%s\n", c->skip*1000.0/rate, c->settle.timed_out ? ", gave up waiting" : "");
+}
+
+static void settle_block(struct settle *st) {
+   double amplitude = sqrt(st->s*st->s + st->c*st->c);
+   double phase     = atan2(st->c, st->s);
+   double step      = remainder(phase - st->phase, 2*M_PI);
+
+   if(st->blocks >= 2 && amplitude > 0.0 && st->amplitude > 0.0 &&
+      fabs(20*log10(amplitude/st->amplitude)) < SETTLE_DB &&
+      fabs(remainder(step - st->step, 2*M_PI)) < SETTLE_RAD) {
+      st->stable++;
+   } else {
+      st->stable = 0;
+   }
+   st->done      = st->stable >= SETTLE_BLOCKS;
+   st->amplitude = amplitude;
+   st->phase     = phase;
+   st->step      = step;
+   st->blocks++;
+   st->n = 0;
+   st->s = 0.0;
+   st->c = 0.0;
+}
 
-  return 1;
+// Runs the settle detector over the start of 'in', returning how many frames
+// it used. Once it has settled the capture starts at c->skip.
+static int settle_frames(struct capture *c, const int16_t *in, int frames, int channels) {
+   struct settle *st = &c->settle;
+   double s[NCO_BLOCK], co[NCO_BLOCK];
+   int i = 0;
+
+   while(i < frames && !st->done) {
+      int n = frames-i;
+      if(c->samples_read < st->min) {
+         if(n > st->min - c->samples_read)
+            n = st->min - c->samples_read;
+      } else {
+         if(n > NCO_BLOCK)
+            n = NCO_BLOCK;
+         if(n > st->block - st->n)
+            n = st->block - st->n;
+         if(n > st->timeout - c->samples_read)
+            n = st->timeout - c->samples_read;
+         nco_sincos(&c->ref, s, co, n);
+         for(int j = 0; j < n; j++) {
+            double l = in[(i+j)*channels] * (0.5 - 0.5*cos(2*M_PI*(st->n+j)/st->block));
+            st->s += l * s[j];
+            st->c += l * co[j];
+         }
+         st->n += n;
+         if(st->n == st->block)
+            settle_block(st);
+      }
+      i += n;
+      c->samples_read += n;
+      if(!st->done && c->samples_read >= st->timeout) {
+         st->done      = 1;
+         st->timed_out = 1;
+      }
+      if(st->done)
+         c->skip = c->samples_read;
+   }
+   return i;
 }
 
-static int init_cap(snd_pcm_t **snddev_cap, const char *name)
-{
-  int err;
-  snd_pcm_hw_params_t *hw_params;
+//=========================================================================================
+// Level setup looks at the left channel
+static int capture_setup(void *arg, const int16_t *in, int frames, int channels) {
+   struct capture *c = arg;
+   double s[NCO_BLOCK], co[NCO_BLOCK];
+   int i = settle_frames(c, in, frames, channels);
+   int end = c->skip+c->count;
+
+   if(!c->settle.done)
+      return 1;
+   while(i < frames && c->samples_read < end) {
+      int n = frames-i;
+      if(n > NCO_BLOCK)
+         n = NCO_BLOCK;
+      if(n > end - c->samples_read)
+         n = end - c->samples_read;
+      nco_sincos(&c->ref, s, co, n);
+      for(int j = 0; j < n; j++) {
+         int16_t l = in[(i+j)*channels];
+         c->setup_power += l * l;
+         c->setup_sin   += l * s[j];
+         c->setup_cos   += l * co[j];
+      }
+      i += n;
+      c->samples_read += n;
+   }
+   c->samples_read += frames-i;
+   return c->samples_read < end;
+}
 
-  if( name == NULL ) {
-      err = snd_pcm_open(snddev_cap, "plughw:0,0", SND_PCM_STREAM_CAPTURE, 0 );
-  } else {
-      err = snd_pcm_open(snddev_cap, name, SND_PCM_STREAM_CAPTURE, 0);
-  }
+// Every channel is kept, split into c->points[ch]
+static int capture_channels(void *arg, const int16_t *in, int frames, int channels) {
+   struct capture *c = arg;
+   int i = settle_frames(c, in, frames, channels);
+   int end = c->skip+c->count;
+   int n;
+
+   if(!c->settle.done)
+      return 1;
+   n = frames-i;
+   if(n > end - c->samples_read)
+      n = end - c->samples_read;
+   if(n > 0) {
+      double *out[MAX_CHANNELS];
+      if(c->samples_read == c->skip)
+         c->settled = stats_clock();
+      for(int ch = 0; ch < channels; ch++)
+         out[ch] = c->points[ch] + c->samples_read - c->skip;
+      c->k->deinterleave(in + i*channels, n, channels, out);
+      i += n;
+      c->samples_read += n;
+   }
+   c->samples_read += frames-i;
+   return c->samples_read < end;
+}
 
-  if( err < 0 ) {
-      printf("Init: cannot open audio playback device %s (%s)\n", name, snd_strerror(err));
+// Start the audio thread playing the setup tone. 'rate' is the desired
+// sample rate on entry, and the actual rate on return
+static int capture_open(struct capture *c, struct run_stats *stats, struct audio_thread *audio, char *device_pb, char *device_cap, int channels, unsigned int *rate, int period_size, int priority) {
+   memset(c, 0, sizeof(*c));
+   c->k     = kernels_select();
+   c->stats = stats;
+   for(int ch = 0; ch < MAX_CHANNELS; ch++) {
+      nco_init(&c->tone[ch], nco_step(1000, *rate));
+      atomic_init(&c->step[ch], c->tone[ch].step);
+   }
+   atomic_init(&c->multi_count, 0);
+   nco_init(&c->ref, c->tone[0].step);
+   if(!audio_thread_start(audio, device_pb, device_cap, channels, *rate, period_size, priority, play_tone, c))
       return 0;
-  } else {
-      printf("Audio playback device opened successfully.\n");
-  }
+   *rate = audio->io.rate;
+   return 1;
+}
 
-  if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
-      printf("Init: cannot allocate hardware parameter structure (%s)\n", snd_strerror(err));
-      return 0;
-  }
- 
-  if ((err = snd_pcm_hw_params_any (*snddev_cap, hw_params)) < 0) {
-      printf("Init: cannot initialize hardware parameter structure (%s)\n", snd_strerror (err));
-      return 0;
-  }
-
-  unsigned int resample = 1;
-  err = snd_pcm_hw_params_set_rate_resample(*snddev_cap, hw_params, resample);
-  if (err < 0) {
-      printf("Init: Resampling setup failed for playback: %s\n", snd_strerror(err));
-      return err;
-  }
-
-  // Set access to RW interleaved.
-  if ((err = snd_pcm_hw_params_set_access (*snddev_cap, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-      printf("Init: cannot set access type (%s)\n", snd_strerror (err));
-      return 0;
-  }
+struct level_point {
+   int volume_cap;
+   double signal;
+   double power;
+   double dest_db;
+};
 
-  if ((err = snd_pcm_hw_params_set_format (*snddev_cap, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-      printf("Init: cannot set sample format (%s)\n", snd_strerror (err));
-      return 0;
-  }
+// Play the setup tone at the given levels and estimate how far the
+// captured signal is from a pure sine. Returns 0 if the audio stopped
+static int measure_levels(struct capture *c, struct audio_thread *audio, char *device_pb, char *device_cap,
+                          int volume_pb, int volume_cap, int point_count, struct level_point *p) {
+   double setup_signal      = 0.0;
+   double setup_distortion  = 0.0;
 
-  // Set channels to stereo (2).
-  if ((err = snd_pcm_hw_params_set_channels (*snddev_cap, hw_params, 2)) < 0) {
-      printf("Init: cannot set channel count (%s)\n", snd_strerror (err));
+   printf("\n");
+   c->stats->calibrate_steps++;
+   SetLevels(device_pb, device_cap, volume_pb, volume_cap);
+   set_tone(c, 1000, audio->io.rate);
+   settle_start(c, audio, 1000, audio->io.rate/5);
+   c->count        = point_count;
+   c->setup_power  = 0.0;
+   c->setup_sin    = 0.0;
+   c->setup_cos    = 0.0;
+   if(!audio_thread_read(audio, capture_setup, c))
       return 0;
-  }
+   settle_report(c, audio->io.rate);
+
+   c->setup_sin    /= point_count/2;
+   c->setup_cos    /= point_count/2;
+   c->setup_power  /= point_count;
+   setup_signal  = sqrt(c->setup_sin*c->setup_sin + c->setup_cos*c->setup_cos)/sqrt(2);
+   c->setup_power   = sqrt(c->setup_power);
+   setup_distortion = c->setup_power-setup_signal;
+   p->volume_cap = volume_cap;
+   p->signal     = setup_signal;
+   p->power      = c->setup_power;
+   p->dest_db    = (log(setup_distortion)-log(c->setup_power))/log(10)*10; 
+   printf("Setup signal      %12.6f\n", setup_signal);
+   printf("Setup power       %12.6f\n", c->setup_power);
+   printf("Est distortion  %12.6f dB\n", p->dest_db);
+   return 1;
+}
 
-  // Set sample rate.
-  unsigned int actualRate = 48000;
-  if ((err = snd_pcm_hw_params_set_rate_near (*snddev_cap, hw_params, &actualRate, 0)) < 0) {
-      printf("Init: cannot set sample rate to 48000. (%s)\n", snd_strerror(err));
+// Returns 0 rather than exiting, as with -M the other pairs carry on
+static int check_signal(struct level_point *p, char *device_cap) {
+   if(!(p->dest_db <= -7.0)) {      // NaN when nothing at all comes back
+      fprintf(stderr, "%s: No signal detected. Have you got the loopback cable plugged in?\n", device_cap);
       return 0;
-  }
-  if( actualRate < desired_rate ) {
-      printf("Init: sample rate does not match requested rate. (%i)\n", actualRate);
-  }
+   }
+   return 1;
+}
 
-  if(snd_pcm_nonblock(*snddev_cap, 1) < 0) {
-      printf("Init: cannot set non-blocking (%s)\n", snd_strerror (err));
-  }
+// The capture level is too high once the input overloads, or once the
+// distortion estimate has risen more than 2dB above the best seen at a
+// lower level
+static int overloaded(struct level_point *p, struct level_point *best) {
+   if(p->power >= 30000)
+      return 1;
+   return best->volume_cap >= 0 && p->dest_db > best->dest_db+2.0;
+}
+
+// Find the highest capture level that is not overloaded. The first
+// measurement plays at 30, as the old sweep did, only to check the loopback
+// is there. After that playback is at 100, and one measurement at a low
+// capture level gives a gain estimate to aim for. The result is then
+// narrowed down by bisection to the same 2% the old sweep stepped by.
+// Results are cached per device pair, and a cached level is used after one
+// check measurement unless 'recalibrate' is set.
+#define CAL_PROBE_PB    30
+#define CAL_PLAYBACK    100
+#define CAL_START_LEVEL 10
+#define CAL_TARGET_RMS  (23170*0.7)    // about -3dBFS
+static int capture_calibrate(struct capture *c, struct audio_thread *audio, char *device_pb, char *device_cap, int point_count, int recalibrate) {
+   unsigned int actual_rate = audio->io.rate;
+   struct level_point p, best;
+   int setup_point_count = point_count;
+   int volume_pb = CAL_PLAYBACK;
+   int volume_cap;
+   int lo = 0, hi = 101;     // highest level known good, lowest known overloaded
+   int step = 0;
+
+   if(setup_point_count > actual_rate/10)
+      setup_point_count = actual_rate/10;
+
+   if(!recalibrate && levels_load(device_pb, device_cap, actual_rate, &volume_pb, &volume_cap)) {
+      printf("\nUsing cached levels, checking them\n");
+      if(!measure_levels(c, audio, device_pb, device_cap, volume_pb, volume_cap, setup_point_count, &p))
+         return 0;
+      if(p.dest_db <= -7.0 && p.power < 30000)
+         return 1;
+      printf("Cached levels no longer look right, recalibrating\n");
+      volume_pb = CAL_PLAYBACK;
+   }
 
-  if ((err = snd_pcm_hw_params (*snddev_cap, hw_params)) < 0) {
-      printf("Init: cannot set parameters (%s)\n", snd_strerror (err));
+   if(!measure_levels(c, audio, device_pb, device_cap, CAL_PROBE_PB, CAL_START_LEVEL, setup_point_count, &p))
       return 0;
-  } else {
-     printf("Audio capture device parameters have been set successfully.\n");
-  }
-
-  snd_pcm_uframes_t bufferSize;
-  snd_pcm_hw_params_get_buffer_size( hw_params, &bufferSize );
-  printf("Init: Buffer size = %lu frames.\n", bufferSize);
-  printf("Init: Significant bits for linear samples = %i\n", snd_pcm_hw_params_get_sbits(hw_params));
-  snd_pcm_hw_params_free (hw_params);
-
-  if ((err = snd_pcm_prepare(*snddev_cap)) < 0) {
-      printf("Init: cannot prepare audio capture interface for use (%s)\n", snd_strerror(err));
+   if(!check_signal(&p, device_cap))
       return 0;
-  } else {
-      printf("Audio capture device has been prepared for use.\n");
-  }
 
-  return 1;
-}
+   best.volume_cap = -1;
+   volume_cap = CAL_START_LEVEL;
+   while(hi - lo > 2) {
+      if(!measure_levels(c, audio, device_pb, device_cap, volume_pb, volume_cap, setup_point_count, &p))
+         return 0;
+      if(!check_signal(&p, device_cap))
+         return 0;
 
+      if(overloaded(&p, &best)) {
+         hi = volume_cap;
+      } else {
+         lo = volume_cap;
+         if(best.volume_cap < 0 || p.dest_db < best.dest_db)
+            best = p;
+      }
 
-static int UnInit(snd_pcm_t *snddev_pb, snd_pcm_t *snddev_cap)
-{
-  if(snddev_pb)
-    snd_pcm_close (snddev_pb);
-  if(snddev_cap)
-    snd_pcm_close (snddev_cap);
-  printf("Audio devices has been uninitialized.\n");
-  return 1;
-}
+      if(step++ == 0 && p.signal > 0) {
+         // First step, assume the captured level scales with the mixer setting
+         volume_cap = CAL_START_LEVEL*CAL_TARGET_RMS/p.signal;
+      } else {
+         volume_cap = (lo+hi)/2;
+      }
+      if(volume_cap > 100)
+         volume_cap = 100;
+      if(volume_cap <= lo || volume_cap >= hi)
+         volume_cap = (lo+hi)/2;
+   }
+   if(lo == 0)
+      lo = 1;
 
+   SetLevels(device_pb, device_cap, volume_pb, lo);
+   if(!levels_save(device_pb, device_cap, actual_rate, volume_pb, lo))
+      printf("Unable to cache the levels\n");
+   return 1;
+}
 
-struct frame_i16_stereo {
-   int16_t l;
-   int16_t r;
-};
+static void capture_close(struct capture *c, struct audio_thread *audio) {
+   audio_thread_stop(audio);
+   if(audio_thread_overruns(audio) > 0)
+      printf("Audio thread: %lu frames dropped, the analysis side fell behind\n", audio_thread_overruns(audio));
+   c->stats->xruns          += atomic_load(&audio->io.xruns);
+   c->stats->alsa_errors    += atomic_load(&audio->io.errors);
+   c->stats->idle_wakeups   += atomic_load(&audio->io.idle_wakeups);
+   c->stats->dropped_frames += audio_thread_overruns(audio);
+}
 
-static int capture_data(char *device_pb, char *device_cap, double *points, int point_count) {
+// Captures 'channels' channels into points[0..channels-1], playing
+// tone_hz[ch] on each, or every tone in 'multi' on all of them if it isn't
+// NULL. 'rate' is the desired sample rate on entry, and the actual rate on
+// return. The time of each phase is added to 'stats'
+static int capture_data(char *device_pb, char *device_cap, double **points, int channels, int point_count, const double *tone_hz,
+                        const struct tone_set *multi, unsigned int *rate, int period_size, int priority, int recalibrate, struct run_stats *stats) {
 
    assert(points != NULL);
-   snd_pcm_t *snddev_pb;
-   snd_pcm_t *snddev_cap;
+   struct audio_thread audio;
+   struct capture c;
+   double t = stats_clock();
    int rtn = 0;
-   int wp = 0;
-   int swp = 0;
-   struct frame_i16_stereo buffer_out[1024];
-   struct frame_i16_stereo buffer_in[1024];
-   int16_t *pb_samples;
-   double  *pb_sin;
-   double  *pb_cos;
-
-
-   pb_samples  = malloc(sizeof(int16_t)*desired_rate);
-   pb_sin      = malloc(sizeof(double)*desired_rate);
-   pb_cos      = malloc(sizeof(double)*desired_rate);
-   if(pb_samples == NULL || pb_sin == NULL || pb_cos == NULL) {
-      free(pb_samples);
-      free(pb_sin);
-      free(pb_cos);
-      fprintf(stderr,"Out of memory\n");
+
+   if(!capture_open(&c, stats, &audio, device_pb, device_cap, channels, rate, period_size, priority))
       return 0;
-   }
-   for(int i = 0; i < desired_rate; i++) {
-      double phase  = (i*2+1)/(desired_rate*2.0)*2.0*M_PI;
-      pb_sin[i] = sin(phase);
-      pb_cos[i] = cos(phase);
-      double s  = pb_sin[i]*3*8192;
-      if(s < 0) {
-         s -= 0.5;
-      } else {
-         s += 0.5;
-      }
-      pb_samples[i] = s;
-   }
-
-   if(init_pb(&snddev_pb, device_pb) && init_cap(&snddev_cap, device_cap)) {
-      int to_write = 0;
-      int buffer_written = 0;
-      int samples_read = 0;
-      int skip = actual_rate/5;
-      double setup_dest_db = 0.0;
-      double best_dest_db  = 0.0;
-      double setup_power   = 0.0;
-      int volume_pb = 30;
-      int volume_cap = 7;
-      int best_volume_cap = 7;
-      int setup_point_count = point_count;
-      int setup_frequency_hz = 1000;
-
-      if(setup_point_count > actual_rate/10)
-         setup_point_count = actual_rate/10;
-
-      do {
-         ///////////////////////////////////////////////////
-         //// Find Optimal volume 
-         ///////////////////////////////////////////////////
-         double setup_cos         = 0.0;
-         double setup_sin         = 0.0;
-         double setup_signal      = 0.0;
-         double setup_distortion  = 0.0;
-         if(best_dest_db > setup_dest_db-2.0) {
-            best_dest_db    = setup_dest_db;
-            best_volume_cap = volume_cap;
-         }
-	 volume_cap+=2; 
-         printf("\n");
-         SetLevels(device_pb, device_cap, volume_pb, volume_cap);
-         samples_read = 0;
-    
-         while(samples_read < skip+setup_point_count) {
-            if(to_write == 0) {
-               for(int j = 0; j < sizeof(buffer_out)/sizeof(struct frame_i16_stereo); j++) {
-                  buffer_out[j].l = pb_samples[wp];
-                  buffer_out[j].r = pb_samples[wp];
-                  wp += setup_frequency_hz;
-                  if(wp >= desired_rate) 
-                     wp -= desired_rate;
-               }
-               to_write = sizeof(buffer_out)/sizeof(struct frame_i16_stereo); 
-               buffer_written = 0;
-            }
-      
-   
-            int frames_written = snd_pcm_writei(snddev_pb, buffer_out+buffer_written, to_write);
-            if(frames_written < 0) {
-               if(frames_written != -EAGAIN) {
-                  printf("Playback error %i\n", frames_written);
-               }
-            } else {
-               to_write       -= frames_written;
-               buffer_written += frames_written;
-            }
-   
-            int frames_read = snd_pcm_readi(snddev_cap, buffer_in, sizeof(buffer_in)/sizeof(struct frame_i16_stereo));
-            if(frames_read > 0) {
-                for(int i = 0; i < frames_read; i++) {
-                   if(samples_read >= skip && samples_read < skip+setup_point_count) {
-                      setup_power += buffer_in[i].l * buffer_in[i].l;
-                      setup_sin   += buffer_in[i].l * pb_sin[swp];
-                      setup_cos   += buffer_in[i].l * pb_cos[swp];
-                      swp += setup_frequency_hz;
-                      if(swp >= desired_rate) 
-                         swp -= desired_rate;
-                   }
-                   samples_read++;
-                } 
-            }
-            usleep(5000);
-         }
-         setup_sin    /= setup_point_count/2;
-         setup_cos    /= setup_point_count/2;
-         setup_power  /= setup_point_count;
-         setup_signal  = sqrt(setup_sin*setup_sin + setup_cos*setup_cos)/sqrt(2);
-         setup_power   = sqrt(setup_power);
-         setup_distortion = setup_power-setup_signal;
-         setup_dest_db    = (log(setup_distortion)-log(setup_power))/log(10)*10; 
-         printf("Setup signal      %12.6f\n", setup_signal);
-         printf("Setup power       %12.6f\n", setup_power);
-         printf("Est distortion  %12.6f dB\n", setup_dest_db);
-         if(setup_dest_db > -7.0) { 
-           
-            fprintf(stderr, "No signal detected. Have you got the loopback cable plugged in?\n");
-            exit(5);
-         }
-         volume_pb = 100;
-      } while(setup_power < 30000 && volume_cap < 100);  // Until we have overloaded
+   stats_phase(&stats->open, &t);
 
-      SetLevels(device_pb, device_cap, volume_pb, best_volume_cap);
-       
+   if(capture_calibrate(&c, &audio, device_pb, device_cap, point_count, recalibrate)) {
+      stats_phase(&stats->calibrate, &t);
       ////////////////////////////////////////////
       //// And now the actual capture
       ////////////////////////////////////////////
-      skip = actual_rate;
-      samples_read = 0;
-      while(samples_read < skip+point_count) {
-         if(to_write == 0) {
-            for(int j = 0; j < sizeof(buffer_out)/sizeof(struct frame_i16_stereo); j++) {
-               buffer_out[j].l = pb_samples[wp];
-               buffer_out[j].r = pb_samples[wp];
-               wp += frequency_hz;
-               if(wp >= desired_rate) 
-                 wp -= desired_rate;
-            }
-            to_write = sizeof(buffer_out)/sizeof(struct frame_i16_stereo); 
-            buffer_written = 0;
-         }
-   
-
-         int frames_written = snd_pcm_writei(snddev_pb, buffer_out+buffer_written, to_write);
-         if(frames_written < 0) {
-            if(frames_written != -EAGAIN) {
-               printf("Playback error %i\n", frames_written);
-            }
-         } else {
-            to_write       -= frames_written;
-            buffer_written += frames_written;
-         }
-
-         int frames_read = snd_pcm_readi(snddev_cap, buffer_in, sizeof(buffer_in)/sizeof(struct frame_i16_stereo));
-         if(frames_read > 0) {
-             for(int i = 0; i < frames_read; i++) {
-                if(samples_read >= skip && samples_read < skip+point_count)
-                  points[samples_read - skip] = buffer_in[i].r;
-                samples_read++;
-             } 
-         }
-         usleep(5000);
+      double settle_hz = tone_hz[0];
+      if(multi != NULL)
+         settle_hz = set_multitone(&c, multi, audio.io.rate);
+      else
+         set_tones(&c, tone_hz, audio.io.rate);
+      memcpy(c.points, points, sizeof(double *)*channels);
+      settle_start(&c, &audio, settle_hz, *rate);
+      c.count        = point_count;
+      if(audio_thread_read(&audio, capture_channels, &c)) {
+         settle_report(&c, audio.io.rate);
+         rtn = 1;
       }
-      rtn = 1;
+      if(c.settled > 0.0) {
+         stats->settle += c.settled - t;
+         t = c.settled;
+      }
+      stats_phase(&stats->capture, &t);
    }
-   UnInit(snddev_pb, snddev_cap);
-   free(pb_samples);
+   capture_close(&c, &audio);
    return rtn;
 }
 
 //=========================================================================================
-#define WIDTH   3840
-#define HEIGHT  1080
-#define LEFT_MARGIN   200
-#define RIGHT_MARGIN   50
-#define TOP_MARGIN    100
-#define BOTTOM_MARGIN 100
+// Loopback latency. A maximum length sequence is played at a known
+// playback frame and found again in the capture by cross-correlation.
+// Playback and capture frames are counted from when the streams started,
+// so the difference is the time the audio spends outside the ALSA
+// buffers: the converters, their filters, and the driver and USB FIFOs.
+#define LATENCY_RUNS     3
+#define LATENCY_MAX_MS   500      // the longest delay looked for
+#define LATENCY_MIN_PEAK 0.1      // a weaker correlation is not the stimulus
+
+struct latency_run {
+   const int16_t *stimulus;
+   int length;
+   atomic_ullong played;       // frames generated, only moved by the audio thread
+   atomic_ullong start;        // playback frame the stimulus starts at, ULLONG_MAX when not armed
+
+   unsigned long long pos;     // capture frame of the next frame read
+   unsigned long long from;    // capture frame points[0] is
+   double *points;
+   int count;
+   int n;
+};
 
+static void play_stimulus(void *arg, int16_t *out, int frames, int channels) {
+   struct latency_run *r = arg;
+   unsigned long long played = atomic_load_explicit(&r->played, memory_order_relaxed);
+   unsigned long long start  = atomic_load_explicit(&r->start, memory_order_acquire);
+
+   for(int i = 0; i < frames; i++) {
+      unsigned long long f = played + i;
+      int16_t v = 0;
+      if(f >= start && f - start < (unsigned long long)r->length)
+         v = r->stimulus[f - start];
+      for(int ch = 0; ch < channels; ch++)
+         out[i*channels+ch] = v;
+   }
+   atomic_store_explicit(&r->played, played + frames, memory_order_release);
+}
 
-void plot(double *data, int count, char *bottom_text) {
-   struct image *img;
-   struct image *font;
-   double min,max;
-   int last;
+// Keeps the right channel from capture frame 'from' on
+static int capture_stimulus(void *arg, const int16_t *in, int frames, int channels) {
+   struct latency_run *r = arg;
 
-   if(count < 2)
+   for(int i = 0; i < frames && r->n < r->count; i++, r->pos++) {
+      if(r->pos >= r->from)
+         r->points[r->n++] = in[i*channels+1];
+   }
+   return r->n < r->count;
+}
+
+static void print_band_delay(struct latency *l, double low_hz, double high_hz, unsigned int rate) {
+   if(high_hz >= rate/2.0)
+      high_hz = rate/2.0*0.9;
+   if(low_hz >= high_hz)
       return;
-   min = data[0];
-   max = data[1];
-   if(max == min)
-     max += 0.1;
+   double gd = latency_group_delay(l, low_hz, high_hz, rate);
+   printf("  Group delay %5.0f - %5.0f Hz  %9.3f ms  %10.2f samples\n", low_hz, high_hz, gd*1e3/rate, gd);
+}
 
-   for(int i = 0; i < count; i++) {
-     if(min > data[i]) 
-        min = data[i];
-     if(max < data[i]) 
-        max = data[i];
-   }
-   max = 0;
-   min = -140;
-   img = image_new(WIDTH, HEIGHT);
-   if(img == NULL) {
-     printf("Out of RAM\n");
-     return;
-   }
-   font = image_from_ppm("font_ML.ppm");
-   if(font == NULL) {
-     printf("Out of RAM\n");
-     image_free(img);
-     return;
-   }
-   image_set_font(img, font);
-   image_set_colour(img, 0, 0, 0);
-   image_set_text_align(img, 0, 0);
-   image_text(img, WIDTH/2, TOP_MARGIN/2, "CODEC Loopback Frequency Spectrum");
-   image_text(img, WIDTH/2, HEIGHT-BOTTOM_MARGIN/2, bottom_text);
-   image_set_text_align(img, -1, 0);
-   int h = HEIGHT-TOP_MARGIN-BOTTOM_MARGIN;
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+0*h/7, "0dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+1*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+1*h/7, "-20dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+2*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+3*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+2*h/7, "-40dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+4*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+5*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+3*h/7, "-60dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+6*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+7*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+4*h/7, "-80dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+8*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+9*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+5*h/7, "-100dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+10*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+11*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+6*h/7, "-120dB ");
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+12*h/14, 0,0,0);
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) image_set_pixel(img, x, TOP_MARGIN+13*h/14, 0,0,0);
-   image_text(img, LEFT_MARGIN, TOP_MARGIN+7*h/7, "-140dB ");
+static int latency_data(char *device_pb, char *device_cap, unsigned int rate, int period_size, int priority, int recalibrate) {
+   struct audio_thread audio;
+   struct capture c;
+   struct run_stats stats;
+   struct latency_run r;
+   struct latency_result res[LATENCY_RUNS];
+   struct latency *l = NULL;
+   double *mls = NULL;
+   int16_t *stimulus = NULL;
+   int order = LATENCY_MLS_MIN;
+   int runs = 0, rtn = 0;
+
+   // The levels, and that there is a loopback at all, come from the usual calibration
+   memset(&stats, 0, sizeof(stats));
+   if(!capture_open(&c, &stats, &audio, device_pb, device_cap, 2, &rate, period_size, priority))
+      return 0;
+   int ok = capture_calibrate(&c, &audio, device_pb, device_cap, rate/2, recalibrate);
+   capture_close(&c, &audio);
+   if(!ok)
+      return 0;
 
-   for(int i = 0; i < count; i++) {
-     double d = data[i];
-     if(d < min) d = min;
-     if(d > max) d = max;
-     int x = (WIDTH-LEFT_MARGIN-RIGHT_MARGIN-1)*i/count+LEFT_MARGIN;
-     int y = (HEIGHT-BOTTOM_MARGIN-1)-(HEIGHT-TOP_MARGIN-BOTTOM_MARGIN-1)*(d-min)/(max-min);
-
-     if(i == 0) {
-        last = y;
-     } else {
-        if(y>last) {
-           while(last != y) {
-              image_set_pixel(img, x,last, 255,0,0);
-              last++;
-           }
-        } else {
-           while(last != y) {
-              image_set_pixel(img, x,last, 255,0,0);
-              last--;
-           } 
-        }
-     }
-   }
-
-   for(int x = LEFT_MARGIN; x < WIDTH-RIGHT_MARGIN; x++) {
-      image_set_pixel(img, x, TOP_MARGIN, 0,0,0);
-      image_set_pixel(img, x, TOP_MARGIN-1, 0,0,0);
-      image_set_pixel(img, x, HEIGHT-BOTTOM_MARGIN, 0,0,0);
-      image_set_pixel(img, x, HEIGHT-BOTTOM_MARGIN+1, 0,0,0);
-   }
-  
-   for(int y = TOP_MARGIN; y < HEIGHT-BOTTOM_MARGIN; y++) {
-      image_set_pixel(img, LEFT_MARGIN, y, 0,0,0);
-      image_set_pixel(img, LEFT_MARGIN-1, y, 0,0,0);
-      image_set_pixel(img, WIDTH-RIGHT_MARGIN, y, 0,0,0);
-      image_set_pixel(img, WIDTH-RIGHT_MARGIN+1, y, 0,0,0);
-   }
- 
-   image_write(img,"graph.ppm");
-   image_free(img);
+   // At least 1/8 s of stimulus, long enough to stand well above the noise
+   while(order < LATENCY_MLS_MAX && LATENCY_MLS_LENGTH(order) < (int)rate/8)
+      order++;
+   memset(&r, 0, sizeof(r));
+   r.length = LATENCY_MLS_LENGTH(order);
+   r.count  = r.length + rate*LATENCY_MAX_MS/1000;
+   atomic_init(&r.played, 0);
+   atomic_init(&r.start, ULLONG_MAX);
+   mls      = malloc(sizeof(double)*r.length);
+   stimulus = malloc(sizeof(int16_t)*r.length);
+   r.points = malloc(sizeof(double)*r.count);
+   if(mls == NULL || stimulus == NULL || r.points == NULL || !latency_mls(mls, order) ||
+      (l = latency_new(mls, r.length, r.count)) == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      goto done;
+   }
+   for(int i = 0; i < r.length; i++)
+      stimulus[i] = mls[i]*TONE_AMPLITUDE/2;
+   r.stimulus = stimulus;
+
+   if(!audio_thread_start(&audio, device_pb, device_cap, 2, rate, period_size, priority, play_stimulus, &r))
+      goto done;
+   printf("\nLatency, %i sample MLS (%.1f ms)\n", r.length, r.length*1e3/rate);
+   printf("  Playback period %lu frames, buffer %lu frames\n", (unsigned long)audio.io.period_size, (unsigned long)audio.io.buffer_size);
+   printf("  Capture period  %lu frames, buffer %lu frames\n", (unsigned long)audio.io.period_size_cap, (unsigned long)audio.io.buffer_size_cap);
+   if(!audio.io.linked)
+      printf("  Warning: the streams are not linked, so the result includes however far apart they started\n");
+
+   for(runs = 0; runs < LATENCY_RUNS; runs++) {
+      // Far enough ahead that none of the stimulus has been generated yet
+      unsigned long long start = atomic_load(&r.played) + audio.io.buffer_size + period_size;
+      atomic_store_explicit(&r.start, start, memory_order_release);
+      r.pos  = audio_thread_position(&audio);
+      r.from = start;
+      r.n    = 0;
+      if(r.pos > r.from) {
+         printf("Capture fell behind playback, stopping\n");
+         break;
+      }
+      if(!audio_thread_read(&audio, capture_stimulus, &r))
+         break;
+      if(atomic_load(&audio.io.xruns) > 0 || audio_thread_overruns(&audio) > 0) {
+         printf("Audio was lost during the measurement, stopping\n");
+         break;
+      }
+
+      double t = stats_clock();
+      if(!latency_find(l, r.points, &res[runs]))
+         break;
+      t = stats_clock() - t;
+      printf("  Run %i  %9.3f ms  %10.2f samples  correlation %.3f  (%.2f ms to find)\n",
+             runs+1, res[runs].delay*1e3/rate, res[runs].delay, res[runs].peak, t*1e3);
+      if(res[runs].peak < LATENCY_MIN_PEAK) {
+         printf("The stimulus was not found in the capture, is the loopback connected?\n");
+         break;
+      }
+   }
+   audio_thread_stop(&audio);
+
+   if(runs == LATENCY_RUNS) {
+      double lo = res[0].delay, hi = res[0].delay, sum = 0.0;
+      for(int i = 0; i < runs; i++) {
+         sum += res[i].delay;
+         if(res[i].delay < lo) lo = res[i].delay;
+         if(res[i].delay > hi) hi = res[i].delay;
+      }
+      double delay = sum/runs;
+      printf("\nLoopback latency  %9.3f ms  %10.2f samples  (spread %.2f samples)\n", delay*1e3/rate, delay, hi-lo);
+      // From the last run, each band against the phase of the cross spectrum
+      print_band_delay(l, 100, 1000, rate);
+      print_band_delay(l, 1000, 10000, rate);
+      print_band_delay(l, 10000, 20000, rate);
+      if(res[runs-1].inverted)
+         printf("  The loopback inverts the signal\n");
+      // What an application that keeps the playback buffer full and
+      // reads a period at a time sees, on top of the path itself
+      double round_trip = delay + audio.io.buffer_size + audio.io.period_size_cap;
+      printf("  With a full playback buffer and one capture period: %.3f ms round trip\n", round_trip*1e3/rate);
+      rtn = 1;
+   }
+
+done:
+   latency_free(l);
+   free(mls);
+   free(stimulus);
+   free(r.points);
+   return rtn;
 }
 
 //=========================================================================================
-void find_s_c(double *points, int point_count, double bin, double *st, double *ct) {
-   static double *s_table = NULL;
-   static double *c_table = NULL;
-   static int pc = 0;
-
-   if(pc != point_count) {
-      if(s_table) free(s_table);
-      if(c_table) free(c_table);
-      s_table = malloc(sizeof(double)*point_count);
-      c_table = malloc(sizeof(double)*point_count);
-      if(s_table == NULL || c_table == NULL) {
-         fprintf(stderr,"Out of memory\n");
-         exit(1);
+// Continuous monitoring, until interrupted
+static volatile sig_atomic_t monitor_stop;
+
+static void monitor_signal(int sig) {
+   monitor_stop = 1;
+}
+
+struct monitor_state {
+   struct monitor *m;
+   struct capture *c;       // for the settle detector
+   unsigned int rate;
+   int hop;
+   int since_report;
+   long samples;
+};
+
+static int capture_monitor(void *arg, const int16_t *in, int frames, int channels) {
+   struct monitor_state *s = arg;
+   double block[256];
+
+   if(!s->c->settle.done) {
+      int n = settle_frames(s->c, in, frames, channels);
+      if(!s->c->settle.done)
+         return !monitor_stop;
+      settle_report(s->c, s->rate);
+      in     += n*channels;
+      frames -= n;
+   }
+   while(frames > 0) {
+      int n = frames;
+      if(n > s->hop - s->since_report)
+         n = s->hop - s->since_report;
+      if(n > 256)
+         n = 256;
+      for(int i = 0; i < n; i++)
+         block[i] = in[i*channels+1];
+      monitor_push(s->m, block, n);
+      in     += n*channels;
+      frames -= n;
+      s->samples      += n;
+      s->since_report += n;
+
+      if(s->since_report == s->hop) {
+         struct monitor_result r;
+         s->since_report = 0;
+         if(monitor_read(s->m, &r)) {
+            printf("%10.2f s  thd+n %8.4f%%  thd %8.4f%%  fundamental %8.3f dBFS  floor %8.2f dBFS/bin\n",
+                   (double)s->samples/s->rate, r.thd_n*100, r.thd*100, r.fundamental_db, r.noise_floor_db);
+            fflush(stdout);
+         }
       }
-      for(int i = 0; i < point_count; i++) {
-         double phase = i/((float)point_count)*2*M_PI;
-         s_table[i] = sin(phase);
-         c_table[i] = cos(phase);
+   }
+   return !monitor_stop;
+}
+
+static int monitor_data(char *device_pb, char *device_cap, double frequency_hz, unsigned int rate, int period_size, int priority, int updates, int harmonics, int recalibrate) {
+   struct audio_thread audio;
+   struct capture c;
+   struct monitor_state s;
+   struct run_stats stats;
+   int rtn = 0;
+
+   memset(&stats, 0, sizeof(stats));
+   if(!capture_open(&c, &stats, &audio, device_pb, device_cap, 2, &rate, period_size, priority))
+      return 0;
+
+   if(capture_calibrate(&c, &audio, device_pb, device_cap, rate/10, recalibrate)) {
+      set_tone(&c, frequency_hz, audio.io.rate);
+      memset(&s, 0, sizeof(s));
+      s.c    = &c;
+      s.rate = rate;
+      s.hop  = rate/updates;
+      if(s.hop < 1)
+         s.hop = 1;
+      s.m = monitor_new(rate, rate/5, frequency_hz, harmonics);
+      if(s.m == NULL) {
+         fprintf(stderr,"Unable to monitor at %g Hz, the tone must be 15Hz or more\n", frequency_hz);
+      } else {
+         printf("\nMonitoring, %i updates/s over about a 0.2 s window. Ctrl-C to stop\n", updates);
+         signal(SIGINT, monitor_signal);
+         signal(SIGTERM, monitor_signal);
+         settle_start(&c, &audio, frequency_hz, rate);
+         if(audio_thread_read(&audio, capture_monitor, &s))
+            rtn = 1;
+         signal(SIGINT, SIG_DFL);
+         signal(SIGTERM, SIG_DFL);
+         monitor_free(s.m);
       }
-      pc = point_count;
-   }
-
-   double s = 0.0;
-   double c = 0.0;
-   double t = 0.0;
-   int index = 0;
-   for(int i = 0; i < point_count; i++) {
-      s += points[i] * s_table[index];
-      c += points[i] * c_table[index];
-      t += points[i];
-      index += bin;
-      if(index >= point_count)
-        index -= point_count;
-   }
-   if(bin == 0) {
-      *st = s/(point_count);
-      *ct = c/(point_count);
-   } else {
-      *st = s/(point_count/2.0);
-      *ct = c/(point_count/2.0);
    }
+   capture_close(&c, &audio);
+   return rtn;
 }
 
-double calc_rms(double *points, int point_count) {
-   int i;
-   double rms = 0.0;
-   for(i = 0; i < point_count; i++) {
-      rms += (points[i]*points[i]);
+//=========================================================================================
+// Writes the graph, timing the drawing and the write separately
+static void plot_timed(const double *data, int count, char *bottom_text, char *filename, struct run_stats *stats) {
+   double t = stats_clock();
+   struct image *img = plot_image(data, count, bottom_text);
+
+   if(img == NULL)
+      return;
+   stats_phase(&stats->plot, &t);
+   image_write(img, filename);
+   image_free(img);
+   stats_phase(&stats->write, &t);
+}
+
+static void report_analysis(struct ad_context *ctx, const struct ad_result *res, struct run_stats *stats) {
+   int bins;
+   const double *spectrum = ad_spectrum(ctx, &bins);
+
+   printf("\n");
+   printf("signal = %10.2f  %8.3f dB\n",res->signal, res->signal_db);
+   printf("thd+n  = %10.2f  (%7.3f%%)\n",res->rms, res->thd_n*100);
+   printf("s:n    = %10.2f dB\n",res->thd_n_db);
+
+   char text[100]; 
+   sprintf(text,"thd+n %7.4f%%, peak %4.2f Hz", res->thd_n*100, res->peak_hz);
+   plot_timed(spectrum, bins, text, "graph.png", stats);
+}
+
+static int report_harmonics(const struct ad_result *res) {
+   const struct ad_harmonic *h = res->harmonics;
+
+   if(res->harmonic_count == 0) {
+      fprintf(stderr,"Fundamental is above Nyquist\n");
+      return 0;
+   }
+
+   printf("\n");
+   for(int k = 0; k < res->harmonic_count; k++) {
+      double rel = h[k].level_db - h[0].level_db;
+      printf("H%-2i %9.2f Hz  %10.2f  %8.3f dBFS  %8.3f dBc  %7.2f deg\n", k+1, h[k].hz,
+             h[k].level, h[k].level_db, rel, h[k].phase*180/M_PI);
    }
-   rms /= point_count;
-   return sqrt(rms);
+   printf("thd    = %10.4f%%  (%8.3f dB)\n", res->thd*100, res->thd_db);
+   return 1;
 }
 
-void remove_bin(double *points, int point_count, double bin, double st, double ct) {
-   int i;
-   for(i = 0; i < point_count; i++) {
-      double phase = i*bin/((double)point_count)*2*M_PI;
-      double f = st*sin(phase) + ct*cos(phase);
-      points[i] -= f;
+// One line per channel, then with 'crosstalk' how much of each channel's
+// tone turns up on the others
+static void report_channels(struct channel_result *results, int channels, const double *tones, int harmonics, int crosstalk) {
+   printf("\n");
+   for(int ch = 0; ch < channels; ch++) {
+      struct analysis_result *res = &results[ch].res;
+      printf("ch%i  signal %8.3f dB  thd+n %8.4f%% (%8.3f dB)", ch+1, res->signal_db,
+             res->rms/res->signal*100, log(res->rms/res->signal)/log(10)*20);
+      if(harmonics > 0)
+         printf("  thd %8.4f%% (%8.3f dB)", results[ch].thd*100, log(results[ch].thd)/log(10)*20);
+      printf("  peak %8.2f Hz\n", res->peak_hz);
+   }
+   if(!crosstalk)
+      return;
+
+   printf("\nCrosstalk, dB relative to the driving channel\n    from");
+   for(int k = 0; k < channels; k++)
+      printf("  %6.0fHz", tones[k]);
+   printf("\n");
+   for(int j = 0; j < channels; j++) {
+      printf("to ch%i  ", j+1);
+      for(int k = 0; k < channels; k++) {
+         if(j == k)
+            printf("  %8s", "-");
+         else
+            printf("  %8.2f", results[j].level_db[k] - results[k].level_db[k]);
+      }
+      printf("\n");
    }
 }
 
-double *signal;
+// The single channel analysis, through the library API. Fills in 'm'
+// and the analysis phases of 'stats'
+static int analyse_one(double *points, int point_count, unsigned int rate, int notch_mode, int use_float, int harmonics, int plot_graph, double frequency_hz,
+                       struct run_stats *stats, struct run_measurement *m) {
+   struct ad_config cfg;
+   struct ad_context *ctx;
+   struct ad_result res;
+   struct ad_timing timing;
+   int rtn = 0;
 
-void window(double *points, int point_count) {
-   for(int i = 0;i < point_count; i++) {
-      points[i] *=  0.42 - 0.5 * cos(2*M_PI*i/point_count) + 0.08 * cos(4*M_PI*i/point_count);
+   memset(&cfg, 0, sizeof(cfg));
+   cfg.point_count  = point_count;
+   cfg.rate         = rate;
+   cfg.notch_mode   = notch_mode;
+   cfg.use_float    = use_float;
+   cfg.harmonics    = harmonics;
+   cfg.frequency_hz = frequency_hz;
+   cfg.threads      = 0;
+   ctx = ad_new(&cfg);
+   if(ctx == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      return 3;
    }
+   memset(&timing, 0, sizeof(timing));
+   ad_set_timing(ctx, &timing);
+   double t = stats_clock();
+   if(harmonics > 0 && !plot_graph) {
+      // Just the Goertzel filters, no FFT
+      ad_harmonics(ctx, points, &res);
+      stats_phase(&stats->analysis, &t);
+      if(!report_harmonics(&res))
+         rtn = 3;
+   } else {
+      printf("\nAnalysing captured data...\n");
+      if(!ad_analyze(ctx, points, &res)) {
+         fprintf(stderr,"Analysis failed\n");
+         rtn = 3;
+      } else {
+         stats_phase(&stats->analysis, &t);
+         m->analysed = 1;
+         if(harmonics > 0 && !report_harmonics(&res))
+            rtn = 3;
+         report_analysis(ctx, &res, stats);
+      }
+   }
+   stats->harmonics += timing.harmonics;
+   stats->window    += timing.window;
+   stats->spectrum  += timing.spectrum;
+   stats->notch     += timing.notch;
+   stats->rms       += timing.rms;
+
+   m->ok        = rtn == 0;
+   m->peak_hz   = res.peak_hz;
+   m->signal_db = res.signal_db;
+   m->thd_n_db  = res.thd_n_db;
+   m->harmonics = res.harmonic_count;
+   m->thd_db    = res.thd_db;
+   ad_free(ctx);
+   return rtn;
 }
 
-int analyze(double *points, int point_count, double max_rms) {
-   int i = 0; double st,ct;
-   double rms = 0.0;
+// The analysis is timed as a whole, and one measurement filled in per channel
+static int analyse_channels(double **points, int channels, int point_count, unsigned int rate, int notch_mode, int use_float,
+                            int harmonics, int plot_graph, int crosstalk, const double *tones,
+                            struct run_stats *stats, struct run_measurement *m) {
+   struct multichannel_options mopt;
+   struct channel_result results[MAX_CHANNELS];
+   struct pool *pool;
+   int rtn = 0;
 
-   printf("\nAnalysing captured data...\n");
-   signal = malloc(sizeof(double)*point_count/2);
+   memset(&mopt, 0, sizeof(mopt));
+   mopt.notch_mode = notch_mode;
+   mopt.use_float  = use_float;
+   mopt.harmonics  = harmonics;
+   mopt.plot       = harmonics == 0 || plot_graph;
+   mopt.crosstalk  = crosstalk;
+   mopt.tone_hz    = tones;
+   printf("\nAnalysing %i channels...\n", channels);
+   double t = stats_clock();
+   pool = pool_new(0);
+   if(multichannel_run(points, channels, point_count, rate, &mopt, pool, results) > 0) {
+      fprintf(stderr,"Out of memory\n");
+      rtn = 3;
+   } else {
+      stats_phase(&stats->analysis, &t);
+      report_channels(results, channels, tones, harmonics, crosstalk);
+      for(int ch = 0; ch < channels; ch++) {
+         struct analysis_result *res = &results[ch].res;
+         m[ch].ok        = results[ch].ok;
+         m[ch].analysed  = 1;
+         m[ch].peak_hz   = res->peak_hz;
+         m[ch].signal_db = res->signal_db;
+         m[ch].thd_n_db  = log10(res->rms/res->signal)*20;
+         m[ch].harmonics = harmonics;
+         m[ch].thd_db    = log10(results[ch].thd)*20;
+      }
+   }
+   pool_free(pool);
+   return rtn;
+}
+
+// -t: every tone, each product and the noise, from one FFT
+static int analyse_multitone(double *points, int point_count, unsigned int rate, const double *tone_hz, int tone_count, int order,
+                             int plot_graph, struct run_stats *stats, struct run_measurement *m) {
+   struct multitone *mt;
+   struct multitone_result res;
+   char name[64];
 
-   if(signal == NULL) {
+   mt = multitone_new(point_count, rate);
+   if(mt == NULL) {
       fprintf(stderr,"Out of memory\n");
-      return 0;
+      return 3;
    }
+   printf("\nAnalysing %i tones, products up to order %i...\n", tone_count, order);
+   double t = stats_clock();
+   if(!multitone_run(mt, points, tone_hz, tone_count, order, &res)) {
+      fprintf(stderr,"Analysis failed\n");
+      multitone_free(mt);
+      return 3;
+   }
+   stats_phase(&stats->analysis, &t);
 
-#if 0
-   printf("Removing bins below 20 Hz.\n");
-   for(i = 0; i < 20*point_count/actual_rate; i++) {
-      find_s_c(points, point_count, i, &st, &ct);
-      remove_tone(points, point_count, i, st, ct, &rms);
+   printf("\n");
+   for(int i = 0; i < res.tone_count; i++)
+      printf("f%-10i %10.2f Hz  %8.3f dBFS\n", i+1, res.tone[i].hz, res.tone[i].level_db);
+   for(int j = 0; j < res.product_count; j++) {
+      const struct multitone_product *p = &res.product[j];
+      multitone_name(p, res.tone_count, name, sizeof(name));
+      printf("%-11s %10.2f Hz  %8.3f dBFS  %8.3f dBc\n", name, p->hz, p->level_db, log10(p->level/res.signal)*20);
+   }
+   double total = sqrt(res.harmonics*res.harmonics + res.imd*res.imd + res.noise*res.noise);
+   printf("\n");
+   printf("tones     = %10.2f  %8.3f dBFS\n", res.signal, log10(res.signal*sqrt(2)/32767)*20);
+   printf("harmonics = %10.2f  (%7.4f%%)  %8.3f dB\n", res.harmonics, res.harmonics/res.signal*100, log10(res.harmonics/res.signal)*20);
+   printf("imd       = %10.2f  (%7.4f%%)  %8.3f dB\n", res.imd, res.imd/res.signal*100, log10(res.imd/res.signal)*20);
+   printf("noise     = %10.2f  (%7.4f%%)  %8.3f dB\n", res.noise, res.noise/res.signal*100, log10(res.noise/res.signal)*20);
+   printf("total     = %10.2f  (%7.4f%%)  %8.3f dB\n", total, total/res.signal*100, log10(total/res.signal)*20);
+
+   if(plot_graph) {
+      char text[100];
+      sprintf(text,"%i tones, imd %7.4f%%, total %7.4f%%", res.tone_count, res.imd/res.signal*100, total/res.signal*100);
+      plot_timed(multitone_signal(mt), multitone_bins(mt), text, "graph.png", stats);
    }
 
-   printf("Removing bins above 20 kHz.\n");
-   for(i = 20000*point_count/actual_rate; i < point_count/2;  i++) {
-      find_s_c(points, point_count, i, &st, &ct);
-      remove_tone(points, point_count, i, st, ct, &rms);
+   m->ok        = 1;
+   m->analysed  = 1;
+   m->peak_hz   = res.tone[0].hz;
+   m->signal_db = log10(res.signal*sqrt(2)/32767)*20;
+   m->thd_n_db  = log10(total/res.signal)*20;
+   m->harmonics = res.harmonics > 0 ? order : 0;     // none below Nyquist for CCIF
+   m->thd_db    = log10(res.harmonics/res.signal)*20;
+   m->tones     = res.tone_count;
+   m->imd_db    = log10(res.imd/res.signal)*20;
+   m->noise_db  = log10(res.noise/res.signal)*20;
+   multitone_free(mt);
+   return 0;
+}
+
+//=========================================================================================
+// Several device pairs at once. Each station captures on its own thread,
+// with its own audio thread, then analyses on the shared pool. pool_for()
+// takes one caller at a time, so however many stations there are the
+// analysis never uses more threads than the pool has.
+struct station_options {
+   int point_count;
+   double frequency_hz;
+   unsigned int rate;
+   int period_size;
+   int priority;
+   int recalibrate;
+   int notch_mode;
+   int use_float;
+   int harmonics;
+   int plot;
+   const char *json_path;
+   struct pool *pool;
+};
+
+struct station {
+   const struct station_options *opt;
+   char *device_pb;
+   char *device_cap;
+   int index;
+   pthread_t thread;
+
+   int ok;
+   unsigned int rate;
+   struct analysis_result res;
+   double thd;
+   struct run_stats stats;
+};
+
+static void *station_run(void *arg) {
+   struct station *st = arg;
+   const struct station_options *opt = st->opt;
+   double *points[2], tones[MAX_CHANNELS];
+   struct analysis_timing timing;
+   struct analysis *a = NULL;
+   float *points_f = NULL;
+   int n = opt->point_count;
+
+   st->stats.start = stats_clock();
+   for(int ch = 0; ch < MAX_CHANNELS; ch++)
+      tones[ch] = opt->frequency_hz;
+   st->rate  = opt->rate;
+   points[0] = malloc(sizeof(double)*n);
+   points[1] = malloc(sizeof(double)*n);
+   if(points[0] == NULL || points[1] == NULL)
+      goto done;
+   if(!capture_data(st->device_pb, st->device_cap, points, 2, n, tones, NULL, &st->rate, opt->period_size, opt->priority, opt->recalibrate, &st->stats))
+      goto done;
+
+   if(opt->use_float) {
+      a        = analysis_new_float(n, st->rate, opt->pool);
+      points_f = malloc(sizeof(float)*n);
+      if(a == NULL || points_f == NULL)
+         goto done;
+   } else {
+      a = analysis_new(n, st->rate, opt->pool);
+      if(a == NULL)
+         goto done;
    }
-#endif
+   analysis_set_notch(a, opt->notch_mode);
+   memset(&timing, 0, sizeof(timing));
+   analysis_set_timing(a, &timing);
+   double t = stats_clock();
+   if(opt->harmonics > 0) {
+      struct harmonic h[MAX_HARMONICS];
+      analysis_harmonics(a, points[1], opt->frequency_hz, opt->harmonics, h, &st->thd);
+      stats_phase(&st->stats.harmonics, &t);
+   }
+   if(opt->use_float) {
+      for(int i = 0; i < n; i++)
+         points_f[i] = points[1][i];
+      analysis_window_float(a, points_f);
+      st->ok = analysis_run_float(a, points_f, &st->res);
+   } else {
+      analysis_window(a, points[1]);
+      st->ok = analysis_run(a, points[1], &st->res);
+   }
+   stats_phase(&st->stats.analysis, &t);
+   st->stats.analysis += st->stats.harmonics;
+   st->stats.window    = timing.window;
+   st->stats.spectrum  = timing.spectrum;
+   st->stats.notch     = timing.notch;
+   st->stats.rms       = timing.rms;
+   if(st->ok && opt->plot) {
+      char name[32], text[100];
+      sprintf(name, "graph_dev%i.png", st->index+1);
+      sprintf(text,"%s thd+n %7.4f%%, peak %4.2f Hz", st->device_cap, st->res.rms/st->res.signal*100, st->res.peak_hz);
+      plot_timed(analysis_signal(a), analysis_bins(a), text, name, &st->stats);
+   }
+
+done:
+   analysis_free(a);
+   free(points_f);
+   free(points[0]);
+   free(points[1]);
+   st->stats.total = stats_clock() - st->stats.start;
+   return NULL;
+}
+
+// 'devices' holds playback and capture device names in pairs
+static int run_stations(char **devices, int count, struct station_options *opt) {
+   struct station *stations;
+   int failed = 0;
 
-   for(i = 0;i < point_count/2; i++) {
-      find_s_c(points, point_count, i, &st, &ct);
-      signal[i] = log(sqrt(st*st+ct*ct)/max_rms)/log(10)*20;
+   stations = calloc(count, sizeof(struct station));
+   if(stations == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      return 3;
    }
+   opt->pool = pool_new(0);
+   for(int i = 0; i < count; i++) {
+      stations[i].opt        = opt;
+      stations[i].device_pb  = devices[2*i];
+      stations[i].device_cap = devices[2*i+1];
+      stations[i].index      = i;
+      if(pthread_create(&stations[i].thread, NULL, station_run, &stations[i]) != 0) {
+         fprintf(stderr,"Unable to start a thread for %s %s\n", devices[2*i], devices[2*i+1]);
+         count = i;
+         failed = 1;
+         break;
+      }
+   }
+   for(int i = 0; i < count; i++)
+      pthread_join(stations[i].thread, NULL);
 
-   int max_bin = 0;
-   for(i = 0;i < point_count/2; i++) { 
-      if(signal[i] > signal[max_bin]) {
-         max_bin = i;
+   printf("\n");
+   for(int i = 0; i < count; i++) {
+      struct station *st = &stations[i];
+      printf("dev%-2i %-12s %-12s ", i+1, st->device_pb, st->device_cap);
+      if(!st->ok) {
+         printf("failed\n");
+         failed = 1;
+         continue;
       }
+      printf("%6u Hz  signal %8.3f dB  thd+n %8.4f%% (%8.3f dB)", st->rate, st->res.signal_db,
+             st->res.rms/st->res.signal*100, log(st->res.rms/st->res.signal)/log(10)*20);
+      if(opt->harmonics > 0)
+         printf("  thd %8.4f%% (%8.3f dB)", st->thd*100, log(st->thd)/log(10)*20);
+      printf("  peak %8.2f Hz\n", st->res.peak_hz);
+   }
+   for(int i = 0; opt->json_path != NULL && i < count; i++) {
+      struct station *st = &stations[i];
+      struct run_measurement m;
+
+      memset(&m, 0, sizeof(m));
+      m.device_pb   = st->device_pb;
+      m.device_cap  = st->device_cap;
+      m.channel     = 2;
+      m.rate        = st->rate;
+      m.point_count = opt->point_count;
+      m.ok          = st->ok;
+      m.analysed    = 1;
+      m.peak_hz     = st->res.peak_hz;
+      m.signal_db   = st->res.signal_db;
+      m.thd_n_db    = log10(st->res.rms/st->res.signal)*20;
+      m.harmonics   = opt->harmonics;
+      m.thd_db      = log10(st->thd)*20;
+      stats_write(opt->json_path, &st->stats, &m);
    }
+   pool_free(opt->pool);
+   free(stations);
+   return failed ? 3 : 0;
+}
+
+static void usage(char *name) {
+   fprintf(stderr,"Usage: %s [-H harmonics] [-p] [-f] [-F] [-m updates] [-C] [-T hz] [-t hz[:weight],...] [-r rate] [-c channels] [-X] [-L] [-P period] [-R priority] [-i file] [-j file] [playback_device [capture_device]]\n", name);
+   fprintf(stderr,"       %s -M [options] playback_device capture_device [playback_device capture_device ...]\n", name);
+   fprintf(stderr,"       %s -b [-o results.csv|results.json] [-H harmonics] [-p] [-f] [-F] [-r rate] file|directory|- ...\n", name);
+   fprintf(stderr,"  -H n   Only measure the fundamental and harmonics H2..Hn (THD, not THD+N)\n");
+   fprintf(stderr,"  -p     With -H, also run the full analysis and write the graph\n");
+   fprintf(stderr,"  -f     Remove the fundamental with a sine fit rather than a 100Hz wide notch\n");
+   fprintf(stderr,"  -F     Run the spectrum and notch on float rather than double samples\n");
+   fprintf(stderr,"  -m n   Keep the tone playing and report THD+N n times a second until interrupted\n");
+   fprintf(stderr,"  -T hz  Test tone frequency, need not be a whole number (default 1000)\n");
+   fprintf(stderr,"  -t l   Play 2 to %i tones at once, e.g. 60:4,7000 for SMPTE IMD, and report each tone,\n", MULTITONE_MAX_TONES);
+   fprintf(stderr,"         the harmonics and IMD products up to the -H order (default 3, at most %i) and the noise\n", MULTITONE_MAX_ORDER);
+   fprintf(stderr,"  -r n   Sample rate (default 48000), also used for raw files with -i and -b\n");
+   fprintf(stderr,"  -c n   Capture and analyse n channels (2 to %i) at once, rather than the right channel\n", MAX_CHANNELS);
+   fprintf(stderr,"  -X     Play a different tone on each channel and report the crosstalk between them\n");
+   fprintf(stderr,"  -L     Measure the loopback latency and group delay rather than the distortion\n");
+   fprintf(stderr,"  -M     Test every playback/capture device pair given, all at once\n");
+   fprintf(stderr,"  -j f   Append a JSON record of the result, the time of each phase and the audio errors to f (- for stdout)\n");
+   fprintf(stderr,"  -C     Recalibrate the levels even if they are cached for these devices\n");
+   fprintf(stderr,"  -P n   ALSA period size in frames (default 1024), the buffer holds 4 periods\n");
+   fprintf(stderr,"  -R n   SCHED_FIFO priority for the audio thread (default 50, 0 for normal scheduling)\n");
+}
 
-   double s = 0.0;
-   int notch_width = 50.0/(actual_rate/point_count);
-   for(int bin = max_bin-notch_width; bin < max_bin+notch_width; bin++) {
-      if(bin >= 0 && bin <= point_count/2) {
-         find_s_c(points, point_count, bin, &st, &ct);
-         remove_bin(points, point_count, bin, st, ct);
-         s += sqrt(st*st+ct*ct)/sqrt(2);
-      } 
+// "hz[:weight],hz[:weight],..." for -t, the weights are relative amplitudes
+static int parse_tones(const char *arg, struct tone_set *ts) {
+   const char *p = arg;
+   char *end;
+
+   ts->count = 0;
+   while(*p != '\0') {
+      if(ts->count == MULTITONE_MAX_TONES)
+         return 0;
+      ts->hz[ts->count]     = strtod(p, &end);
+      ts->weight[ts->count] = 1.0;
+      if(end == p || ts->hz[ts->count] <= 0)
+         return 0;
+      p = end;
+      if(*p == ':') {
+         ts->weight[ts->count] = strtod(p+1, &end);
+         if(end == p+1 || ts->weight[ts->count] <= 0)
+            return 0;
+         p = end;
+      }
+      ts->count++;
+      if(*p == ',')
+         p++;
+      else if(*p != '\0')
+         return 0;
    }
+   return ts->count >= 2;
+}
 
-   printf("\n");
-   rms = calc_rms(points,point_count);
-   printf("signal = %10.2f  %8.3f dB\n",s, signal[max_bin]);
-   printf("thd+n  = %10.2f  (%7.3f%%)\n",rms, rms/s*100);
-   printf("s:n    = %10.2f dB\n",log(rms/s*rms/s)/log(10)*10);
+static int tones_below_nyquist(const double *tones, int channels, const struct tone_set *multi, unsigned int rate) {
+   int ok = tones[channels-1] < rate/2.0;
 
-   char text[100]; 
-   sprintf(text,"thd+n %7.4f%%, peak %4.2f Hz", rms/s*100, (double)max_bin * actual_rate/point_count );
-   plot(signal, point_count/2, text);
-   free(signal);
-   return 0;
+   for(int t = 0; t < multi->count; t++)
+      if(multi->hz[t] >= rate/2.0)
+         ok = 0;
+   if(!ok)
+      fprintf(stderr,"Tone frequency must be below half the %u Hz sample rate\n", rate);
+   return ok;
+}
+
+static int run_batch(char **paths, int count, char *output_path, int notch_mode, int use_float, unsigned int rate, int harmonics, double frequency_hz, int plot_graph) {
+   struct batch_options opt;
+   struct pool *pool;
+   int failed;
+
+   if(count == 0) {
+      fprintf(stderr,"No capture files given\n");
+      return 1;
+   }
+   memset(&opt, 0, sizeof(opt));
+   opt.notch_mode   = notch_mode;
+   opt.use_float    = use_float;
+   opt.raw_rate     = rate;
+   opt.harmonics    = harmonics;
+   opt.frequency_hz = frequency_hz;
+   opt.plot         = plot_graph;
+   opt.out          = stdout;
+   if(output_path != NULL) {
+      const char *ext = strrchr(output_path, '.');
+      opt.json = ext != NULL && strcmp(ext, ".json") == 0;
+      opt.out  = fopen(output_path, "w");
+      if(opt.out == NULL) {
+         fprintf(stderr,"Unable to create %s\n", output_path);
+         return 3;
+      }
+   }
+
+   pool   = pool_new(0);
+   failed = batch_run(paths, count, &opt, pool);
+   pool_free(pool);
+   if(opt.out != stdout)
+      fclose(opt.out);
+   return failed ? 4 : 0;
 }
 
 int main( int argc, char *argv[] )
@@ -707,29 +1354,272 @@ int main( int argc, char *argv[] )
    char *device_pb   = "hw:0";
    char *device_cap  = "hw:0";
    int points_to_cap = 24000;
+   double frequency_hz = 1000;
+   unsigned int rate = 48000;
+   int harmonics     = 0;
+   int plot_graph    = 0;
+   int notch_mode    = ANALYSIS_NOTCH_BAND;
+   int period_size   = 1024;
+   int priority      = 50;
+   int updates       = 0;
+   int recalibrate   = 0;
+   char *input_path  = NULL;
+   int batch         = 0;
+   char *output_path = NULL;
+   int use_float     = 0;
+   int channels      = 2;
+   int multichannel  = 0;
+   int crosstalk     = 0;
+   int stations      = 0;
+   int latency       = 0;
+   struct tone_set multi;
+   char *json_path   = NULL;
+   struct run_stats stats;
+   double tones[MAX_CHANNELS];
+   int rtn = 0;
+   int opt;
+
+   memset(&multi, 0, sizeof(multi));
+   while((opt = getopt(argc, argv, "H:pfFm:CP:R:i:bo:T:t:r:c:XMLj:")) != -1) {
+      switch(opt) {
+         case 'H':
+            harmonics = atoi(optarg);
+            if(harmonics < 1 || harmonics > MAX_HARMONICS) {
+               fprintf(stderr,"Harmonic count must be between 1 and %i\n", MAX_HARMONICS);
+               return 1;
+            }
+            break;
+         case 'p':
+            plot_graph = 1;
+            break;
+         case 'f':
+            notch_mode = ANALYSIS_NOTCH_FIT;
+            break;
+         case 'F':
+            use_float = 1;
+            break;
+         case 'm':
+            updates = atoi(optarg);
+            if(updates < 1 || updates > 1000) {
+               fprintf(stderr,"Updates per second must be between 1 and 1000\n");
+               return 1;
+            }
+            break;
+         case 'C':
+            recalibrate = 1;
+            break;
+         case 'P':
+            period_size = atoi(optarg);
+            if(period_size < 16) {
+               fprintf(stderr,"Period size is too small\n");
+               return 1;
+            }
+            break;
+         case 'R':
+            priority = atoi(optarg);
+            break;
+         case 'i':
+            input_path = optarg;
+            break;
+         case 'b':
+            batch = 1;
+            break;
+         case 'T':
+            frequency_hz = atof(optarg);
+            if(frequency_hz <= 0) {
+               fprintf(stderr,"Tone frequency must be above 0Hz\n");
+               return 1;
+            }
+            break;
+         case 't':
+            if(!parse_tones(optarg, &multi)) {
+               fprintf(stderr,"-t needs 2 to %i tones, as hz[:weight],hz[:weight],...\n", MULTITONE_MAX_TONES);
+               return 1;
+            }
+            break;
+         case 'r':
+            rate = atoi(optarg);
+            if(rate < 8000 || rate > 768000) {
+               fprintf(stderr,"Sample rate must be between 8000 and 768000\n");
+               return 1;
+            }
+            break;
+         case 'o':
+            output_path = optarg;
+            break;
+         case 'c':
+            channels = atoi(optarg);
+            if(channels < 2 || channels > MAX_CHANNELS) {
+               fprintf(stderr,"Channel count must be between 2 and %i\n", MAX_CHANNELS);
+               return 1;
+            }
+            multichannel = 1;
+            break;
+         case 'X':
+            crosstalk    = 1;
+            multichannel = 1;
+            break;
+         case 'M':
+            stations = 1;
+            break;
+         case 'L':
+            latency = 1;
+            break;
+         case 'j':
+            json_path = optarg;
+            break;
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
+   // With -X each channel gets its own tone, spaced so none is a harmonic of another
+   for(int ch = 0; ch < MAX_CHANNELS; ch++)
+      tones[ch] = crosstalk ? frequency_hz*(1+ch*CROSSTALK_SPACING) : frequency_hz;
+   // A capture file brings its own rate, and with -b each file does
+   if(input_path == NULL && !batch && !tones_below_nyquist(tones, channels, &multi, rate))
+      return 1;
+   points_to_cap = rate/2;     // Half a second of capture, whatever the rate
+   if(batch && multichannel) {
+      fprintf(stderr,"-c and -X work on one capture, they can't be used with -b\n");
+      return 1;
+   }
+   if(multi.count > 0 && (batch || multichannel || stations || updates > 0 || latency)) {
+      fprintf(stderr,"-t plays every tone on every channel, it can't be used with -b, -c, -X, -M, -m or -L\n");
+      return 1;
+   }
+   if(multi.count > 0 && harmonics > MULTITONE_MAX_ORDER) {
+      fprintf(stderr,"With -t, -H is the highest product order, at most %i\n", MULTITONE_MAX_ORDER);
+      return 1;
+   }
+   if(latency && (batch || multichannel || stations || updates > 0 || input_path != NULL)) {
+      fprintf(stderr,"-L can't be used with -b, -c, -X, -M, -m or -i\n");
+      return 1;
+   }
+   if(stations) {
+      struct station_options sopt;
+      int pairs = argc - optind;
 
-   double *points;
-   points = malloc(sizeof(double)*points_to_cap);
-   if(points == NULL) {
-      fprintf(stderr,"Out of memory\n");
-      return 3;
+      if(pairs < 2 || pairs % 2 != 0) {
+         fprintf(stderr,"-M needs playback and capture devices in pairs\n");
+         return 1;
+      }
+      if(batch || multichannel || updates > 0 || input_path != NULL) {
+         fprintf(stderr,"-M can't be used with -b, -c, -X, -m or -i\n");
+         return 1;
+      }
+      memset(&sopt, 0, sizeof(sopt));
+      sopt.point_count  = points_to_cap;
+      sopt.frequency_hz = frequency_hz;
+      sopt.rate         = rate;
+      sopt.period_size  = period_size;
+      sopt.priority     = priority;
+      sopt.recalibrate  = recalibrate;
+      sopt.notch_mode   = notch_mode;
+      sopt.use_float    = use_float;
+      sopt.harmonics    = harmonics;
+      sopt.plot         = harmonics == 0 || plot_graph;
+      sopt.json_path    = json_path;
+      return run_stations(argv+optind, pairs/2, &sopt);
    }
-   for(int i = 0; i < points_to_cap; i++) {
-     points[i] = 32767;
+   if(batch)
+      return run_batch(argv+optind, argc-optind, output_path, notch_mode, use_float, rate, harmonics, frequency_hz, plot_graph);
+   if(argc - optind > 2) {
+      usage(argv[0]);
+      return 1;
    }
-   window(points, points_to_cap);
-   double max_rms = calc_rms(points,points_to_cap);
-   printf("Max RMS %f\n",max_rms);
-   
 
-   if(argc >= 2) device_pb = argv[1];
-   if(argc == 3) device_cap = argv[2];
+   if(argc - optind >= 1) device_pb  = argv[optind];
+   if(argc - optind == 2) device_cap = argv[optind+1];
 
-   if(!capture_data(device_pb, device_cap, points, points_to_cap))
-      return 3;
+   if(updates > 0 && input_path != NULL) {
+      fprintf(stderr,"-m needs live devices, it can't be used with -i\n");
+      return 1;
+   }
+   if(updates > 0 && multichannel) {
+      fprintf(stderr,"-m follows one channel, it can't be used with -c or -X\n");
+      return 1;
+   }
+   if(latency)
+      return latency_data(device_pb, device_cap, rate, period_size, priority, recalibrate) ? 0 : 3;
+   if(updates > 0) {
+      if(!monitor_data(device_pb, device_cap, frequency_hz, rate, period_size, priority, updates, harmonics > 0 ? harmonics : 10, recalibrate))
+         return 3;
+      return 0;
+   }
 
-   window(points, points_to_cap);
-   analyze(points, points_to_cap, max_rms);
-   free(points);
-   return 0;
+   memset(&stats, 0, sizeof(stats));
+   stats.start = stats_clock();
+
+   struct input_file input;
+   if(input_path != NULL) {
+      if(!input_open(&input, input_path, rate))
+         return 3;
+      rate          = input.rate;
+      points_to_cap = fft_size_below(input.frames < INT_MAX ? input.frames : INT_MAX);
+      printf("%s: %li frames, %i channels, %i bit, %u Hz\n", input_path, input.frames, input.channels, input.bits, input.rate);
+      if(points_to_cap < input.frames)
+         printf("Analysing the first %i frames, a length the FFT can do quickly\n", points_to_cap);
+      if(!tones_below_nyquist(tones, channels, &multi, rate)) {
+         input_close(&input);
+         return 1;
+      }
+      if(multichannel && input.channels < channels) {
+         fprintf(stderr,"%s has only %i channels\n", input_path, input.channels);
+         input_close(&input);
+         return 3;
+      }
+   }
+
+   double *points[MAX_CHANNELS];
+   int ok = 1;
+   memset(points, 0, sizeof(points));
+   for(int ch = 0; ch < channels; ch++) {
+      points[ch] = malloc(sizeof(double)*points_to_cap);
+      if(points[ch] == NULL)
+         ok = 0;
+   }
+   if(!ok) {
+      fprintf(stderr,"Out of memory\n");
+      rtn = 3;
+   } else if(input_path != NULL) {
+      double t = stats_clock();
+      if(multichannel) {
+         for(int ch = 0; ch < channels; ch++)
+            input_read(&input, ch, 0, points_to_cap, points[ch]);
+      } else {
+         // Same channel as the live capture, the right one
+         input_read(&input, input.channels > 1 ? 1 : 0, 0, points_to_cap, points[1]);
+      }
+      stats_phase(&stats.capture, &t);
+   } else if(!capture_data(device_pb, device_cap, points, channels, points_to_cap, tones, multi.count > 0 ? &multi : NULL, &rate, period_size, priority, recalibrate, &stats)) {
+      rtn = 3;
+   }
+   if(input_path != NULL)
+      input_close(&input);
+
+   // One measurement per channel analysed, the single channel one is the right
+   struct run_measurement m[MAX_CHANNELS];
+   memset(m, 0, sizeof(m));
+   for(int ch = 0; ch < MAX_CHANNELS; ch++) {
+      m[ch].device_pb   = input_path != NULL ? input_path : device_pb;
+      m[ch].device_cap  = input_path != NULL ? input_path : device_cap;
+      m[ch].channel     = multichannel ? ch+1 : 2;
+      m[ch].rate        = rate;
+      m[ch].point_count = points_to_cap;
+   }
+   if(rtn == 0) {
+      if(multi.count > 0)
+         rtn = analyse_multitone(points[1], points_to_cap, rate, multi.hz, multi.count, harmonics > 0 ? harmonics : 3,
+                                 harmonics == 0 || plot_graph, &stats, m);
+      else if(multichannel)
+         rtn = analyse_channels(points, channels, points_to_cap, rate, notch_mode, use_float, harmonics, plot_graph, crosstalk, tones, &stats, m);
+      else
+         rtn = analyse_one(points[1], points_to_cap, rate, notch_mode, use_float, harmonics, plot_graph, frequency_hz, &stats, m);
+   }
+   for(int ch = 0; json_path != NULL && ch < (multichannel ? channels : 1); ch++)
+      stats_write(json_path, &stats, &m[ch]);
+   for(int ch = 0; ch < channels; ch++)
+      free(points[ch]);
+   return rtn;
 }
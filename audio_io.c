@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "audio_io.h"
+
+// The ALSA side of things. Both PCMs are mmap'ed and the loop sleeps in
+// poll() until one of them has a period ready, so samples are generated
+// straight into the playback ring and taken straight from the capture ring.
+
+#define PERIODS 4
+
+static int init_pb(snd_pcm_t **snddev_pb, const char *name, int channels, unsigned int *rate, snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer)
+{
+  int err;
+  snd_pcm_hw_params_t *hw_params;
+  snd_pcm_sw_params_t *sw_params;
+
+  if( name == NULL ) {
+      name = "plughw:0,0";
+      printf("USING %s\n",name);
+  }
+  err = snd_pcm_open(snddev_pb, name, SND_PCM_STREAM_PLAYBACK, 0);
+
+  if( err < 0 ) {
+      printf("Init: cannot open audio playback device %s (%s)\n", name, snd_strerror(err));
+      return 0;
+  }
+  printf("Audio playback device opened successfully.\n");
+
+  if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
+      printf("Init: cannot allocate hardware parameter structure (%s)\n", snd_strerror(err));
+      return 0;
+  }
+ 
+  if ((err = snd_pcm_hw_params_any (*snddev_pb, hw_params)) < 0) {
+      printf("Init: cannot initialize hardware parameter structure (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  unsigned int resample = 1;
+  err = snd_pcm_hw_params_set_rate_resample(*snddev_pb, hw_params, resample);
+  if (err < 0) {
+      printf("Init: Resampling setup failed for playback: %s\n", snd_strerror(err));
+      return 0;
+  }
+
+  // Set access to mmap interleaved, samples go straight to and from the ring.
+  if ((err = snd_pcm_hw_params_set_access (*snddev_pb, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+      printf("Init: cannot set access type (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_hw_params_set_format (*snddev_pb, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
+      printf("Init: cannot set sample format (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_hw_params_set_channels (*snddev_pb, hw_params, channels)) < 0) {
+      printf("Init: cannot set channel count (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  // Set sample rate.
+  unsigned int desired_rate = *rate;
+  unsigned int actual_rate  = desired_rate;
+  if ((err = snd_pcm_hw_params_set_rate_near (*snddev_pb, hw_params, &actual_rate, 0)) < 0) {
+      printf("Init: cannot set sample rate to %i. (%s)\n",desired_rate, snd_strerror(err));
+      return 0;
+  }
+  if( actual_rate < desired_rate ) {
+      printf("Init: sample rate does not match requested rate. (%i)\n", actual_rate);
+  }
+  *rate = actual_rate;
+
+  // Set period size, with a few periods in the buffer.
+  if ((err = snd_pcm_hw_params_set_period_size_near (*snddev_pb, hw_params, period, 0)) < 0) {
+      printf("Init: cannot set period size (%s)\n", snd_strerror (err));
+      return 0;
+  }
+  *buffer = *period * PERIODS;
+  if ((err = snd_pcm_hw_params_set_buffer_size_near (*snddev_pb, hw_params, buffer)) < 0) {
+      printf("Init: cannot set buffer size (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if(snd_pcm_nonblock(*snddev_pb, 1) < 0) {
+      printf("Init: cannot set non-blocking (%s)\n", snd_strerror (err));
+  }
+
+  if ((err = snd_pcm_hw_params (*snddev_pb, hw_params)) < 0) {
+      printf("Init: cannot set parameters (%s)\n", snd_strerror (err));
+      return 0;
+  } else {
+     printf("Audio device parameters have been set successfully.\n");
+  }
+
+  snd_pcm_hw_params_get_period_size( hw_params, period, 0 );
+  snd_pcm_hw_params_get_buffer_size( hw_params, buffer );
+  printf("Init: Period size = %lu frames.\n", *period);
+  printf("Init: Buffer size = %lu frames.\n", *buffer);
+  printf("Init: Significant bits for linear samples = %i\n", snd_pcm_hw_params_get_sbits(hw_params));
+  snd_pcm_hw_params_free (hw_params);
+
+  // Only wake up once there is at least a period to move
+  if ((err = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
+      printf("Init: cannot allocate software parameter structure (%s)\n", snd_strerror(err));
+      return 0;
+  }
+  snd_pcm_sw_params_current(*snddev_pb, sw_params);
+  snd_pcm_sw_params_set_avail_min(*snddev_pb, sw_params, *period);
+  err = snd_pcm_sw_params (*snddev_pb, sw_params);
+  snd_pcm_sw_params_free (sw_params);
+  if (err < 0) {
+      printf("Init: cannot set software parameters (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_prepare(*snddev_pb)) < 0) {
+      printf("Init: cannot prepare audio interface for use (%s)\n", snd_strerror(err));
+      return 0;
+  } else {
+      printf("Audio device has been prepared for use.\n");
+  }
+
+  return 1;
+}
+
+static int init_cap(snd_pcm_t **snddev_cap, const char *name, int channels, unsigned int *rate, snd_pcm_uframes_t *period, snd_pcm_uframes_t *buffer)
+{
+  int err;
+  snd_pcm_hw_params_t *hw_params;
+  snd_pcm_sw_params_t *sw_params;
+
+  if( name == NULL ) {
+      err = snd_pcm_open(snddev_cap, "plughw:0,0", SND_PCM_STREAM_CAPTURE, 0 );
+  } else {
+      err = snd_pcm_open(snddev_cap, name, SND_PCM_STREAM_CAPTURE, 0);
+  }
+
+  if( err < 0 ) {
+      printf("Init: cannot open audio playback device %s (%s)\n", name, snd_strerror(err));
+      return 0;
+  } else {
+      printf("Audio playback device opened successfully.\n");
+  }
+
+  if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
+      printf("Init: cannot allocate hardware parameter structure (%s)\n", snd_strerror(err));
+      return 0;
+  }
+ 
+  if ((err = snd_pcm_hw_params_any (*snddev_cap, hw_params)) < 0) {
+      printf("Init: cannot initialize hardware parameter structure (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  unsigned int resample = 1;
+  err = snd_pcm_hw_params_set_rate_resample(*snddev_cap, hw_params, resample);
+  if (err < 0) {
+      printf("Init: Resampling setup failed for playback: %s\n", snd_strerror(err));
+      return 0;
+  }
+
+  // Set access to mmap interleaved, samples go straight to and from the ring.
+  if ((err = snd_pcm_hw_params_set_access (*snddev_cap, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+      printf("Init: cannot set access type (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_hw_params_set_format (*snddev_cap, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
+      printf("Init: cannot set sample format (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_hw_params_set_channels (*snddev_cap, hw_params, channels)) < 0) {
+      printf("Init: cannot set channel count (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  // Set sample rate.
+  unsigned int actualRate = *rate;
+  if ((err = snd_pcm_hw_params_set_rate_near (*snddev_cap, hw_params, &actualRate, 0)) < 0) {
+      printf("Init: cannot set sample rate to %i. (%s)\n", *rate, snd_strerror(err));
+      return 0;
+  }
+  if( actualRate < *rate ) {
+      printf("Init: sample rate does not match requested rate. (%i)\n", actualRate);
+  }
+
+  // Set period size, with a few periods in the buffer.
+  if ((err = snd_pcm_hw_params_set_period_size_near (*snddev_cap, hw_params, period, 0)) < 0) {
+      printf("Init: cannot set period size (%s)\n", snd_strerror (err));
+      return 0;
+  }
+  *buffer = *period * PERIODS;
+  if ((err = snd_pcm_hw_params_set_buffer_size_near (*snddev_cap, hw_params, buffer)) < 0) {
+      printf("Init: cannot set buffer size (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if(snd_pcm_nonblock(*snddev_cap, 1) < 0) {
+      printf("Init: cannot set non-blocking (%s)\n", snd_strerror (err));
+  }
+
+  if ((err = snd_pcm_hw_params (*snddev_cap, hw_params)) < 0) {
+      printf("Init: cannot set parameters (%s)\n", snd_strerror (err));
+      return 0;
+  } else {
+     printf("Audio capture device parameters have been set successfully.\n");
+  }
+
+  snd_pcm_hw_params_get_period_size( hw_params, period, 0 );
+  snd_pcm_hw_params_get_buffer_size( hw_params, buffer );
+  printf("Init: Period size = %lu frames.\n", *period);
+  printf("Init: Buffer size = %lu frames.\n", *buffer);
+  printf("Init: Significant bits for linear samples = %i\n", snd_pcm_hw_params_get_sbits(hw_params));
+  snd_pcm_hw_params_free (hw_params);
+
+  // Only wake up once there is at least a period to move
+  if ((err = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
+      printf("Init: cannot allocate software parameter structure (%s)\n", snd_strerror(err));
+      return 0;
+  }
+  snd_pcm_sw_params_current(*snddev_cap, sw_params);
+  snd_pcm_sw_params_set_avail_min(*snddev_cap, sw_params, *period);
+  err = snd_pcm_sw_params (*snddev_cap, sw_params);
+  snd_pcm_sw_params_free (sw_params);
+  if (err < 0) {
+      printf("Init: cannot set software parameters (%s)\n", snd_strerror (err));
+      return 0;
+  }
+
+  if ((err = snd_pcm_prepare(*snddev_cap)) < 0) {
+      printf("Init: cannot prepare audio capture interface for use (%s)\n", snd_strerror(err));
+      return 0;
+  } else {
+      printf("Audio capture device has been prepared for use.\n");
+  }
+
+  return 1;
+}
+
+
+int audio_io_open(struct audio_io *io, const char *device_pb, const char *device_cap, int channels, unsigned int rate, int period_size)
+{
+  snd_pcm_uframes_t period_pb  = period_size, buffer_pb;
+  snd_pcm_uframes_t period_cap = period_size, buffer_cap;
+
+  memset(io, 0, sizeof(struct audio_io));
+  io->channels = channels;
+  io->rate     = rate;
+  atomic_init(&io->xruns, 0);
+  atomic_init(&io->errors, 0);
+  atomic_init(&io->idle_wakeups, 0);
+
+  if(!init_pb(&io->pb, device_pb, channels, &io->rate, &period_pb, &buffer_pb)) {
+     audio_io_close(io);
+     return 0;
+  }
+  if(!init_cap(&io->cap, device_cap, channels, &io->rate, &period_cap, &buffer_cap)) {
+     audio_io_close(io);
+     return 0;
+  }
+  io->period_size     = period_pb;
+  io->buffer_size     = buffer_pb;
+  io->period_size_cap = period_cap;
+  io->buffer_size_cap = buffer_cap;
+
+  io->nfds_pb  = snd_pcm_poll_descriptors_count(io->pb);
+  io->nfds_cap = snd_pcm_poll_descriptors_count(io->cap);
+  io->fds = malloc(sizeof(struct pollfd)*(io->nfds_pb+io->nfds_cap));
+  if(io->nfds_pb <= 0 || io->nfds_cap <= 0 || io->fds == NULL) {
+     printf("Init: cannot get poll descriptors\n");
+     audio_io_close(io);
+     return 0;
+  }
+  snd_pcm_poll_descriptors(io->pb,  io->fds, io->nfds_pb);
+  snd_pcm_poll_descriptors(io->cap, io->fds+io->nfds_pb, io->nfds_cap);
+
+  // Start both together if the driver allows it
+  if(snd_pcm_link(io->pb, io->cap) < 0)
+     printf("Init: playback and capture can't be linked, starting separately\n");
+  else
+     io->linked = 1;
+  return 1;
+}
+
+void audio_io_close(struct audio_io *io)
+{
+  if(io->pb)
+    snd_pcm_close (io->pb);
+  if(io->cap)
+    snd_pcm_close (io->cap);
+  free(io->fds);
+  io->pb  = NULL;
+  io->cap = NULL;
+  io->fds = NULL;
+  printf("Audio devices has been uninitialized.\n");
+}
+
+//=========================================================================================
+static int16_t *area_frames(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset)
+{
+  return (int16_t *)((char *)areas[0].addr + areas[0].first/8 + offset*areas[0].step/8);
+}
+
+// Fill as much of the playback ring as there is space for, adding the
+// frames written to *moved
+static int fill_playback(struct audio_io *io, audio_play_fn play, void *arg, snd_pcm_sframes_t *moved)
+{
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(io->pb);
+
+  if(avail < 0)
+    return avail;
+  *moved += avail;
+
+  while(avail > 0) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames = avail;
+    snd_pcm_sframes_t committed;
+    int err;
+
+    if((err = snd_pcm_mmap_begin(io->pb, &areas, &offset, &frames)) < 0)
+      return err;
+    play(arg, area_frames(areas, offset), frames, io->channels);
+    committed = snd_pcm_mmap_commit(io->pb, offset, frames);
+    if(committed < 0)
+      return committed;
+    if(committed != frames)
+      return -EPIPE;
+    avail -= frames;
+  }
+  return 0;
+}
+
+// Hand everything in the capture ring to 'capture', sets *done once it has had enough
+static int drain_capture(struct audio_io *io, audio_capture_fn capture, void *arg, int *done, snd_pcm_sframes_t *moved)
+{
+  snd_pcm_sframes_t avail = snd_pcm_avail_update(io->cap);
+
+  if(avail < 0)
+    return avail;
+  *moved += avail;
+
+  while(avail > 0 && !*done) {
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames = avail;
+    snd_pcm_sframes_t committed;
+    int err;
+
+    if((err = snd_pcm_mmap_begin(io->cap, &areas, &offset, &frames)) < 0)
+      return err;
+    *done = !capture(arg, area_frames(areas, offset), frames, io->channels);
+    committed = snd_pcm_mmap_commit(io->cap, offset, frames);
+    if(committed < 0)
+      return committed;
+    avail -= frames;
+  }
+  return 0;
+}
+
+static int start(struct audio_io *io, audio_play_fn play, void *arg)
+{
+  snd_pcm_sframes_t moved = 0;
+  int err;
+
+  if((err = fill_playback(io, play, arg, &moved)) < 0)
+    return err;
+  if((err = snd_pcm_start(io->pb)) < 0)
+    return err;
+  // Linked streams have already started together
+  if(snd_pcm_state(io->cap) != SND_PCM_STATE_RUNNING) {
+    if((err = snd_pcm_start(io->cap)) < 0)
+      return err;
+  }
+  io->started = 1;
+  return 0;
+}
+
+// After an xrun both streams are restarted, so playback and capture stay in step
+static int recover(struct audio_io *io, int err, audio_play_fn play, void *arg)
+{
+  printf("Audio xrun (%s), restarting\n", snd_strerror(err));
+  if(err == -EPIPE || err == -ESTRPIPE)
+    atomic_fetch_add_explicit(&io->xruns, 1, memory_order_relaxed);
+  snd_pcm_drop(io->pb);
+  snd_pcm_drop(io->cap);
+  if((err = snd_pcm_prepare(io->pb)) < 0)
+    return err;
+  if(snd_pcm_state(io->cap) != SND_PCM_STATE_PREPARED) {
+    if((err = snd_pcm_prepare(io->cap)) < 0)
+      return err;
+  }
+  return start(io, play, arg);
+}
+
+// Keeps the playback ring full and passes captured frames to 'capture'
+// until it returns 0. The streams keep running between calls.
+int audio_io_run(struct audio_io *io, audio_play_fn play, audio_capture_fn capture, void *arg)
+{
+  int nfds = io->nfds_pb + io->nfds_cap;
+  int done = 0;
+  int err;
+
+  if(!io->started) {
+    if((err = start(io, play, arg)) < 0) {
+      atomic_fetch_add_explicit(&io->errors, 1, memory_order_relaxed);
+      printf("Audio: cannot start streams (%s)\n", snd_strerror(err));
+      return 0;
+    }
+  }
+
+  while(!done) {
+    unsigned short revents_pb, revents_cap;
+    snd_pcm_sframes_t moved = 0;
+
+    if(poll(io->fds, nfds, 1000) < 0) {
+      if(errno == EINTR)
+        continue;
+      printf("Audio: poll failed (%s)\n", strerror(errno));
+      return 0;
+    }
+    snd_pcm_poll_descriptors_revents(io->pb,  io->fds, io->nfds_pb, &revents_pb);
+    snd_pcm_poll_descriptors_revents(io->cap, io->fds+io->nfds_pb, io->nfds_cap, &revents_cap);
+
+    err = 0;
+    if(revents_pb & (POLLOUT|POLLERR))
+      err = fill_playback(io, play, arg, &moved);
+    if(err == 0 && (revents_cap & (POLLIN|POLLERR)))
+      err = drain_capture(io, capture, arg, &done, &moved);
+    if(err == 0 && moved == 0)
+      atomic_fetch_add_explicit(&io->idle_wakeups, 1, memory_order_relaxed);
+    if(err < 0 && !done) {
+      atomic_fetch_add_explicit(&io->errors, 1, memory_order_relaxed);
+      if((err = recover(io, err, play, arg)) < 0) {
+        atomic_fetch_add_explicit(&io->errors, 1, memory_order_relaxed);
+        printf("Audio: cannot recover (%s)\n", snd_strerror(err));
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef AUDIO_IO_H
+#define AUDIO_IO_H
+#include <stdint.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <alsa/asoundlib.h>
+
+// A playback and capture PCM pair, running through the mmap'ed ALSA rings
+struct audio_io {
+   snd_pcm_t *pb;
+   snd_pcm_t *cap;
+   unsigned int rate;
+   int channels;
+   snd_pcm_uframes_t period_size;
+   snd_pcm_uframes_t buffer_size;
+   snd_pcm_uframes_t period_size_cap;   // what the capture side got, the above is playback
+   snd_pcm_uframes_t buffer_size_cap;
+   int linked;                           // the streams start together
+   int started;
+
+   struct pollfd *fds;
+   int nfds_pb;
+   int nfds_cap;
+
+   // Counted by audio_io_run(), readable from any thread
+   atomic_ulong xruns;
+   atomic_ulong errors;          // ALSA calls that failed, xruns included
+   atomic_ulong idle_wakeups;    // poll() woke up with no frames to move either way
+};
+
+// Generate 'frames' interleaved frames straight into the playback ring
+typedef void (*audio_play_fn)(void *arg, int16_t *out, int frames, int channels);
+// Take 'frames' interleaved frames straight from the capture ring,
+// return 0 once nothing more is wanted
+typedef int (*audio_capture_fn)(void *arg, const int16_t *in, int frames, int channels);
+
+int audio_io_open(struct audio_io *io, const char *device_pb, const char *device_cap, int channels, unsigned int rate, int period_size);
+int audio_io_run(struct audio_io *io, audio_play_fn play, audio_capture_fn capture, void *arg);
+void audio_io_close(struct audio_io *io);
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "audio_thread.h"
+
+// Enough ring for a second of audio, so the consumer can stall for a
+// while (e.g. in SetLevels()) without losing anything
+#define RING_SECONDS 1
+
+static int to_ring(void *arg, const int16_t *in, int frames, int channels) {
+   struct audio_thread *t = arg;
+
+   ring_write(&t->ring, in, frames);
+   sem_post(&t->ready);
+   return !atomic_load_explicit(&t->quit, memory_order_relaxed);
+}
+
+// audio_io_run() has one argument for both callbacks, so playback comes
+// through here to get its own
+static void from_play(void *arg, int16_t *out, int frames, int channels) {
+   struct audio_thread *t = arg;
+
+   t->play(t->play_arg, out, frames, channels);
+}
+
+static void *audio_main(void *arg) {
+   struct audio_thread *t = arg;
+
+   while(!atomic_load(&t->quit)) {
+      if(!audio_io_run(&t->io, from_play, to_ring, t))
+         break;
+   }
+   atomic_store(&t->running, 0);
+   sem_post(&t->ready);
+   return NULL;
+}
+
+int audio_thread_start(struct audio_thread *t, const char *device_pb, const char *device_cap, int channels, unsigned int rate,
+                       int period_size, int priority, audio_play_fn play, void *play_arg) {
+   pthread_attr_t attr;
+   int err = -1;
+
+   t->play     = play;
+   t->play_arg = play_arg;
+   t->realtime = 0;
+   atomic_init(&t->quit, 0);
+   atomic_init(&t->running, 1);
+
+   if(!audio_io_open(&t->io, device_pb, device_cap, channels, rate, period_size))
+      return 0;
+   if(!ring_init(&t->ring, (unsigned long)t->io.rate*RING_SECONDS, t->io.channels)) {
+      fprintf(stderr,"Out of memory\n");
+      audio_io_close(&t->io);
+      return 0;
+   }
+   sem_init(&t->ready, 0, 0);
+
+   if(priority > 0) {
+      struct sched_param param;
+
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = priority;
+      pthread_attr_init(&attr);
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&attr, &param);
+      err = pthread_create(&t->thread, &attr, audio_main, t);
+      pthread_attr_destroy(&attr);
+      if(err == 0)
+         t->realtime = 1;
+      else
+         printf("Audio thread: SCHED_FIFO priority %i not allowed (%s), using normal scheduling\n", priority, strerror(err));
+   }
+   if(err != 0 && (err = pthread_create(&t->thread, NULL, audio_main, t)) != 0) {
+      fprintf(stderr,"Audio thread: cannot start (%s)\n", strerror(err));
+      sem_destroy(&t->ready);
+      ring_free(&t->ring);
+      audio_io_close(&t->io);
+      return 0;
+   }
+   return 1;
+}
+
+// Pass captured frames to 'capture' until it returns 0. Returns 0 if the
+// audio thread has stopped.
+int audio_thread_read(struct audio_thread *t, audio_capture_fn capture, void *arg) {
+   while(1) {
+      const int16_t *frames;
+      unsigned long n = ring_peek(&t->ring, &frames);
+
+      if(n == 0) {
+         struct timespec ts;
+
+         if(!atomic_load(&t->running))
+            return 0;
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_sec += 1;
+         sem_timedwait(&t->ready, &ts);
+         continue;
+      }
+
+      int more = capture(arg, frames, n, t->ring.channels);
+      ring_consume(&t->ring, n);
+      if(!more)
+         return 1;
+   }
+}
+
+// Drop everything captured so far, so the next read starts with what
+// comes in after the call (give or take what is still in the ALSA buffers)
+void audio_thread_flush(struct audio_thread *t) {
+   const int16_t *frames;
+   unsigned long n;
+
+   while((n = ring_peek(&t->ring, &frames)) > 0)
+      ring_consume(&t->ring, n);
+}
+
+unsigned long audio_thread_overruns(struct audio_thread *t) {
+   return atomic_load(&t->ring.overruns);
+}
+
+// The capture frame the next audio_thread_read() starts at, counted from
+// when the streams started. Only right while nothing has been dropped.
+unsigned long audio_thread_position(struct audio_thread *t) {
+   return atomic_load(&t->ring.tail);
+}
+
+void audio_thread_stop(struct audio_thread *t) {
+   atomic_store(&t->quit, 1);
+   pthread_join(t->thread, NULL);
+   sem_destroy(&t->ready);
+   ring_free(&t->ring);
+   audio_io_close(&t->io);
+}
@@ -0,0 +1,33 @@
+#ifndef AUDIO_THREAD_H
+#define AUDIO_THREAD_H
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "audio_io.h"
+#include "ring.h"
+
+// Runs the ALSA loop on its own (SCHED_FIFO when allowed) thread. All it
+// does is generate the tone and copy captured frames into the ring, the
+// consumer takes them out with audio_thread_read().
+struct audio_thread {
+   struct audio_io io;
+   struct ring ring;
+   pthread_t thread;
+   sem_t ready;
+   atomic_int quit;
+   atomic_int running;
+   int realtime;
+
+   audio_play_fn play;
+   void *play_arg;
+};
+
+int audio_thread_start(struct audio_thread *t, const char *device_pb, const char *device_cap, int channels, unsigned int rate,
+                       int period_size, int priority, audio_play_fn play, void *play_arg);
+int audio_thread_read(struct audio_thread *t, audio_capture_fn capture, void *arg);
+void audio_thread_flush(struct audio_thread *t);
+unsigned long audio_thread_overruns(struct audio_thread *t);
+unsigned long audio_thread_position(struct audio_thread *t);
+void audio_thread_stop(struct audio_thread *t);
+#endif
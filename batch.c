@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <strings.h>
+#include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "analysis.h"
+#include "input.h"
+#include "plot.h"
+#include "pool.h"
+#include "fft.h"
+
+// Reused from file to file, only reallocated when the size or rate changes
+struct worker {
+   struct analysis *a;
+   int point_count;
+   unsigned int rate;
+   double *points;
+   float *points_f;
+   int points_size;
+};
+
+struct batch {
+   const struct batch_options *opt;
+   char **files;
+   int file_count;
+   int files_size;
+   struct worker *workers;
+   pthread_mutex_t out_lock;
+   int rows;
+   int failed;
+};
+
+static int add_file(struct batch *b, const char *path) {
+   if(b->file_count == b->files_size) {
+      int size = b->files_size ? b->files_size*2 : 256;
+      char **files = realloc(b->files, sizeof(char *)*size);
+      if(files == NULL)
+         return 0;
+      b->files      = files;
+      b->files_size = size;
+   }
+   b->files[b->file_count] = strdup(path);
+   if(b->files[b->file_count] == NULL)
+      return 0;
+   b->file_count++;
+   return 1;
+}
+
+static int capture_name(const char *name) {
+   const char *ext = strrchr(name, '.');
+   return ext != NULL && (strcasecmp(ext, ".wav") == 0 || strcasecmp(ext, ".raw") == 0);
+}
+
+static int by_name(const void *x, const void *y) {
+   return strcmp(*(char * const *)x, *(char * const *)y);
+}
+
+static int add_directory(struct batch *b, const char *dir) {
+   DIR *d = opendir(dir);
+   struct dirent *e;
+   int first = b->file_count;
+   char path[4096];
+
+   if(d == NULL) {
+      fprintf(stderr,"Unable to open directory %s\n", dir);
+      return 0;
+   }
+   while((e = readdir(d)) != NULL) {
+      struct stat st;
+      if(!capture_name(e->d_name))
+         continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+      if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+         continue;
+      if(!add_file(b, path)) {
+         closedir(d);
+         return 0;
+      }
+   }
+   closedir(d);
+   qsort(b->files+first, b->file_count-first, sizeof(char *), by_name);
+   return 1;
+}
+
+static int add_path(struct batch *b, const char *path) {
+   struct stat st;
+
+   if(strcmp(path, "-") == 0) {
+      char line[4096];
+      while(fgets(line, sizeof(line), stdin) != NULL) {
+         line[strcspn(line, "\r\n")] = '\0';
+         if(line[0] != '\0' && !add_file(b, line))
+            return 0;
+      }
+      return 1;
+   }
+   if(stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+      return add_directory(b, path);
+   return add_file(b, path);
+}
+
+//=========================================================================================
+static void json_string(FILE *f, const char *s) {
+   fputc('"', f);
+   for(; *s; s++) {
+      if(*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if((unsigned char)*s < 0x20)
+         fprintf(f, "\\u%04x", *s);
+      else
+         fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+static void csv_string(FILE *f, const char *s) {
+   fputc('"', f);
+   for(; *s; s++) {
+      if(*s == '"')
+         fputc('"', f);
+      fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+static void header(struct batch *b) {
+   if(b->opt->json) {
+      fprintf(b->opt->out, "[\n");
+   } else {
+      fprintf(b->opt->out, "file,frames,rate,peak_hz,signal_db,thd_n_pct,thd_n_db");
+      if(b->opt->harmonics > 0)
+         fprintf(b->opt->out, ",thd_pct,thd_db");
+      fprintf(b->opt->out, ",error\n");
+   }
+}
+
+static void footer(struct batch *b) {
+   if(b->opt->json)
+      fprintf(b->opt->out, "%s]\n", b->rows ? "\n" : "");
+   fflush(b->opt->out);
+}
+
+// 'res' is NULL when the file could not be analysed
+static void report(struct batch *b, const char *file, const struct input_file *in,
+                   const struct analysis_result *res, double thd, const char *error) {
+   FILE *f = b->opt->out;
+   double thd_n = 0.0;
+
+   if(res != NULL)
+      thd_n = res->rms/res->signal;
+
+   pthread_mutex_lock(&b->out_lock);
+   if(b->opt->json) {
+      fprintf(f, "%s  {\"file\": ", b->rows ? ",\n" : "");
+      json_string(f, file);
+      if(res != NULL) {
+         fprintf(f, ", \"frames\": %li, \"rate\": %u, \"peak_hz\": %.2f, \"signal_db\": %.3f, \"thd_n_pct\": %.5f, \"thd_n_db\": %.3f",
+                 in->frames, in->rate, res->peak_hz, res->signal_db, thd_n*100, log10(thd_n)*20);
+         if(b->opt->harmonics > 0)
+            fprintf(f, ", \"thd_pct\": %.5f, \"thd_db\": %.3f", thd*100, log10(thd)*20);
+      } else {
+         fprintf(f, ", \"error\": ");
+         json_string(f, error);
+      }
+      fprintf(f, "}");
+   } else {
+      csv_string(f, file);
+      if(res != NULL) {
+         fprintf(f, ",%li,%u,%.2f,%.3f,%.5f,%.3f", in->frames, in->rate, res->peak_hz, res->signal_db, thd_n*100, log10(thd_n)*20);
+         if(b->opt->harmonics > 0)
+            fprintf(f, ",%.5f,%.3f", thd*100, log10(thd)*20);
+         fprintf(f, ",\n");
+      } else {
+         fprintf(f, ",,,,,,%s,", b->opt->harmonics > 0 ? ",," : "");
+         csv_string(f, error);
+         fprintf(f, "\n");
+      }
+   }
+   fflush(f);
+   b->rows++;
+   if(res == NULL)
+      b->failed++;
+   pthread_mutex_unlock(&b->out_lock);
+}
+
+//=========================================================================================
+static int worker_setup(struct worker *w, int point_count, unsigned int rate, int notch_mode, int use_float) {
+   if(w->a == NULL || w->point_count != point_count || w->rate != rate) {
+      analysis_free(w->a);
+      // No pool, the parallelism is across files
+      if(use_float)
+         w->a = analysis_new_float(point_count, rate, NULL);
+      else
+         w->a = analysis_new(point_count, rate, NULL);
+      if(w->a == NULL)
+         return 0;
+      w->point_count = point_count;
+      w->rate        = rate;
+      analysis_set_notch(w->a, notch_mode);
+   }
+   if(w->points_size < point_count) {
+      free(w->points);
+      free(w->points_f);
+      w->points   = malloc(sizeof(double)*point_count);
+      w->points_f = use_float ? malloc(sizeof(float)*point_count) : NULL;
+      w->points_size = w->points == NULL || (use_float && w->points_f == NULL) ? 0 : point_count;
+      if(w->points_size == 0)
+         return 0;
+   }
+   return 1;
+}
+
+static void plot_file(struct worker *w, const char *file, const struct analysis_result *res) {
+   const char *base = strrchr(file, '/');
+   char name[4096], text[100];
+
+   base = base ? base+1 : file;
+   snprintf(name, sizeof(name), "%s", base);
+   char *ext = strrchr(name, '.');
+   if(ext != NULL)
+      *ext = '\0';
+   strncat(name, ".png", sizeof(name)-strlen(name)-1);
+   sprintf(text,"thd+n %7.4f%%, peak %4.2f Hz", res->rms/res->signal*100, res->peak_hz);
+   plot(analysis_signal(w->a), analysis_bins(w->a), text, name);
+}
+
+static void analyse_file(void *arg, int worker, int index) {
+   struct batch *b = arg;
+   struct worker *w = &b->workers[worker];
+   const char *file = b->files[index];
+   struct input_file in;
+   struct analysis_result res;
+   double thd = 0.0;
+   int n;
+
+   if(!input_open(&in, file, b->opt->raw_rate)) {
+      report(b, file, NULL, NULL, 0, "unreadable");
+      return;
+   }
+   if(in.frames < 16) {
+      input_close(&in);
+      report(b, file, NULL, NULL, 0, "too short");
+      return;
+   }
+   // Cut to a length without large prime factors, which the FFT is slow at
+   n = fft_size_below(in.frames < INT_MAX ? in.frames : INT_MAX);
+   if(!worker_setup(w, n, in.rate, b->opt->notch_mode, b->opt->use_float)) {
+      input_close(&in);
+      report(b, file, NULL, NULL, 0, "out of memory");
+      return;
+   }
+   input_read(&in, in.channels > 1 ? 1 : 0, 0, n, w->points);
+
+   if(b->opt->harmonics > 0) {
+      struct harmonic harmonics[MAX_HARMONICS];
+      if(analysis_harmonics(w->a, w->points, b->opt->frequency_hz, b->opt->harmonics, harmonics, &thd) == 0) {
+         input_close(&in);
+         report(b, file, NULL, NULL, 0, "fundamental above Nyquist");
+         return;
+      }
+   }
+   int ok;
+   if(b->opt->use_float) {
+      for(int i = 0; i < n; i++)
+         w->points_f[i] = w->points[i];
+      analysis_window_float(w->a, w->points_f);
+      ok = analysis_run_float(w->a, w->points_f, &res);
+   } else {
+      analysis_window(w->a, w->points);
+      ok = analysis_run(w->a, w->points, &res);
+   }
+   if(!ok) {
+      input_close(&in);
+      report(b, file, NULL, NULL, 0, "out of memory");
+      return;
+   }
+   if(b->opt->plot)
+      plot_file(w, file, &res);
+   report(b, file, &in, &res, thd, NULL);
+   input_close(&in);
+}
+
+int batch_run(char **paths, int count, const struct batch_options *opt, struct pool *pool) {
+   struct batch b;
+   int workers = pool != NULL ? pool_size(pool) : 1;
+
+   memset(&b, 0, sizeof(b));
+   b.opt = opt;
+   for(int i = 0; i < count; i++) {
+      if(!add_path(&b, paths[i])) {
+         fprintf(stderr,"Unable to list %s\n", paths[i]);
+         b.failed = 1;
+         goto done;
+      }
+   }
+   b.workers = calloc(workers, sizeof(struct worker));
+   if(b.workers == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      b.failed = 1;
+      goto done;
+   }
+
+   pthread_mutex_init(&b.out_lock, NULL);
+   header(&b);
+   pool_run(pool, b.file_count, analyse_file, &b);
+   footer(&b);
+   pthread_mutex_destroy(&b.out_lock);
+
+   for(int i = 0; i < workers; i++) {
+      analysis_free(b.workers[i].a);
+      free(b.workers[i].points);
+      free(b.workers[i].points_f);
+   }
+   fprintf(stderr,"%i files analysed, %i failed\n", b.file_count, b.failed);
+done:
+   for(int i = 0; i < b.file_count; i++)
+      free(b.files[i]);
+   free(b.files);
+   free(b.workers);
+   return b.failed;
+}
@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdio.h>
+
+struct pool;
+
+// Analyses many capture files, spread over the pool with one analysis
+// context per worker. A result is written to 'out' as each file finishes,
+// so the order follows completion rather than the command line.
+struct batch_options {
+   int notch_mode;
+   int use_float;           // window, FFT, notch and RMS in float
+   unsigned int raw_rate;   // for .raw files, which have no header
+   int harmonics;           // also measure THD over H2..Hn, 0 for none
+   double frequency_hz;     // fundamental for the harmonics
+   int plot;                // write <name>.png for each file
+   int json;                // JSON array rather than CSV
+   FILE *out;
+};
+
+// Each path is a capture, a directory of .wav/.raw captures, or "-" to read
+// paths from stdin one per line. Returns the number of files that failed.
+int batch_run(char **paths, int count, const struct batch_options *opt, struct pool *pool);
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "analysis.h"
+#include "pool.h"
+#include "kernels.h"
+#include "image.h"
+#include "plot.h"
+
+// Times each stage of the double and float analysis pipelines, the graph
+// and writing it out, on synthetic captures of several lengths. Then checks
+// what was measured against what was put into the capture, and the float
+// path against the double one, so a faster version can't quietly get the
+// wrong answer. Exits with 1 if it does.
+
+#define RATE         48000
+#define RUN_SECONDS  0.25     // Keep repeating each stage for at least this long
+#define MIN_RUNS     3
+#define GRAPH_FILE   "bench_graph.png"
+
+// Every length holds a whole number of cycles of the tone, so the band
+// notch sees it centred on a bin
+static const int point_counts[] = { 4800, 24000, 48000, 96000, 192000 };
+
+//=========================================================================================
+// A synthetic loopback capture
+#define SYNTH_HARMONICS 4
+
+struct synth {
+   double hz;
+   double level_db;                       // Fundamental peak, dBFS
+   double harmonic_db[SYNTH_HARMONICS];   // 2nd, 3rd, ... dBc
+   double noise_rms;                      // White noise, in counts
+   double dc;                             // In counts
+};
+
+static const struct synth synth = {
+   .hz          = 1000.0,
+   .level_db    = -3.0,
+   .harmonic_db = { -70.0, -80.0, -90.0, -100.0 },
+   .noise_rms   = 2.0,
+   .dc          = 50.0,
+};
+
+// Rounded to 16 bits like a real capture. The noise is the sum of four
+// uniform values, which is close enough to Gaussian.
+static void generate(const struct synth *s, double *points, int count) {
+   double amplitude = 32767*pow(10, s->level_db/20);
+   unsigned int seed = 1;
+
+   for(int i = 0; i < count; i++) {
+      double t = 2*M_PI*s->hz*i/RATE;
+      double x = sin(t);
+      for(int h = 0; h < SYNTH_HARMONICS; h++)
+         x += pow(10, s->harmonic_db[h]/20)*sin((h+2)*t);
+
+      double noise = 0.0;
+      for(int j = 0; j < 4; j++) {
+         seed = seed*1103515245 + 12345;
+         noise += (seed >> 16 & 0x7FFF)/32768.0 - 0.5;
+      }
+      points[i] = floor(amplitude*x + s->dc + noise*s->noise_rms*sqrt(3) + 0.5);
+   }
+}
+
+static double expected_thd(const struct synth *s) {
+   double sum = 0.0;
+   for(int h = 0; h < SYNTH_HARMONICS; h++)
+      sum += pow(10, s->harmonic_db[h]/10);
+   return sqrt(sum);
+}
+
+// The residual is measured after the window, which scales everything left
+// in it (harmonics, noise, rounding and DC alike) by the window's RMS. The
+// fundamental is summed over the bins of the notch, which for this window
+// comes back to its true level.
+static double expected_thd_n(const struct synth *s) {
+   double amplitude = 32767*pow(10, s->level_db/20);
+   double window_rms = sqrt(0.42*0.42 + 2*0.25*0.25 + 2*0.04*0.04);
+   double thd = expected_thd(s)*amplitude;
+   double rest = thd*thd/2 + s->noise_rms*s->noise_rms + 1.0/12 + s->dc*s->dc;
+   return sqrt(rest)*window_rms/(amplitude/sqrt(2));
+}
+
+//=========================================================================================
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void print_stage(const char *what, const char *stage, double seconds, int count) {
+   printf("  %-7s %-10s %10.4f %10.3f %12.2f\n", what, stage, seconds*1e3, seconds*1e9/count, count/seconds*1e-6);
+}
+
+static void print_timing(const char *what, const struct analysis_timing *t, int runs, int count) {
+   print_stage(what, "window",   t->window/runs,   count);
+   print_stage(what, "spectrum", t->spectrum/runs, count);
+   print_stage(what, "notch",    t->notch/runs,    count);
+   print_stage(what, "rms",      t->rms/runs,      count);
+   print_stage(what, "total",    (t->window+t->spectrum+t->notch+t->rms)/runs, count);
+}
+
+static int check(const char *what, const char *name, double got, double want, double tolerance_db) {
+   double error = 20*log10(got/want);
+   int ok = fabs(error) <= tolerance_db;
+
+   printf("  %-7s %-10s %10.3f dB, expected %10.3f dB, %+7.3f dB %s\n", what, name,
+          20*log10(got), 20*log10(want), error, ok ? "ok" : "FAIL");
+   return ok;
+}
+
+// Compares one run of an analysis against the synthetic capture
+static int check_result(const char *what, struct analysis *a, const double *raw, int count, const struct analysis_result *r) {
+   double amplitude = 32767*pow(10, synth.level_db/20);
+   struct harmonic h[SYNTH_HARMONICS+1];
+   double thd;
+   int ok = 1;
+
+   if(fabs(r->peak_hz - synth.hz) > (double)RATE/count) {
+      printf("  %-7s peak at %.2f Hz, expected %.2f Hz FAIL\n", what, r->peak_hz, synth.hz);
+      ok = 0;
+   }
+   ok &= check(what, "signal", r->signal, amplitude/sqrt(2), 0.05);
+   ok &= check(what, "thd+n", r->rms/r->signal, expected_thd_n(&synth), 0.25);
+   if(analysis_harmonics(a, raw, synth.hz, SYNTH_HARMONICS+1, h, &thd) == SYNTH_HARMONICS+1)
+      ok &= check(what, "thd", thd, expected_thd(&synth), 0.15);
+   else
+      ok = 0;
+   return ok;
+}
+
+// The float path against the double one, on the same capture. THD+N has to
+// match to FLOAT_THD_N_DB. Bins the graph can show are compared in dB, but
+// a bin near the bottom can differ by a dB or so from rounding far below
+// it, so what has to hold is that the difference itself, as a level, stays
+// below the bottom of the graph.
+#define FLOAT_THD_N_DB  0.001
+#define GRAPH_FLOOR_DB  -140.0
+
+static int check_float(struct analysis *ad, struct analysis *af, const struct analysis_result *rd, const struct analysis_result *rf) {
+   double *sd = analysis_signal(ad), *sf = analysis_signal(af);
+   double thd_n = fabs(20*log10(rd->rms/rd->signal) - 20*log10(rf->rms/rf->signal));
+   double worst = 0.0, error = 0.0;
+   int ok;
+
+   for(int i = 0; i < analysis_bins(ad); i++) {
+      double e = fabs(pow(10, sd[i]/20) - pow(10, sf[i]/20));
+      if(e > error)
+         error = e;
+      if(sd[i] > GRAPH_FLOOR_DB && fabs(sd[i]-sf[i]) > worst)
+         worst = fabs(sd[i]-sf[i]);
+   }
+   error = 20*log10(error);
+   ok = thd_n <= FLOAT_THD_N_DB && error <= GRAPH_FLOOR_DB;
+   printf("  float   vs double  thd+n differs by %.2e dB, bins above %.0f dB by at most %.2e dB, error floor %.1f dB %s\n",
+          thd_n, GRAPH_FLOOR_DB, worst, error, ok ? "ok" : "FAIL");
+   return ok;
+}
+
+//=========================================================================================
+// Returns 0 if any of the results were wrong, -1 when out of memory
+static int bench(int count, int notch_mode, struct pool *pool) {
+   struct analysis_timing td, tf;
+   struct analysis_result rd, rf;
+   struct analysis *ad, *af;
+   double *raw, *pd;
+   float *pf;
+   int runs, ok = 1;
+
+   raw = malloc(sizeof(double)*count);
+   pd  = malloc(sizeof(double)*count);
+   pf  = malloc(sizeof(float)*count);
+   ad  = analysis_new(count, RATE, pool);
+   af  = analysis_new_float(count, RATE, pool);
+   if(raw == NULL || pd == NULL || pf == NULL || ad == NULL || af == NULL) {
+      ok = -1;
+      goto done;
+   }
+   analysis_set_notch(ad, notch_mode);
+   analysis_set_notch(af, notch_mode);
+   generate(&synth, raw, count);
+   printf("%i points\n", count);
+
+   memset(&td, 0, sizeof(td));
+   analysis_set_timing(ad, &td);
+   double start = now();
+   for(runs = 0; runs < MIN_RUNS || now()-start < RUN_SECONDS; runs++) {
+      memcpy(pd, raw, sizeof(double)*count);
+      analysis_window(ad, pd);
+      analysis_run(ad, pd, &rd);
+   }
+   analysis_set_timing(ad, NULL);
+   print_timing("double", &td, runs, count);
+
+   memset(&tf, 0, sizeof(tf));
+   analysis_set_timing(af, &tf);
+   start = now();
+   for(runs = 0; runs < MIN_RUNS || now()-start < RUN_SECONDS; runs++) {
+      for(int i = 0; i < count; i++)
+         pf[i] = raw[i];
+      analysis_window_float(af, pf);
+      analysis_run_float(af, pf, &rf);
+   }
+   analysis_set_timing(af, NULL);
+   print_timing("float", &tf, runs, count);
+
+   // The graph is drawn from the spectrum of the last double run
+   double t_plot = 0.0, t_write = 0.0;
+   start = now();
+   for(runs = 0; runs < MIN_RUNS || now()-start < RUN_SECONDS; runs++) {
+      double t = now();
+      struct image *img = plot_image(analysis_signal(ad), analysis_bins(ad), "bench");
+      if(img == NULL) {
+         ok = -1;
+         goto done;
+      }
+      t_plot += now()-t;
+      t = now();
+      image_write(img, GRAPH_FILE);
+      t_write += now()-t;
+      image_free(img);
+   }
+   remove(GRAPH_FILE);
+   print_stage("graph", "plot", t_plot/runs, count);
+   print_stage("graph", "write png", t_write/runs, count);
+
+   ok &= check_result("double", ad, raw, count, &rd);
+   ok &= check_result("float", af, raw, count, &rf);
+   ok &= check_float(ad, af, &rd, &rf);
+
+done:
+   analysis_free(ad);
+   analysis_free(af);
+   free(raw);
+   free(pd);
+   free(pf);
+   return ok;
+}
+
+int main(int argc, char *argv[]) {
+   struct pool *pool = NULL;
+   int notch_mode = ANALYSIS_NOTCH_BAND;
+   int only = 0, failed = 0;
+
+   for(int i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "-f") == 0)
+         notch_mode = ANALYSIS_NOTCH_FIT;
+      else if(strcmp(argv[i], "-t") == 0)
+         pool = pool_new(0);
+      else if(strcmp(argv[i], "-n") == 0 && i+1 < argc)
+         only = atoi(argv[++i]);
+      else {
+         fprintf(stderr,"Usage: %s [-f] [-t] [-n point_count]\n", argv[0]);
+         fprintf(stderr,"  -f  Fit the fundamental rather than notching a band of bins\n");
+         fprintf(stderr,"  -t  Run the analysis on a pool of one thread per CPU\n");
+         fprintf(stderr,"  -n  Only this capture length\n");
+         return 1;
+      }
+   }
+
+   printf("kernels: %s, threads: %i\n", kernels_select()->name, pool != NULL ? pool_size(pool) : 1);
+   printf("  %-7s %-10s %10s %10s %12s\n", "", "", "ms/run", "ns/sample", "Msamples/s");
+   for(int i = 0; i < (int)(sizeof(point_counts)/sizeof(point_counts[0])); i++) {
+      int count = only > 0 ? only : point_counts[i];
+      int ok = bench(count, notch_mode, pool);
+      if(ok < 0) {
+         fprintf(stderr,"Out of memory\n");
+         pool_free(pool);
+         return 3;
+      }
+      if(!ok)
+         failed = 1;
+      if(only > 0)
+         break;
+   }
+   pool_free(pool);
+   if(failed)
+      printf("Results did not match the synthetic capture\n");
+   return failed ? 1 : 0;
+}
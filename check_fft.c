@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <complex.h>
+
+#include "fft.h"
+#include "analysis.h"
+
+// Checks every bin of the mixed radix FFT, double and float, against
+// find_s_c(), the direct sum over the capture for one bin. The lengths
+// cover each kind of butterfly: a power of two, 3*5*7, a large prime for
+// the generic one, and the usual 24000. Exits with 1 on a mismatch.
+
+static const int sizes[] = { 1024, 105, 4801, 24000 };
+
+// find_s_c() has float rounding in its sine tables, so the double FFT is
+// held to that, and the float FFT to its own precision. Both are of the
+// largest sample.
+#define DOUBLE_TOLERANCE  1e-7
+#define FLOAT_TOLERANCE   1e-6
+
+static int check(int n) {
+   double *points = malloc(sizeof(double)*n);
+   float *points_f = malloc(sizeof(float)*n);
+   double complex *spectrum = malloc(sizeof(double complex)*n);
+   float complex *spectrum_f = malloc(sizeof(float complex)*n);
+   struct fft_plan *plan = fft_plan_new(n);
+   struct analysis *a = analysis_new(n, 48000, NULL);
+   double worst = 0.0, worst_f = 0.0;
+   unsigned int seed = 1;
+   int ok;
+
+   if(points == NULL || points_f == NULL || spectrum == NULL || spectrum_f == NULL || plan == NULL || a == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      exit(3);
+   }
+   for(int i = 0; i < n; i++) {
+      seed = seed*1103515245 + 12345;
+      points[i]   = (seed >> 8 & 0xFFFF) - 32768.0 + 8000*sin(2*M_PI*i*17.25/n);
+      points_f[i] = points[i];
+   }
+   fft_forward_real(plan, points, spectrum);
+   fft_forward_real_float(plan, points_f, spectrum_f);
+
+   for(int bin = 0; bin <= n/2; bin++) {
+      double st, ct;
+      double scale = bin == 0 ? n : n/2.0;
+      find_s_c(a, points, bin, &st, &ct);
+      double complex want = (ct - I*st)*scale;
+      double e   = cabs(spectrum[bin] - want)/scale;
+      double e_f = cabs(spectrum_f[bin] - want)/scale;
+      if(e > worst)     worst = e;
+      if(e_f > worst_f) worst_f = e_f;
+   }
+   ok = worst <= 40000*DOUBLE_TOLERANCE && worst_f <= 40000*FLOAT_TOLERANCE;
+   printf("%6i points: worst bin off by %.3g (double), %.3g (float) %s\n", n, worst, worst_f, ok ? "ok" : "FAIL");
+
+   analysis_free(a);
+   fft_plan_free(plan);
+   free(points);
+   free(points_f);
+   free(spectrum);
+   free(spectrum_f);
+   return ok;
+}
+
+int main(int argc, char *argv[]) {
+   int failed = 0;
+
+   for(int i = 0; i < (int)(sizeof(sizes)/sizeof(sizes[0])); i++)
+      if(!check(sizes[i]))
+         failed = 1;
+   return failed;
+}
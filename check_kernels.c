@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "kernels.h"
+
+// Runs every kernel set the CPU supports against the scalar one, at odd
+// lengths and on buffers that are not aligned, and exits with 1 if any of
+// them disagree. Sums may be added up in a different order, so those are
+// compared to the sum of the magnitudes of what was added. The sine
+// removal is checked against libm instead, the scalar kernel included, so
+// the oscillators can't drift from what remove_bin() used to give.
+
+static const int sizes[] = { 1, 7, 4801, 24000 };
+static const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+static const int channel_counts[] = { 1, 2, 3, 8 };
+
+#define SUM_TOLERANCE     1e-12   // of the sum of magnitudes
+#define DOUBLE_TOLERANCE  1e-9    // of the amplitude, for the oscillators
+#define FLOAT_TOLERANCE   1e-6
+
+static unsigned int seed = 1;
+
+static double noise(void) {
+   seed = seed*1103515245 + 12345;
+   return ((seed >> 8 & 0xFFFF) - 32768.0);
+}
+
+static int failures;
+
+static void compare(const char *name, const char *kernel, int n, int bin, double got, double want, double tolerance) {
+   if(fabs(got - want) > tolerance || isnan(got)) {
+      if(failures < 20)
+         printf("  %-7s %-12s n %6i bin %6i: %.17g, reference %.17g FAIL\n", name, kernel, n, bin, got, want);
+      failures++;
+   }
+}
+
+// What remove_bin() did before the kernels, with sin() and cos() for every sample
+static void libm_remove(double *points, int begin, int end, int n, int bin, double st, double ct) {
+   for(int i = begin; i < end; i++) {
+      double phase = i*(double)bin/n*2*M_PI;
+      points[i] -= st*sin(phase) + ct*cos(phase);
+   }
+}
+
+//=========================================================================================
+// Buffers start one element past an aligned allocation
+static void check_size(const struct kernels *k, const struct kernels *ref, int n) {
+   double *mem_p = malloc(sizeof(double)*(n+1)), *points = mem_p+1;
+   double *mem_s = malloc(sizeof(double)*(n+1)), *s_table = mem_s+1;
+   double *mem_c = malloc(sizeof(double)*(n+1)), *c_table = mem_c+1;
+   double *mem_w = malloc(sizeof(double)*(n+1)), *window = mem_w+1;
+   double *mem_a = malloc(sizeof(double)*(n+1)), *a = mem_a+1;
+   double *mem_b = malloc(sizeof(double)*(n+1)), *b = mem_b+1;
+   float *mem_fa = malloc(sizeof(float)*(n+1)), *fa = mem_fa+1;
+   int16_t *mem_i = malloc(sizeof(int16_t)*(n*8+1)), *in = mem_i+1;
+   int bins[] = { 0, 1, n/3, n-1 };
+   double magnitude = 0.0;
+
+   if(mem_p == NULL || mem_s == NULL || mem_c == NULL || mem_w == NULL || mem_a == NULL || mem_b == NULL ||
+      mem_fa == NULL || mem_i == NULL) {
+      fprintf(stderr,"Out of memory\n");
+      exit(3);
+   }
+   for(int i = 0; i < n; i++) {
+      points[i]  = noise();
+      s_table[i] = sin(2*M_PI*i/n);
+      c_table[i] = cos(2*M_PI*i/n);
+      window[i]  = 0.42 - 0.5 * cos(2*M_PI*i/n) + 0.08 * cos(4*M_PI*i/n);
+      magnitude += fabs(points[i]);
+   }
+
+   for(int j = 0; j < 4; j++) {
+      double s, c, rs, rc;
+      k->dot_sc(points, s_table, c_table, n, bins[j], &s, &c);
+      ref->dot_sc(points, s_table, c_table, n, bins[j], &rs, &rc);
+      compare(k->name, "dot_sc sin", n, bins[j], s, rs, magnitude*SUM_TOLERANCE);
+      compare(k->name, "dot_sc cos", n, bins[j], c, rc, magnitude*SUM_TOLERANCE);
+   }
+
+   compare(k->name, "sum_sq", n, 0, k->sum_sq(points, n), ref->sum_sq(points, n), ref->sum_sq(points, n)*SUM_TOLERANCE);
+
+   memcpy(a, points, sizeof(double)*n);
+   memcpy(b, points, sizeof(double)*n);
+   k->multiply(a, window, n);
+   ref->multiply(b, window, n);
+   for(int i = 0; i < n; i++)
+      compare(k->name, "multiply", n, i, a[i], b[i], 0.0);
+
+   // The whole range, then one that starts and ends off a vector boundary
+   for(int j = 0; j < 4; j++) {
+      for(int range = 0; range < 2; range++) {
+         int begin = range == 0 || n < 8 ? 0 : 3;
+         int end   = range == 0 || n < 8 ? n : n-2;
+         memcpy(a, points, sizeof(double)*n);
+         memcpy(b, points, sizeof(double)*n);
+         k->remove_sc(a, begin, end, n, bins[j], 12345.6, -7890.1);
+         libm_remove(b, begin, end, n, bins[j], 12345.6, -7890.1);
+         for(int i = 0; i < n; i++)
+            compare(k->name, "remove_sc", n, bins[j], a[i], b[i], 20000*DOUBLE_TOLERANCE);
+
+         for(int i = 0; i < n; i++)
+            fa[i] = points[i];
+         k->remove_sc_f(fa, begin, end, n, bins[j], 12345.6, -7890.1);
+         for(int i = 0; i < n; i++)
+            compare(k->name, "remove_sc_f", n, bins[j], fa[i], b[i], 60000*FLOAT_TOLERANCE);
+      }
+   }
+
+   for(int j = 0; j < 4; j++) {
+      int channels = channel_counts[j];
+      double *out[8], *out_ref[8];
+      for(int i = 0; i < n*channels; i++)
+         in[i] = noise();
+      for(int ch = 0; ch < channels; ch++) {
+         out[ch]     = malloc(sizeof(double)*n);
+         out_ref[ch] = malloc(sizeof(double)*n);
+         if(out[ch] == NULL || out_ref[ch] == NULL) {
+            fprintf(stderr,"Out of memory\n");
+            exit(3);
+         }
+      }
+      k->deinterleave(in, n, channels, out);
+      ref->deinterleave(in, n, channels, out_ref);
+      for(int ch = 0; ch < channels; ch++) {
+         for(int i = 0; i < n; i++)
+            compare(k->name, "deinterleave", n, channels, out[ch][i], out_ref[ch][i], 0.0);
+         free(out[ch]);
+         free(out_ref[ch]);
+      }
+   }
+
+   free(mem_p); free(mem_s); free(mem_c); free(mem_w); free(mem_a); free(mem_b);
+   free(mem_fa); free(mem_i);
+}
+
+int main(int argc, char *argv[]) {
+   const struct kernels *ref = kernels_by_name("scalar");
+
+   for(int i = 0; i < (int)(sizeof(names)/sizeof(names[0])); i++) {
+      const struct kernels *k = kernels_by_name(names[i]);
+      int before = failures;
+
+      if(k == NULL) {
+         printf("%-7s not supported on this CPU, skipped\n", names[i]);
+         continue;
+      }
+      for(int j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++)
+         check_size(k, ref, sizes[j]);
+      printf("%-7s %s\n", k->name, failures == before ? "matches scalar and libm" : "FAILED");
+   }
+   return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <math.h>
+#include <complex.h>
+
+#include "fft.h"
+
+// Mixed radix decimation-in-time FFT. Sizes are factored into radix 4, 2, 3
+// and then any remaining odd primes, so sizes like 24000 (2^6*3*5^3) are
+// transformed directly without padding.
+
+#define MAX_FACTORS  32
+
+struct fft_plan {
+   int n;
+   int factors[2*MAX_FACTORS];    // pairs of (radix, remaining length)
+   double complex *twiddle;       // exp(-2*pi*i*k/n) for k = 0..n-1
+   float complex *twiddle_f;      // the same, rounded once for the float transforms
+   // For the radices above 4, sized for the largest. Being in the plan,
+   // nothing is allocated per transform, but a plan can only be used by
+   // one thread at a time.
+   double complex *scratch;
+   float complex *scratch_f;
+};
+
+static void factorize(struct fft_plan *plan) {
+   int n = plan->n;
+   int p = 4;
+   int i = 0;
+
+   do {
+      while(n % p) {
+         switch(p) {
+            case 4:  p = 2; break;
+            case 2:  p = 3; break;
+            default: p += 2; break;
+         }
+         if(p*p > n)
+            p = n;
+      }
+      n /= p;
+      plan->factors[i++] = p;
+      plan->factors[i++] = n;
+   } while(n > 1);
+}
+
+struct fft_plan *fft_plan_new(int n) {
+   struct fft_plan *plan;
+
+   if(n < 1)
+      return NULL;
+
+   plan = calloc(1, sizeof(struct fft_plan));
+   if(plan == NULL)
+      return NULL;
+
+   plan->n = n;
+   plan->twiddle   = malloc(sizeof(double complex)*n);
+   plan->twiddle_f = malloc(sizeof(float complex)*n);
+   if(plan->twiddle == NULL || plan->twiddle_f == NULL) {
+      fft_plan_free(plan);
+      return NULL;
+   }
+   for(int i = 0; i < n; i++) {
+      double phase = -2*M_PI*i/n;
+      plan->twiddle[i]   = cos(phase) + I*sin(phase);
+      plan->twiddle_f[i] = plan->twiddle[i];
+   }
+   if(n == 1) {
+      plan->factors[0] = 1;
+      plan->factors[1] = 1;
+   } else {
+      factorize(plan);
+   }
+
+   int radix = 1;
+   for(int i = 0; ; i += 2) {
+      if(plan->factors[i] > radix)
+         radix = plan->factors[i];
+      if(plan->factors[i+1] == 1)
+         break;
+   }
+   plan->scratch   = malloc(sizeof(double complex)*radix);
+   plan->scratch_f = malloc(sizeof(float complex)*radix);
+   if(plan->scratch == NULL || plan->scratch_f == NULL) {
+      fft_plan_free(plan);
+      return NULL;
+   }
+   return plan;
+}
+
+int fft_plan_size(struct fft_plan *plan) {
+   return plan->n;
+}
+
+// The largest size up to 'n' with no factor above 7, so a capture file of
+// any length can be cut to one that doesn't fall to an O(p^2) butterfly
+int fft_size_below(int n) {
+   for(; n > 1; n--) {
+      int m = n;
+      for(int p = 2; p <= 7; p++)
+         while(m % p == 0)
+            m /= p;
+      if(m == 1)
+         break;
+   }
+   return n;
+}
+
+void fft_plan_free(struct fft_plan *plan) {
+   if(plan == NULL)
+      return;
+   free(plan->twiddle);
+   free(plan->twiddle_f);
+   free(plan->scratch);
+   free(plan->scratch_f);
+   free(plan);
+}
+
+//=========================================================================================
+#define FFT_REAL      double
+#define FFT_COMPLEX   double complex
+#define FFT_TWIDDLE   twiddle
+#define FFT_SCRATCH   scratch
+#define FFT_NAME(x)   x
+#include "fft_impl.h"
+
+#define FFT_REAL      float
+#define FFT_COMPLEX   float complex
+#define FFT_TWIDDLE   twiddle_f
+#define FFT_SCRATCH   scratch_f
+#define FFT_NAME(x)   x##_f
+#include "fft_impl.h"
+
+// 'in' and 'out' must not overlap
+void fft_forward(struct fft_plan *plan, const double complex *in, double complex *out) {
+   work(plan, out, (const double *)in, 0, 1, plan->factors);
+}
+
+void fft_forward_real(struct fft_plan *plan, const double *in, double complex *out) {
+   work(plan, out, in, 1, 1, plan->factors);
+}
+
+void fft_forward_float(struct fft_plan *plan, const float complex *in, float complex *out) {
+   work_f(plan, out, (const float *)in, 0, 1, plan->factors);
+}
+
+void fft_forward_real_float(struct fft_plan *plan, const float *in, float complex *out) {
+   work_f(plan, out, in, 1, 1, plan->factors);
+}
+
+// Scaled by 1/n, so it undoes fft_forward(). Done as conj(fft(conj(in)))/n,
+// so 'in' is conjugated in place during the call and put back after.
+void fft_inverse(struct fft_plan *plan, double complex *in, double complex *out) {
+   int n = plan->n;
+
+   for(int i = 0; i < n; i++)
+      in[i] = conj(in[i]);
+   work(plan, out, (const double *)in, 0, 1, plan->factors);
+   for(int i = 0; i < n; i++) {
+      in[i]  = conj(in[i]);
+      out[i] = conj(out[i])/n;
+   }
+}
@@ -0,0 +1,20 @@
+#ifndef FFT_H
+#define FFT_H
+#include <complex.h>
+
+// A plan holds the twiddles for one size and the scratch space for its
+// larger radices, so nothing is allocated per transform. Because of the
+// scratch, a plan must not be used by two threads at once; give each
+// thread its own.
+struct fft_plan;
+
+struct fft_plan *fft_plan_new(int n);
+int fft_plan_size(struct fft_plan *plan);
+int fft_size_below(int n);
+void fft_forward(struct fft_plan *plan, const double complex *in, double complex *out);
+void fft_forward_real(struct fft_plan *plan, const double *in, double complex *out);
+void fft_forward_float(struct fft_plan *plan, const float complex *in, float complex *out);
+void fft_forward_real_float(struct fft_plan *plan, const float *in, float complex *out);
+void fft_inverse(struct fft_plan *plan, double complex *in, double complex *out);
+void fft_plan_free(struct fft_plan *plan);
+#endif
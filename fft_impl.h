@@ -0,0 +1,102 @@
+// The butterflies and recursion of fft.c, for one sample type. Included once
+// per type with FFT_REAL, FFT_COMPLEX, FFT_TWIDDLE and FFT_SCRATCH (the
+// plan's buffers of that type) and FFT_NAME(x) (the name for x) defined.
+
+static void FFT_NAME(bfly2)(FFT_COMPLEX *out, const FFT_COMPLEX *tw, int fstride, int m) {
+   for(int k = 0; k < m; k++) {
+      FFT_COMPLEX t = out[k+m] * tw[k*fstride];
+      out[k+m] = out[k] - t;
+      out[k]  += t;
+   }
+}
+
+static void FFT_NAME(bfly3)(FFT_COMPLEX *out, const FFT_COMPLEX *tw, int fstride, int m) {
+   FFT_REAL epi3 = cimag(tw[fstride*m]);
+
+   for(int k = 0; k < m; k++) {
+      FFT_COMPLEX t1 = out[k+m]   * tw[k*fstride];
+      FFT_COMPLEX t2 = out[k+2*m] * tw[2*k*fstride];
+      FFT_COMPLEX s3 = t1 + t2;
+      FFT_COMPLEX s0 = (t1 - t2) * epi3;
+
+      out[k+m]   = out[k] - s3*(FFT_REAL)0.5;
+      out[k]    += s3;
+      out[k+2*m] = out[k+m] - I*s0;
+      out[k+m]  += I*s0;
+   }
+}
+
+static void FFT_NAME(bfly4)(FFT_COMPLEX *out, const FFT_COMPLEX *tw, int fstride, int m) {
+   for(int k = 0; k < m; k++) {
+      FFT_COMPLEX s0 = out[k+m]   * tw[k*fstride];
+      FFT_COMPLEX s1 = out[k+2*m] * tw[2*k*fstride];
+      FFT_COMPLEX s2 = out[k+3*m] * tw[3*k*fstride];
+      FFT_COMPLEX s5 = out[k] - s1;
+      FFT_COMPLEX s3 = s0 + s2;
+      FFT_COMPLEX s4 = s0 - s2;
+
+      out[k]    += s1;
+      out[k+2*m] = out[k] - s3;
+      out[k]    += s3;
+      out[k+m]   = s5 - I*s4;
+      out[k+3*m] = s5 + I*s4;
+   }
+}
+
+// 'scratch' holds at least p values
+static void FFT_NAME(bfly_generic)(FFT_COMPLEX *out, const FFT_COMPLEX *tw, FFT_COMPLEX *scratch, int fstride, int m, int p, int n) {
+   for(int u = 0; u < m; u++) {
+      for(int q = 0; q < p; q++)
+         scratch[q] = out[u+q*m];
+
+      for(int q1 = 0; q1 < p; q1++) {
+         int k = u+q1*m;
+         int step = fstride*k;
+         int index = 0;
+         FFT_COMPLEX sum = scratch[0];
+         for(int q = 1; q < p; q++) {
+            index += step;
+            if(index >= n)
+               index -= n;
+            sum += scratch[q] * tw[index];
+         }
+         out[k] = sum;
+      }
+   }
+}
+
+// 'in' points to FFT_REALs, 'is_real' selects between real input and
+// interleaved real/imaginary pairs.
+static void FFT_NAME(work)(const struct fft_plan *plan, FFT_COMPLEX *out, const FFT_REAL *in, int is_real, int fstride, const int *factors) {
+   int p = factors[0];
+   int m = factors[1];
+   int in_step = fstride * (is_real ? 1 : 2);
+   FFT_COMPLEX *o = out;
+
+   if(m == 1) {
+      for(int q = 0; q < p; q++) {
+         *o++ = is_real ? in[0] : in[0] + I*in[1];
+         in += in_step;
+      }
+   } else {
+      for(int q = 0; q < p; q++) {
+         FFT_NAME(work)(plan, o, in, is_real, fstride*p, factors+2);
+         in += in_step;
+         o  += m;
+      }
+   }
+
+   switch(p) {
+      case 1:  break;
+      case 2:  FFT_NAME(bfly2)(out, plan->FFT_TWIDDLE, fstride, m); break;
+      case 3:  FFT_NAME(bfly3)(out, plan->FFT_TWIDDLE, fstride, m); break;
+      case 4:  FFT_NAME(bfly4)(out, plan->FFT_TWIDDLE, fstride, m); break;
+      default: FFT_NAME(bfly_generic)(out, plan->FFT_TWIDDLE, plan->FFT_SCRATCH, fstride, m, p, plan->n); break;
+   }
+}
+
+#undef FFT_REAL
+#undef FFT_COMPLEX
+#undef FFT_TWIDDLE
+#undef FFT_SCRATCH
+#undef FFT_NAME
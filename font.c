@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+#include "font.h"
+#include "font_ML.h"
+
+const struct font font_ml = {
+   FONT_ATLAS_WIDTH, FONT_ATLAS_HEIGHT, FONT_ATLAS_WIDTH/16, FONT_ATLAS_HEIGHT/6, font_atlas
+};
@@ -0,0 +1,17 @@
+#ifndef FONT_H
+#define FONT_H
+#include <stdint.h>
+
+// A fixed width font of characters 32 to 127, in 16 columns by 6 rows.
+// Each byte is how much of that pixel is covered by the glyph, 0 to 255.
+struct font {
+   int width;           // of the whole atlas
+   int height;
+   int char_width;
+   int char_height;
+   const uint8_t *coverage;
+};
+
+// Built in from font_ML.ppm
+extern const struct font font_ml;
+#endif
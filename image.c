@@ -2,23 +2,42 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "font.h"
 #include "image.h"
 
+// One contiguous buffer of 'height' rows, each 'stride' bytes apart
 struct image {
    int width;
    int height;
+   int stride;
    int8_t h_align;
    int8_t v_align;
-   struct image *font;
+   const struct font *font;
    int x,y;
    uint8_t r,g,b;
-   uint8_t **data;
+   uint8_t *data;
+   void *map;           // set if 'data' points into a mapped file
+   size_t map_size;
 };
 
-struct image *image_new(int w, int h) {
+#define IMAGE_ALIGN 64
+
+static uint8_t *image_row(struct image *img, int y) {
+   return img->data + (size_t)y*img->stride;
+}
+
+// Everything but the pixels
+static struct image *image_alloc(int w, int h, int stride) {
    struct image *img;
-   int i;
 
    img = malloc(sizeof(struct image));
    if(img == NULL)
@@ -26,6 +45,7 @@ struct image *image_new(int w, int h) {
 
    img->width  = w;
    img->height = h;
+   img->stride = stride;
 
    img->x = 0;
    img->y = 0;
@@ -37,34 +57,30 @@ struct image *image_new(int w, int h) {
    img->b = 0;
 
    img->font = NULL;
-   img->data = malloc(sizeof(char *)*h);
-   if(img->data == NULL) {
-      free(img);
-      return NULL;
-   }
- 
-   memset(img->data,0,sizeof(char *)*h);
+   img->data = NULL;
+   img->map  = NULL;
+   img->map_size = 0;
+   return img;
+}
 
-   for(i = 0; i < h; i++) {
-      img->data[i] = malloc(w*3);
-      if(img->data[i] == NULL)
-         break;
-      memset(img->data[i],255,w*3);
-   }
-   if(i != h) {
-      for(i = 0; i < h; i++) {
-         if(img->data[i] != NULL) {
-            free(img->data[i]);
-         }
-      }
-      free(img->data);
+struct image *image_new(int w, int h) {
+   struct image *img;
+   void *data;
+   int stride = (w*3 + 15) & ~15;
+
+   img = image_alloc(w, h, stride);
+   if(img == NULL)
+      return NULL;
+   if(posix_memalign(&data, IMAGE_ALIGN, (size_t)stride*h) != 0) {
       free(img);
       return NULL;
    }
+   img->data = data;
+   memset(img->data, 255, (size_t)stride*h);
    return img;
 }
 
-void image_set_font(struct image *img, struct image *font) {
+void image_set_font(struct image *img, const struct font *font) {
    img->font = font;
 }
 
@@ -79,23 +95,119 @@ void image_set_colour(struct image *img, uint8_t r, uint8_t g, uint8_t b) {
    img->b = b;
 }
 void image_set_pixel(struct image *img, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-   if(y <= 0) return;
-   if(x <= 0) return;
+   if(y < 0) return;
+   if(x < 0) return;
    if(x >= img->width) return; 
    if(y >= img->height) return; 
-   img->data[y][(x)*3+0] = r;
-   img->data[y][(x)*3+1] = g;
-   img->data[y][(x)*3+2] = b;
+   uint8_t *p = image_row(img, y) + x*3;
+   p[0] = r;
+   p[1] = g;
+   p[2] = b;
+}
 
+// Fill 'w' pixels from 'p' with the current colour. Grey is a memset,
+// anything else is one pixel doubled up with memcpy
+static void fill_span(struct image *img, uint8_t *p, int w) {
+   int done;
+
+   if(img->r == img->g && img->g == img->b) {
+      memset(p, img->r, w*3);
+      return;
+   }
+   p[0] = img->r;
+   p[1] = img->g;
+   p[2] = img->b;
+   for(done = 1; done < w; done *= 2)
+      memcpy(p + done*3, p, (done*2 <= w ? done : w-done)*3);
+}
+
+void image_hline(struct image *img, int x, int y, int w) {
+   if(y < 0 || y >= img->height) return;
+   if(x < 0) {
+      w += x;
+      x = 0;
+   }
+   if(x+w > img->width)
+      w = img->width - x;
+   if(w <= 0) return;
+   fill_span(img, image_row(img, y) + x*3, w);
+}
+
+void image_vline(struct image *img, int x, int y, int h) {
+   if(x < 0 || x >= img->width) return;
+   if(y < 0) {
+      h += y;
+      y = 0;
+   }
+   if(y+h > img->height)
+      h = img->height - y;
+   if(h <= 0) return;
+
+   uint8_t *p = image_row(img, y) + x*3;
+   for(int i = 0; i < h; i++) {
+      p[0] = img->r;
+      p[1] = img->g;
+      p[2] = img->b;
+      p += img->stride;
+   }
 }
-void image_rectangle(struct image *img, int x, int y, int w, int h) {
-   int i,j;
 
-   if(y+h <= 0) return;
-   if(x+w <= 0) return;
-   if(x > img->width) return; 
-   if(y > img->height) return; 
+// Liang-Barsky: narrow [*t0, *t1] to where p*t <= q
+static int clip_edge(double p, double q, double *t0, double *t1) {
+   if(p == 0)
+      return q >= 0;
+   double t = q/p;
+   if(p < 0) {
+      if(t > *t1) return 0;
+      if(t > *t0) *t0 = t;
+   } else {
+      if(t < *t0) return 0;
+      if(t < *t1) *t1 = t;
+   }
+   return 1;
+}
+
+// Both ends are drawn. The line is clipped to the image first, so only the
+// visible part is stepped through
+void image_line(struct image *img, int x0, int y0, int x1, int y1) {
+   if(y0 == y1) {
+      image_hline(img, x0 < x1 ? x0 : x1, y0, abs(x1-x0)+1);
+      return;
+   }
+   if(x0 == x1) {
+      image_vline(img, x0, y0 < y1 ? y0 : y1, abs(y1-y0)+1);
+      return;
+   }
+
+   double t0 = 0.0, t1 = 1.0;
+   double dx = x1-x0, dy = y1-y0;
+   if(!clip_edge(-dx, x0, &t0, &t1) || !clip_edge(dx, img->width-1-x0, &t0, &t1) ||
+      !clip_edge(-dy, y0, &t0, &t1) || !clip_edge(dy, img->height-1-y0, &t0, &t1))
+      return;
+   int cx0 = x0 + lrint(t0*dx), cy0 = y0 + lrint(t0*dy);
+   int cx1 = x0 + lrint(t1*dx), cy1 = y0 + lrint(t1*dy);
+
+   // Bresenham over the clipped part
+   int sx = cx0 < cx1 ? 1 : -1, sy = cy0 < cy1 ? 1 : -1;
+   int ax = abs(cx1-cx0), ay = -abs(cy1-cy0);
+   int err = ax+ay;
+   for(;;) {
+      image_set_pixel(img, cx0, cy0, img->r, img->g, img->b);
+      if(cx0 == cx1 && cy0 == cy1)
+         break;
+      int e2 = 2*err;
+      if(e2 >= ay) {
+         err += ay;
+         cx0 += sx;
+      }
+      if(e2 <= ax) {
+         err += ax;
+         cy0 += sy;
+      }
+   }
+}
 
+void image_rectangle(struct image *img, int x, int y, int w, int h) {
    if(x < 0) {
       w += x;
       x = 0;
@@ -103,27 +215,30 @@ void image_rectangle(struct image *img, int x, int y, int w, int h) {
    if(x+w > img->width) {
      w = img->width -x;
    }
-   if(y+h > img->height) {
-     h = img->height -y;
-   }
-
    if(y < 0) {
       h += y;
       y = 0;
    }
-
-   for(j = 0; j < h; j++) {
-      for(i = 0; i < w; i++) {
-         img->data[j+y][(x+i)*3+0] = img->r;
-         img->data[j+y][(x+i)*3+1] = img->g;
-         img->data[j+y][(x+i)*3+2] = img->b;
-      }
+   if(y+h > img->height) {
+     h = img->height -y;
    }
+   if(w <= 0 || h <= 0) return;
+
+   // Fill the first row, then copy it down
+   fill_span(img, image_row(img, y) + x*3, w);
+   for(int j = 1; j < h; j++)
+      memcpy(image_row(img, y+j) + x*3, image_row(img, y) + x*3, w*3);
 }
 
+// PNG if the name ends in .png, otherwise binary PPM
 int image_write(struct image *img, char *fname) {
   int i;
   FILE *f;
+  const char *ext = strrchr(fname, '.');
+
+  if(ext != NULL && strcasecmp(ext, ".png") == 0) {
+     return image_write_png(img, fname, IMAGE_PNG_FAST);
+  }
 
   if(img == NULL) {
      return 0;
@@ -133,40 +248,438 @@ int image_write(struct image *img, char *fname) {
      return 0;
   }
 
-  for(i = 0;i < img->height; i++) {
-     if(img->data[i] == NULL) {
-        return 0;
-     }
-  }
-
   f = fopen(fname,"w");
   if(f == NULL) {
      return 0;
   }
 
   fprintf(f,"P6\n%i %i\n255\n", img->width, img->height);
-  for(i = 0;i < img->height; i++) {
-     if(fwrite(img->data[i],3,img->width,f) != img->width) {
+  if(img->stride == img->width*3) {
+     // Rows are packed, the whole image goes in one write
+     if(fwrite(img->data, img->stride, img->height, f) != img->height) {
         fclose(f);
         return 0;
      }
+  } else {
+     for(i = 0;i < img->height; i++) {
+        if(fwrite(image_row(img, i), 3, img->width, f) != img->width) {
+           fclose(f);
+           return 0;
+        }
+     }
   }
 
-  fclose(f);
+  if(fclose(f) != 0) {
+     return 0;
+  }
   return 1;
 }
-void image_free(struct image *img) {
+//=========================================================================================
+// PNG output. Rows are filtered and deflated as they are produced, using
+// fixed Huffman codes and a hash chain match finder, so there is nothing
+// to link against. The compressed stream goes out in 64K IDAT chunks.
+//=========================================================================================
+#define PNG_WSIZE      32768
+#define PNG_WMASK      (PNG_WSIZE-1)
+#define PNG_HASH_SIZE  32768
+#define PNG_MIN_MATCH  3
+#define PNG_MAX_MATCH  258
+#define PNG_IDAT_SIZE  65536
+#define PNG_BUF_WINDOWS 8     // rows are buffered this many windows deep between slides
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                       35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                       3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                        8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+struct png_writer {
+   FILE *f;
+   int error;
+   int max_chain;           // match candidates tried per position
+   int max_insert;          // longer matches only hash their first position
+   int fast;
+   uint32_t crc_table[256];
+   uint16_t lit_code[288];  // fixed Huffman codes, bit reversed
+   uint8_t  lit_bits[288];
+   uint8_t  len_code[PNG_MAX_MATCH+1];
+
+   // Filtered rows, after up to 32K of history. 'pos' is the next byte to
+   // deflate and 'end' the end of the data
+   uint8_t *buf;
+   int buf_size;
+   int pos;
+   int end;
+   int32_t head[PNG_HASH_SIZE];
+   int32_t prev[PNG_WSIZE];
+   uint32_t adler_a, adler_b;
+   uint8_t *row_best;
+   uint8_t *row_try;
+
+   uint64_t bits;
+   int bit_count;
+   uint8_t out[PNG_IDAT_SIZE];
+   int out_len;
+};
+
+static void put_be32(uint8_t *p, uint32_t v) {
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+static uint32_t crc_update(const uint32_t *table, uint32_t crc, const uint8_t *p, size_t n) {
+   while(n--)
+      crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   return crc;
+}
+
+static void png_chunk(struct png_writer *w, const char *type, const uint8_t *data, uint32_t len) {
+   uint8_t hdr[8], tail[4];
+   uint32_t crc;
+
+   put_be32(hdr, len);
+   memcpy(hdr+4, type, 4);
+   crc = crc_update(w->crc_table, 0xffffffff, hdr+4, 4);
+   crc = crc_update(w->crc_table, crc, data, len) ^ 0xffffffff;
+   put_be32(tail, crc);
+   if(fwrite(hdr, 1, 8, w->f) != 8 || (len > 0 && fwrite(data, 1, len, w->f) != len) || fwrite(tail, 1, 4, w->f) != 4)
+      w->error = 1;
+}
+
+// Deflate writes its bits least significant first
+static void put_bits(struct png_writer *w, uint32_t value, int n) {
+   w->bits |= (uint64_t)value << w->bit_count;
+   w->bit_count += n;
+   while(w->bit_count >= 8) {
+      w->out[w->out_len++] = w->bits;
+      w->bits >>= 8;
+      w->bit_count -= 8;
+      if(w->out_len == PNG_IDAT_SIZE) {
+         png_chunk(w, "IDAT", w->out, w->out_len);
+         w->out_len = 0;
+      }
+   }
+}
+
+static uint32_t reverse_bits(uint32_t code, int n) {
+   uint32_t r = 0;
+   while(n--) {
+      r = (r << 1) | (code & 1);
+      code >>= 1;
+   }
+   return r;
+}
+
+static void png_tables(struct png_writer *w) {
+   for(uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for(int k = 0; k < 8; k++)
+         c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      w->crc_table[n] = c;
+   }
+   for(int v = 0; v < 288; v++) {
+      uint32_t code;
+      int n;
+      if(v < 144)      { code = 0x30 + v;        n = 8; }
+      else if(v < 256) { code = 0x190 + v - 144; n = 9; }
+      else if(v < 280) { code = v - 256;         n = 7; }
+      else             { code = 0xc0 + v - 280;  n = 8; }
+      w->lit_code[v] = reverse_bits(code, n);
+      w->lit_bits[v] = n;
+   }
+   // 258 has a code of its own, so it is filled in last
+   for(int c = 0; c < 29; c++) {
+      for(int l = len_base[c]; l < len_base[c] + (1 << len_extra[c]) && l <= PNG_MAX_MATCH; l++)
+         w->len_code[l] = c;
+   }
+}
+
+static void put_match(struct png_writer *w, int len, int dist) {
+   int lc = w->len_code[len];
+   int dc = 29;
+
+   put_bits(w, w->lit_code[257+lc], w->lit_bits[257+lc]);
+   put_bits(w, len - len_base[lc], len_extra[lc]);
+   while(dist_base[dc] > dist)
+      dc--;
+   put_bits(w, reverse_bits(dc, 5), 5);
+   put_bits(w, dist - dist_base[dc], dist_extra[dc]);
+}
+
+static uint32_t hash3(const uint8_t *p) {
+   return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (PNG_HASH_SIZE-1);
+}
+
+static void insert(struct png_writer *w, int pos) {
+   uint32_t h = hash3(w->buf+pos);
+   w->prev[pos & PNG_WMASK] = w->head[h];
+   w->head[h] = pos;
+}
+
+static int match_length(const uint8_t *p, const uint8_t *q, int max_len) {
+   int l = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   // Eight bytes at a time, the first differing byte is the lowest set one
+   for(; l+8 <= max_len; l += 8) {
+      uint64_t a, b;
+      memcpy(&a, p+l, 8);
+      memcpy(&b, q+l, 8);
+      if(a != b)
+         return l + (__builtin_ctzll(a ^ b) >> 3);
+   }
+#endif
+   while(l < max_len && p[l] == q[l])
+      l++;
+   return l;
+}
+
+// Greedy LZ77 over [pos, end). Unless flushing, the last PNG_MAX_MATCH
+// bytes are held back so a match can run on into the next row
+static void deflate_data(struct png_writer *w, int flush) {
+   int limit = flush ? w->end : w->end - PNG_MAX_MATCH;
+
+   while(w->pos < limit) {
+      int pos = w->pos;
+      int avail = w->end - pos;
+      int best_len = 0, best_dist = 0;
+      const uint8_t *p = w->buf+pos;
+
+      if(avail >= PNG_MIN_MATCH) {
+         int max_len = avail < PNG_MAX_MATCH ? avail : PNG_MAX_MATCH;
+         int cand = w->head[hash3(p)];
+         int chain = w->max_chain;
+
+         while(cand >= 0 && pos - cand < PNG_WSIZE && chain-- > 0) {
+            const uint8_t *q = w->buf+cand;
+            if(q[best_len] == p[best_len]) {
+               int l = match_length(p, q, max_len);
+               if(l > best_len) {
+                  best_len  = l;
+                  best_dist = pos - cand;
+                  if(l == max_len)
+                     break;
+               }
+            }
+            cand = w->prev[cand & PNG_WMASK];
+         }
+         insert(w, pos);
+      }
+
+      if(best_len >= PNG_MIN_MATCH) {
+         put_match(w, best_len, best_dist);
+         if(best_len <= w->max_insert) {
+            for(int i = 1; i < best_len && pos+i+PNG_MIN_MATCH <= w->end; i++)
+               insert(w, pos+i);
+         }
+         w->pos += best_len;
+      } else {
+         put_bits(w, w->lit_code[*p], w->lit_bits[*p]);
+         w->pos++;
+      }
+   }
+}
+
+// Drop everything older than the 32K window. The shift is a whole number
+// of windows so positions keep their slots in 'prev'
+static void slide(struct png_writer *w) {
+   int shift = (w->pos - PNG_WSIZE) & ~PNG_WMASK;
+
+   memmove(w->buf, w->buf+shift, w->end-shift);
+   w->pos -= shift;
+   w->end -= shift;
+   for(int i = 0; i < PNG_HASH_SIZE; i++)
+      w->head[i] = w->head[i] >= shift ? w->head[i]-shift : -1;
+   for(int i = 0; i < PNG_WSIZE; i++)
+      w->prev[i] = w->prev[i] >= shift ? w->prev[i]-shift : -1;
+}
+
+static void adler_update(struct png_writer *w, const uint8_t *p, int n) {
+   uint32_t a = w->adler_a, b = w->adler_b;
+   while(n > 0) {
+      // The most bytes before b can overflow
+      int k = n < 5552 ? n : 5552;
+      n -= k;
+      while(k--) {
+         a += *p++;
+         b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+   }
+   w->adler_a = a;
+   w->adler_b = b;
+}
+
+static int paeth(int a, int b, int c) {
+   int p  = a + b - c;
+   int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+   if(pa <= pb && pa <= pc) return a;
+   if(pb <= pc) return b;
+   return c;
+}
+
+// Filter 'row' with filter 'type' into out[1..n]
+static void filter_row(int type, const uint8_t *row, const uint8_t *up, int n, uint8_t *out) {
    int i;
-   if(img->data != NULL) {
-      for(i = 0; i < img->height; i++) {
-         if(img->data[i] != NULL) {
-            free(img->data[i]);
+
+   out[0] = type;
+   out++;
+   switch(type) {
+      case 1:
+         for(i = 0; i < 3 && i < n; i++)
+            out[i] = row[i];
+         for(; i < n; i++)
+            out[i] = row[i] - row[i-3];
+         break;
+      case 2:
+         for(i = 0; i < n; i++)
+            out[i] = row[i] - up[i];
+         break;
+      case 4:
+         for(i = 0; i < 3 && i < n; i++)
+            out[i] = row[i] - up[i];
+         for(; i < n; i++)
+            out[i] = row[i] - paeth(row[i-3], up[i], up[i-3]);
+         break;
+      default:
+         memcpy(out, row, n);
+         break;
+   }
+}
+
+// The usual sum of absolute differences guess at how well a filtered row
+// will compress
+static int filter_cost(const uint8_t *out, int n) {
+   int cost = 0;
+   for(int i = 1; i <= n; i++)
+      cost += out[i] < 128 ? out[i] : 256 - out[i];
+   return cost;
+}
+
+// The fast level always uses Up. Most rows of a graph repeat the one above,
+// or nearly so, and that filters to (nearly) all zeros. Other levels pick
+// the best looking of all four filters for each row
+static void png_row(struct png_writer *w, const uint8_t *row, const uint8_t *up, int n) {
+   static const int types[] = { 1, 2, 4 };
+   int tries = up == NULL ? 1 : 3;
+   int best_cost;
+
+   if(up != NULL && (w->fast || memcmp(row, up, n) == 0)) {
+      filter_row(2, row, up, n, w->row_best);
+   } else {
+      filter_row(0, row, up, n, w->row_best);
+      best_cost = filter_cost(w->row_best, n);
+      for(int i = 0; i < tries; i++) {
+         filter_row(types[i], row, up, n, w->row_try);
+         int cost = filter_cost(w->row_try, n);
+         if(cost < best_cost) {
+            uint8_t *t  = w->row_best;
+            w->row_best = w->row_try;
+            w->row_try  = t;
+            best_cost   = cost;
          }
       }
-      free(img->data);
    }
+
+   if(w->end + n+1 > w->buf_size)
+      slide(w);
+   memcpy(w->buf+w->end, w->row_best, n+1);
+   adler_update(w, w->row_best, n+1);
+   w->end += n+1;
+   deflate_data(w, 0);
 }
 
+int image_write_png(struct image *img, char *fname, int level) {
+   struct png_writer *w;
+   uint8_t ihdr[13], adler[4];
+   int row_len, ok;
+
+   if(img == NULL || img->data == NULL)
+      return 0;
+   row_len = img->width*3;
+   if(level < IMAGE_PNG_FAST) level = IMAGE_PNG_FAST;
+   if(level > IMAGE_PNG_BEST) level = IMAGE_PNG_BEST;
+
+   w = malloc(sizeof(struct png_writer));
+   if(w == NULL)
+      return 0;
+   memset(w, 0, sizeof(*w));
+   w->max_chain  = 2 << level;
+   w->max_insert = level == IMAGE_PNG_FAST ? 4 : PNG_MAX_MATCH;
+   w->fast       = level == IMAGE_PNG_FAST;
+   w->buf_size   = PNG_BUF_WINDOWS*PNG_WSIZE + PNG_MAX_MATCH + row_len+1;
+   w->buf        = malloc(w->buf_size);
+   w->row_best   = malloc(row_len+1);
+   w->row_try    = malloc(row_len+1);
+   w->adler_a    = 1;
+   w->f          = fopen(fname, "wb");
+   if(w->buf == NULL || w->row_best == NULL || w->row_try == NULL || w->f == NULL) {
+      ok = 0;
+      goto done;
+   }
+   memset(w->head, 0xff, sizeof(w->head));
+   memset(w->prev, 0xff, sizeof(w->prev));
+   png_tables(w);
+
+   if(fwrite("\x89PNG\r\n\x1a\n", 1, 8, w->f) != 8)
+      w->error = 1;
+   put_be32(ihdr, img->width);
+   put_be32(ihdr+4, img->height);
+   ihdr[8]  = 8;     // bits per sample
+   ihdr[9]  = 2;     // RGB
+   ihdr[10] = 0;     // deflate
+   ihdr[11] = 0;     // adaptive filtering
+   ihdr[12] = 0;     // not interlaced
+   png_chunk(w, "IHDR", ihdr, sizeof(ihdr));
+
+   // zlib header for a 32K window, then one final block of fixed codes
+   put_bits(w, 0x78, 8);
+   put_bits(w, 0x01, 8);
+   put_bits(w, 1, 1);
+   put_bits(w, 1, 2);
+   for(int y = 0; y < img->height; y++)
+      png_row(w, image_row(img, y), y > 0 ? image_row(img, y-1) : NULL, row_len);
+   deflate_data(w, 1);
+   put_bits(w, w->lit_code[256], w->lit_bits[256]);
+   if(w->bit_count > 0)
+      put_bits(w, 0, 8 - w->bit_count);
+   put_be32(adler, (w->adler_b << 16) | w->adler_a);
+   for(int i = 0; i < 4; i++)
+      put_bits(w, adler[i], 8);
+   png_chunk(w, "IDAT", w->out, w->out_len);
+   png_chunk(w, "IEND", NULL, 0);
+   ok = !w->error;
+
+done:
+   if(w->f != NULL && fclose(w->f) != 0)
+      ok = 0;
+   free(w->buf);
+   free(w->row_best);
+   free(w->row_try);
+   free(w);
+   return ok;
+}
+
+void image_free(struct image *img) {
+   if(img->map != NULL)
+      munmap(img->map, img->map_size);
+   else
+      free(img->data);
+   free(img);
+}
+
+//=========================================================================================
+// PPM and PGM input. The file is mapped and the header parsed in place.
+// 8 bit RGB is used where it lies, the mapping is private so drawing on the
+// image never touches the file. Grey and 16 bit files are converted to 8
+// bit RGB in one pass.
+//=========================================================================================
 static int whitespace(char c) {
   if(c == ' ') return 1;
   if(c == '\t') return 1;
@@ -179,124 +692,123 @@ static int digit(char c) {
    return (c >= '0' && c <= '9');
 }
 
-struct image *image_from_ppm(char *file_name) {
-   FILE *file;
-   struct image *img;
-   int c, last_c = 0;
-   int width = 0, height = 0, maxval = 0;
+// Skips whitespace and comments, then reads a number. Returns -1 if there
+// isn't one
+static long header_number(const uint8_t *p, size_t size, size_t *pos) {
+   long n = 0;
 
-   file = fopen(file_name, "r");
-   if(file == NULL) {
-     fprintf(stderr,"File %s not able to be opened\n", file_name);
-     return 0;
+   while(*pos < size && (whitespace(p[*pos]) || p[*pos] == '#')) {
+      if(p[*pos] == '#') {
+         while(*pos < size && p[*pos] != '\n')
+            (*pos)++;
+      } else {
+         (*pos)++;
+      }
    }
-
-   c = getc(file);
-   if(c != 'P') {
-     goto format_error;
+   if(*pos >= size || !digit(p[*pos]))
+      return -1;
+   while(*pos < size && digit(p[*pos])) {
+      n = n*10 + p[(*pos)++]-'0';
+      if(n > 1000000)
+         return -1;
    }
+   return n;
+}
 
-   c = getc(file);
-   if(c != '6') {
-     goto format_error;
+static void convert_pixels(struct image *img, const uint8_t *src, int channels, int maxval) {
+   int bytes = maxval > 255 ? 2 : 1;
+
+   for(int y = 0; y < img->height; y++) {
+      uint8_t *dst = image_row(img, y);
+      for(int x = 0; x < img->width; x++) {
+         for(int c = 0; c < 3; c++) {
+            const uint8_t *s = src + (x*channels + (channels == 3 ? c : 0))*bytes;
+            unsigned v = bytes == 2 ? (s[0] << 8) | s[1] : s[0];
+            if(v > maxval)
+               v = maxval;
+            dst[3*x+c] = (v*255 + maxval/2)/maxval;
+         }
+      }
+      src += (size_t)img->width*channels*bytes;
    }
+}
 
-   c = getc(file);
-   while(whitespace(c)) {
-     last_c = c;
-     c = getc(file);
-     if(c == '#' && last_c == '\n') {
-       c = getc(file);
-       while(c != '\n' && c != EOF) {
-         c = getc(file);
-       }
-     }
+struct image *image_from_ppm(char *file_name) {
+   struct image *img = NULL;
+   struct stat st;
+   uint8_t *map;
+   size_t size, pos = 2;
+   long width, height, maxval;
+   int fd, channels, bytes;
+
+   fd = open(file_name, O_RDONLY);
+   if(fd < 0) {
+     fprintf(stderr,"File %s not able to be opened\n", file_name);
+     return NULL;
    }
-
-   if(!digit(c)) {
-     goto format_error;
+   if(fstat(fd, &st) != 0 || st.st_size < 8) {
+     close(fd);
+     fprintf(stderr,"File format error\n");
+     return NULL;
    }
-
-   while(digit(c)) {
-     width = (width*10)+(c-'0');
-     c = getc(file);
+   size = st.st_size;
+   map  = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED) {
+     fprintf(stderr,"Error reading data in %s\n", file_name);
+     return NULL;
    }
 
-   while(whitespace(c)) {
-     last_c = c;
-     c = getc(file);
-     if(c == '#' && last_c == '\n') {
-       c = getc(file);
-       while(c != '\n' && c != EOF) {
-         c = getc(file);
-       }
-     }
-   }
-
-   if(!digit(c)) {
+   if(map[0] != 'P' || (map[1] != '5' && map[1] != '6')) {
      goto format_error;
    }
-
-   while(digit(c)) {
-     height = (height*10)+(c-'0');
-     c = getc(file);
-   }
-
-   while(whitespace(c)) {
-     last_c = c;
-     c = getc(file);
-     if(c == '#' && last_c == '\n') {
-       c = getc(file);
-       while(c != '\n' && c != EOF) {
-         c = getc(file);
-       }
-     }
-   }
-
-   if(!digit(c)) {
+   channels = map[1] == '6' ? 3 : 1;
+   width    = header_number(map, size, &pos);
+   height   = header_number(map, size, &pos);
+   maxval   = header_number(map, size, &pos);
+   // Exactly one whitespace character before the pixels
+   if(width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535 || pos >= size || !whitespace(map[pos])) {
      goto format_error;
    }
-
-   while(digit(c)) {
-     maxval = (maxval*10)+(c-'0');
-     c = getc(file);
-   }
-
-   if(!whitespace(c)) {
+   pos++;
+   bytes = maxval > 255 ? 2 : 1;
+   if((size - pos)/((size_t)width*channels*bytes) < (size_t)height) {
      goto format_error;
    }
-   
-   if(maxval != 255) {
-     goto format_error;
+
+   if(channels == 3 && maxval == 255) {
+      img = image_alloc(width, height, width*3);
+      if(img == NULL) {
+        goto img_error;
+      }
+      img->data     = map + pos;
+      img->map      = map;
+      img->map_size = size;
+      return img;
    }
-   img = image_new(width,height);
 
+   img = image_new(width, height);
    if(img == NULL) {
      goto img_error;
    }
-   for(int i = 0; i < height; i++) {
-      if(fread(img->data[i],3, width,file) != width) {
-         goto read_error;
-      }
-   }
-   fclose(file);
+   convert_pixels(img, map + pos, channels, maxval);
+   munmap(map, size);
    return img;
 
-read_error:
-   image_free(img);
-   fprintf(stderr,"Error reading data in %s\n", file_name);
-   fclose(file);
-   return 0;
-
 img_error:
    fprintf(stderr,"Unable to create image %s\n", file_name);
-   fclose(file);
+   munmap(map, size);
    return NULL;
 
 format_error:
    fprintf(stderr,"File format error\n"); 
-   fclose(file);
-   return 0;
+   munmap(map, size);
+   return NULL;
+}
+
+// x/255 for x up to 255*255, without the divide
+static inline int div255(int x) {
+   return (x + 1 + (x >> 8)) >> 8;
 }
 
 int char_write(struct image *img, char c) {
@@ -306,8 +818,8 @@ int char_write(struct image *img, char c) {
    if(img->font == NULL) {
       return 1;
    }
-   char_width  = img->font->width/16;
-   char_height = img->font->height/6;
+   char_width  = img->font->char_width;
+   char_height = img->font->char_height;
    // Test to see if off the page //
    if(img->y >= img->height || img->x >= img->width || img->y <= -char_height || img->x <= -char_width) {
       return 1;
@@ -319,7 +831,7 @@ int char_write(struct image *img, char c) {
    fx = (c%16)*char_width;
    fy = (c/16)*char_height;
 
-   for(dy = 0; dy < img->font->height/6 && img->y+dy < img->height; dy++) {
+   for(dy = 0; dy < char_height && img->y+dy < img->height; dy++) {
       if(img->y+dy >= 0) {
          int copy_w = char_width;
          int offset = 0;
@@ -331,14 +843,15 @@ int char_write(struct image *img, char c) {
             offset = -img->x;
             copy_w -= offset;
          }
+         const uint8_t *src = img->font->coverage + (fy+dy)*img->font->width + fx+offset;
+         uint8_t *dst = image_row(img, img->y+dy) + 3*(img->x+offset);
          for(dx = 0; dx < copy_w; dx++) {
-           uint8_t mix_r = img->font->data[fy+dy][3*(fx+offset+dx)+0];
-           uint8_t mix_g = img->font->data[fy+dy][3*(fx+offset+dx)+1];
-           uint8_t mix_b = img->font->data[fy+dy][3*(fx+offset+dx)+2];
-           int tx = img->x+offset+dx;
-           img->data[img->y+dy][3*tx+0] = (img->data[img->y+dy][3*tx+0] * mix_r + img->r * (255-mix_r))/255;
-           img->data[img->y+dy][3*tx+1] = (img->data[img->y+dy][3*tx+1] * mix_g + img->g * (255-mix_g))/255;
-           img->data[img->y+dy][3*tx+2] = (img->data[img->y+dy][3*tx+2] * mix_b + img->b * (255-mix_b))/255;
+           int a = src[dx];
+           if(a == 0)
+              continue;
+           dst[3*dx+0] = div255(dst[3*dx+0] * (255-a) + img->r * a);
+           dst[3*dx+1] = div255(dst[3*dx+1] * (255-a) + img->g * a);
+           dst[3*dx+2] = div255(dst[3*dx+2] * (255-a) + img->b * a);
          }
       }
    }
@@ -372,8 +885,8 @@ int image_text(struct image *img, int x, int y, char *text) {
       if(this_width > width)
          width = this_width;
    }
-   width  *= img->font->width/16;
-   height *= img->font->height/6;
+   width  *= img->font->char_width;
+   height *= img->font->char_height;
 
    switch( img->h_align) {
       case -1:
@@ -400,11 +913,11 @@ int image_text(struct image *img, int x, int y, char *text) {
    while(*text) {
       if(*text == '\n') {
          cur_x = x;
-         y += img->font->height/6;
+         y += img->font->char_height;
       } else {
         image_set_pos(img, cur_x, y);
         char_write(img, *text);
-        cur_x += img->font->width/16;
+        cur_x += img->font->char_width;
       }
       text++;
    }
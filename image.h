@@ -1,11 +1,20 @@
 struct image *image_new(int w, int h);
 struct image *image_from_ppm(char *file_name);
-void image_set_font(struct image *img, struct image *font);
+struct font;
+void image_set_font(struct image *img, const struct font *font);
 int image_text(struct image *img, int x, int y, char *text);
 void image_set_pos(struct image *img, int x, int y);
 void image_set_colour(struct image *img, uint8_t r, uint8_t g, uint8_t b);
 void image_set_pixel(struct image *img, int x, int y, uint8_t r, uint8_t g, uint8_t b);
+// Spans, lines and rectangles use the current colour and are clipped to the image
+void image_hline(struct image *img, int x, int y, int w);
+void image_vline(struct image *img, int x, int y, int h);
+void image_line(struct image *img, int x0, int y0, int x1, int y1);
 void image_rectangle(struct image *img, int x, int y, int w, int h);
 int image_write(struct image *img, char *fname);
+// 'level' trades speed for size, from IMAGE_PNG_FAST to IMAGE_PNG_BEST
+#define IMAGE_PNG_FAST 1
+#define IMAGE_PNG_BEST 9
+int image_write_png(struct image *img, char *fname, int level);
 void image_set_text_align(struct image *img, int h_align, int v_align);
 void image_free(struct image *img);
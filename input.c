@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "input.h"
+
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+static unsigned int get16(const uint8_t *p) {
+   return p[0] | (p[1] << 8);
+}
+
+static unsigned long get32(const uint8_t *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static int supported(const struct input_file *f) {
+   if((f->format == INPUT_PCM   && (f->bits == 16 || f->bits == 24 || f->bits == 32)) ||
+      (f->format == INPUT_FLOAT && (f->bits == 32 || f->bits == 64)))
+      return 1;
+   fprintf(stderr,"Unsupported sample format %i with %i bits\n", f->format, f->bits);
+   return 0;
+}
+
+static int parse_wav(struct input_file *f, const uint8_t *p, size_t size) {
+   const uint8_t *fmt = NULL;
+   unsigned long fmt_len = 0;
+   size_t pos = 12;
+
+   while(pos + 8 <= size) {
+      unsigned long len = get32(p+pos+4);
+      const uint8_t *body = p+pos+8;
+
+      if(memcmp(p+pos, "fmt ", 4) == 0 && len >= 16 && len <= size-(pos+8)) {
+         fmt     = body;
+         fmt_len = len;
+      } else if(memcmp(p+pos, "data", 4) == 0) {
+         if(fmt == NULL) {
+            fprintf(stderr,"WAV data chunk before fmt chunk\n");
+            return 0;
+         }
+         f->format   = get16(fmt);
+         f->channels = get16(fmt+2);
+         f->rate     = get32(fmt+4);
+         f->bits     = get16(fmt+14);
+         if(f->format == WAVE_FORMAT_EXTENSIBLE && fmt_len >= 26 && get16(fmt+16) >= 22)
+            f->format = get16(fmt+24);     // first two bytes of the sub format GUID
+         // Before the bits are divided by, as 4 bit ADPCM would give 0 bytes
+         if(!supported(f))
+            return 0;
+
+         if(len > size-(pos+8))           // truncated, or still being written
+            len = size-(pos+8);
+         f->data = body;
+         if(f->channels > 0)
+            f->frames = len / (f->channels*(f->bits/8));
+         return 1;
+      }
+      pos += 8 + len + (len & 1);
+   }
+   fprintf(stderr,"No data chunk in WAV file\n");
+   return 0;
+}
+
+int input_open(struct input_file *f, const char *path, unsigned int raw_rate) {
+   struct stat st;
+   int fd;
+
+   memset(f, 0, sizeof(*f));
+   fd = open(path, O_RDONLY);
+   if(fd < 0) {
+      fprintf(stderr,"Unable to open %s\n", path);
+      return 0;
+   }
+   if(fstat(fd, &st) != 0 || st.st_size == 0) {
+      fprintf(stderr,"%s is empty\n", path);
+      close(fd);
+      return 0;
+   }
+   f->map_size = st.st_size;
+   f->map = mmap(NULL, f->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(f->map == MAP_FAILED) {
+      fprintf(stderr,"Unable to map %s\n", path);
+      f->map = NULL;
+      return 0;
+   }
+   madvise(f->map, f->map_size, MADV_SEQUENTIAL);
+
+   const uint8_t *p = f->map;
+   if(f->map_size >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p+8, "WAVE", 4) == 0) {
+      if(!parse_wav(f, p, f->map_size)) {
+         input_close(f);
+         return 0;
+      }
+   } else {
+      f->format   = INPUT_PCM;
+      f->channels = 2;
+      f->bits     = 16;
+      f->rate     = raw_rate;
+      f->data     = p;
+      f->frames   = f->map_size / 4;
+   }
+
+   if(f->channels < 1 || f->rate == 0 || f->frames == 0) {
+      fprintf(stderr,"%s has no usable audio\n", path);
+      input_close(f);
+      return 0;
+   }
+   return 1;
+}
+
+// One loop per format, so the inner loop is a plain strided load and
+// convert that the compiler can unroll. WAV is little endian, as are the
+// hosts this runs on.
+void input_read(const struct input_file *f, int channel, long first, long count, double *points) {
+   int stride = f->channels;
+   long i;
+
+   if(f->format == INPUT_FLOAT && f->bits == 32) {
+      const uint8_t *p = f->data + ((size_t)first*stride + channel)*4;
+      for(i = 0; i < count; i++) {
+         float v;
+         memcpy(&v, p + (size_t)i*stride*4, 4);
+         points[i] = v*32768.0;
+      }
+   } else if(f->format == INPUT_FLOAT) {
+      const uint8_t *p = f->data + ((size_t)first*stride + channel)*8;
+      for(i = 0; i < count; i++) {
+         double v;
+         memcpy(&v, p + (size_t)i*stride*8, 8);
+         points[i] = v*32768.0;
+      }
+   } else if(f->bits == 16) {
+      const uint8_t *p = f->data + ((size_t)first*stride + channel)*2;
+      for(i = 0; i < count; i++) {
+         int16_t v;
+         memcpy(&v, p + (size_t)i*stride*2, 2);
+         points[i] = v;
+      }
+   } else if(f->bits == 24) {
+      const uint8_t *p = f->data + ((size_t)first*stride + channel)*3;
+      for(i = 0; i < count; i++) {
+         const uint8_t *s = p + (size_t)i*stride*3;
+         int32_t v = (int32_t)((uint32_t)s[0] << 8 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 24);
+         points[i] = v/65536.0;
+      }
+   } else {
+      const uint8_t *p = f->data + ((size_t)first*stride + channel)*4;
+      for(i = 0; i < count; i++) {
+         int32_t v;
+         memcpy(&v, p + (size_t)i*stride*4, 4);
+         points[i] = v/65536.0;
+      }
+   }
+}
+
+void input_close(struct input_file *f) {
+   if(f->map != NULL)
+      munmap(f->map, f->map_size);
+   f->map = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef INPUT_H
+#define INPUT_H
+#include <stddef.h>
+#include <stdint.h>
+
+// A WAV or raw capture file, mmap'ed so samples are converted straight out
+// of the page cache. Raw files are taken to be what this tool captures:
+// 16 bit little endian, two channels.
+#define INPUT_PCM    1
+#define INPUT_FLOAT  3
+
+struct input_file {
+   void *map;
+   size_t map_size;
+   const uint8_t *data;     // first frame
+   long frames;
+   int channels;
+   int bits;                // per sample: 16, 24 or 32 (PCM), 32 or 64 (float)
+   int format;
+   unsigned int rate;
+};
+
+int input_open(struct input_file *f, const char *path, unsigned int raw_rate);
+// Convert 'count' frames of one channel, starting at 'first', to doubles
+// scaled to 16 bit full scale like the live capture
+void input_read(const struct input_file *f, int channel, long first, long count, double *points);
+void input_close(struct input_file *f);
+#endif
@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+// remove_sc() generates the sine and cosine with oscillators, these are
+// reseeded from the exact phase this often so rounding can't build up
+#define RESEED 1024
+
+static void exact_phase(long long i, int bin, int n, double *c, double *s) {
+   double phase = 2*M_PI*((i*bin) % n)/n;
+   *c = cos(phase);
+   *s = sin(phase);
+}
+
+//=========================================================================================
+// Plain C, also used to finish off the tails of the vector versions
+//=========================================================================================
+static void dot_sc_scalar(const double *points, const double *s_table, const double *c_table, int n, int bin, double *st, double *ct) {
+   double s = 0.0;
+   double c = 0.0;
+   int index = 0;
+   for(int i = 0; i < n; i++) {
+      s += points[i] * s_table[index];
+      c += points[i] * c_table[index];
+      index += bin;
+      if(index >= n)
+        index -= n;
+   }
+   *st = s;
+   *ct = c;
+}
+
+static double sum_sq_scalar(const double *points, int n) {
+   double sum = 0.0;
+   for(int i = 0; i < n; i++)
+      sum += points[i]*points[i];
+   return sum;
+}
+
+static void multiply_scalar(double *points, const double *window, int n) {
+   for(int i = 0; i < n; i++)
+      points[i] *= window[i];
+}
+
+static void remove_sc_scalar(double *points, int begin, int end, int n, int bin, double st, double ct) {
+   double rr, ri, zr = 1.0, zi = 0.0;
+
+   exact_phase(1, bin, n, &rr, &ri);
+   for(int i = begin; i < end; i++) {
+      if((i-begin) % RESEED == 0)
+         exact_phase(i, bin, n, &zr, &zi);
+      points[i] -= st*zi + ct*zr;
+      double t = zr*rr - zi*ri;
+      zi = zr*ri + zi*rr;
+      zr = t;
+   }
+}
+
+static void remove_sc_f_scalar(float *points, int begin, int end, int n, int bin, double st, double ct) {
+   double rr, ri, zr = 1.0, zi = 0.0;
+
+   exact_phase(1, bin, n, &rr, &ri);
+   for(int i = begin; i < end; i++) {
+      if((i-begin) % RESEED == 0)
+         exact_phase(i, bin, n, &zr, &zi);
+      points[i] -= st*zi + ct*zr;
+      double t = zr*rr - zi*ri;
+      zi = zr*ri + zi*rr;
+      zr = t;
+   }
+}
+
+// Frames [begin, end), so the SIMD versions can finish their tails here
+static void deinterleave_range(const int16_t *in, int begin, int end, int channels, double **out) {
+   for(int ch = 0; ch < channels; ch++) {
+      double *o = out[ch];
+      for(int i = begin; i < end; i++)
+         o[i] = in[i*channels+ch];
+   }
+}
+
+static void deinterleave_scalar(const int16_t *in, int frames, int channels, double **out) {
+   deinterleave_range(in, 0, frames, channels, out);
+}
+
+static const struct kernels kernels_scalar = {
+   "scalar", dot_sc_scalar, sum_sq_scalar, multiply_scalar, remove_sc_scalar, remove_sc_f_scalar,
+   deinterleave_scalar
+};
+
+#ifdef HAVE_X86
+//=========================================================================================
+// SSE2, two lanes
+//=========================================================================================
+__attribute__((target("sse2")))
+static void dot_sc_sse2(const double *points, const double *s_table, const double *c_table, int n, int bin, double *st, double *ct) {
+   __m128d vs = _mm_setzero_pd();
+   __m128d vc = _mm_setzero_pd();
+   double s[2], c[2];
+   int step = (2LL*bin) % n;
+   int i0 = 0, i1 = bin % n;
+   int i;
+
+   for(i = 0; i+2 <= n; i += 2) {
+      __m128d x = _mm_loadu_pd(points+i);
+      vs = _mm_add_pd(vs, _mm_mul_pd(x, _mm_set_pd(s_table[i1], s_table[i0])));
+      vc = _mm_add_pd(vc, _mm_mul_pd(x, _mm_set_pd(c_table[i1], c_table[i0])));
+      i0 += step; if(i0 >= n) i0 -= n;
+      i1 += step; if(i1 >= n) i1 -= n;
+   }
+   _mm_storeu_pd(s, vs);
+   _mm_storeu_pd(c, vc);
+   *st = s[0]+s[1];
+   *ct = c[0]+c[1];
+   for(; i < n; i++) {
+      int index = ((long long)i*bin) % n;
+      *st += points[i]*s_table[index];
+      *ct += points[i]*c_table[index];
+   }
+}
+
+__attribute__((target("sse2")))
+static double sum_sq_sse2(const double *points, int n) {
+   __m128d a0 = _mm_setzero_pd();
+   __m128d a1 = _mm_setzero_pd();
+   double sum[2];
+   int i;
+
+   for(i = 0; i+4 <= n; i += 4) {
+      __m128d x0 = _mm_loadu_pd(points+i);
+      __m128d x1 = _mm_loadu_pd(points+i+2);
+      a0 = _mm_add_pd(a0, _mm_mul_pd(x0, x0));
+      a1 = _mm_add_pd(a1, _mm_mul_pd(x1, x1));
+   }
+   _mm_storeu_pd(sum, _mm_add_pd(a0, a1));
+   return sum[0] + sum[1] + sum_sq_scalar(points+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static void multiply_sse2(double *points, const double *window, int n) {
+   int i;
+   for(i = 0; i+2 <= n; i += 2)
+      _mm_storeu_pd(points+i, _mm_mul_pd(_mm_loadu_pd(points+i), _mm_loadu_pd(window+i)));
+   multiply_scalar(points+i, window+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static void remove_sc_sse2(double *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m128d vst = _mm_set1_pd(st);
+   __m128d vct = _mm_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(2, bin, n, &rc, &rs);
+   __m128d rr = _mm_set1_pd(rc);
+   __m128d ri = _mm_set1_pd(rs);
+   while(i+2 <= end) {
+      double c[2], s[2];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      exact_phase(i,   bin, n, &c[0], &s[0]);
+      exact_phase(i+1, bin, n, &c[1], &s[1]);
+      __m128d zr = _mm_loadu_pd(c);
+      __m128d zi = _mm_loadu_pd(s);
+      for(; i+2 <= block_end; i += 2) {
+         __m128d f = _mm_add_pd(_mm_mul_pd(vst, zi), _mm_mul_pd(vct, zr));
+         _mm_storeu_pd(points+i, _mm_sub_pd(_mm_loadu_pd(points+i), f));
+         __m128d t = _mm_sub_pd(_mm_mul_pd(zr, rr), _mm_mul_pd(zi, ri));
+         zi = _mm_add_pd(_mm_mul_pd(zr, ri), _mm_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_scalar(points, i, end, n, bin, st, ct);
+}
+
+__attribute__((target("sse2")))
+static void remove_sc_f_sse2(float *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m128d vst = _mm_set1_pd(st);
+   __m128d vct = _mm_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(2, bin, n, &rc, &rs);
+   __m128d rr = _mm_set1_pd(rc);
+   __m128d ri = _mm_set1_pd(rs);
+   while(i+2 <= end) {
+      double c[2], s[2];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      exact_phase(i,   bin, n, &c[0], &s[0]);
+      exact_phase(i+1, bin, n, &c[1], &s[1]);
+      __m128d zr = _mm_loadu_pd(c);
+      __m128d zi = _mm_loadu_pd(s);
+      for(; i+2 <= block_end; i += 2) {
+         __m128d f = _mm_add_pd(_mm_mul_pd(vst, zi), _mm_mul_pd(vct, zr));
+         __m128d x = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(points+i))));
+         _mm_storel_epi64((__m128i *)(points+i), _mm_castps_si128(_mm_cvtpd_ps(_mm_sub_pd(x, f))));
+         __m128d t = _mm_sub_pd(_mm_mul_pd(zr, rr), _mm_mul_pd(zi, ri));
+         zi = _mm_add_pd(_mm_mul_pd(zr, ri), _mm_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_f_scalar(points, i, end, n, bin, st, ct);
+}
+
+// Only stereo is worth shuffling with two lanes, each 32 bit lane holds a
+// left and right pair that shifts split apart
+__attribute__((target("sse2")))
+static void deinterleave_sse2(const int16_t *in, int frames, int channels, double **out) {
+   int i = 0;
+
+   if(channels == 2) {
+      double *l = out[0], *r = out[1];
+      for(; i+4 <= frames; i += 4) {
+         __m128i v  = _mm_loadu_si128((const __m128i *)(in+i*2));
+         __m128i vl = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+         __m128i vr = _mm_srai_epi32(v, 16);
+         _mm_storeu_pd(l+i,   _mm_cvtepi32_pd(vl));
+         _mm_storeu_pd(l+i+2, _mm_cvtepi32_pd(_mm_shuffle_epi32(vl, _MM_SHUFFLE(1,0,3,2))));
+         _mm_storeu_pd(r+i,   _mm_cvtepi32_pd(vr));
+         _mm_storeu_pd(r+i+2, _mm_cvtepi32_pd(_mm_shuffle_epi32(vr, _MM_SHUFFLE(1,0,3,2))));
+      }
+   }
+   deinterleave_range(in, i, frames, channels, out);
+}
+
+static const struct kernels kernels_sse2 = {
+   "sse2", dot_sc_sse2, sum_sq_sse2, multiply_sse2, remove_sc_sse2, remove_sc_f_sse2,
+   deinterleave_sse2
+};
+
+//=========================================================================================
+// AVX2 with FMA, four lanes
+//=========================================================================================
+__attribute__((target("avx2,fma")))
+static double hsum_avx2(__m256d v) {
+   double d[4];
+   _mm256_storeu_pd(d, v);
+   return (d[0]+d[1]) + (d[2]+d[3]);
+}
+
+__attribute__((target("avx2,fma")))
+static void dot_sc_avx2(const double *points, const double *s_table, const double *c_table, int n, int bin, double *st, double *ct) {
+   __m256d vs = _mm256_setzero_pd();
+   __m256d vc = _mm256_setzero_pd();
+   __m128i vi    = _mm_setr_epi32(0, ((long long)bin) % n, (2LL*bin) % n, (3LL*bin) % n);
+   __m128i vstep = _mm_set1_epi32((4LL*bin) % n);
+   __m128i vn    = _mm_set1_epi32(n);
+   __m128i vlast = _mm_set1_epi32(n-1);
+   int i;
+
+   for(i = 0; i+4 <= n; i += 4) {
+      __m256d x = _mm256_loadu_pd(points+i);
+      vs = _mm256_fmadd_pd(x, _mm256_i32gather_pd(s_table, vi, 8), vs);
+      vc = _mm256_fmadd_pd(x, _mm256_i32gather_pd(c_table, vi, 8), vc);
+      vi = _mm_add_epi32(vi, vstep);
+      vi = _mm_sub_epi32(vi, _mm_and_si128(_mm_cmpgt_epi32(vi, vlast), vn));
+   }
+   *st = hsum_avx2(vs);
+   *ct = hsum_avx2(vc);
+   for(; i < n; i++) {
+      int index = ((long long)i*bin) % n;
+      *st += points[i]*s_table[index];
+      *ct += points[i]*c_table[index];
+   }
+}
+
+__attribute__((target("avx2,fma")))
+static double sum_sq_avx2(const double *points, int n) {
+   __m256d a0 = _mm256_setzero_pd();
+   __m256d a1 = _mm256_setzero_pd();
+   int i;
+
+   for(i = 0; i+8 <= n; i += 8) {
+      __m256d x0 = _mm256_loadu_pd(points+i);
+      __m256d x1 = _mm256_loadu_pd(points+i+4);
+      a0 = _mm256_fmadd_pd(x0, x0, a0);
+      a1 = _mm256_fmadd_pd(x1, x1, a1);
+   }
+   return hsum_avx2(_mm256_add_pd(a0, a1)) + sum_sq_scalar(points+i, n-i);
+}
+
+__attribute__((target("avx2,fma")))
+static void multiply_avx2(double *points, const double *window, int n) {
+   int i;
+   for(i = 0; i+4 <= n; i += 4)
+      _mm256_storeu_pd(points+i, _mm256_mul_pd(_mm256_loadu_pd(points+i), _mm256_loadu_pd(window+i)));
+   multiply_scalar(points+i, window+i, n-i);
+}
+
+__attribute__((target("avx2,fma")))
+static void remove_sc_avx2(double *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m256d vst = _mm256_set1_pd(st);
+   __m256d vct = _mm256_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(4, bin, n, &rc, &rs);
+   __m256d rr = _mm256_set1_pd(rc);
+   __m256d ri = _mm256_set1_pd(rs);
+   while(i+4 <= end) {
+      double c[4], s[4];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      for(int l = 0; l < 4; l++)
+         exact_phase(i+l, bin, n, &c[l], &s[l]);
+      __m256d zr = _mm256_loadu_pd(c);
+      __m256d zi = _mm256_loadu_pd(s);
+      for(; i+4 <= block_end; i += 4) {
+         __m256d f = _mm256_fmadd_pd(vst, zi, _mm256_mul_pd(vct, zr));
+         _mm256_storeu_pd(points+i, _mm256_sub_pd(_mm256_loadu_pd(points+i), f));
+         __m256d t = _mm256_fmsub_pd(zr, rr, _mm256_mul_pd(zi, ri));
+         zi = _mm256_fmadd_pd(zr, ri, _mm256_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_scalar(points, i, end, n, bin, st, ct);
+}
+
+__attribute__((target("avx2,fma")))
+static void remove_sc_f_avx2(float *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m256d vst = _mm256_set1_pd(st);
+   __m256d vct = _mm256_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(4, bin, n, &rc, &rs);
+   __m256d rr = _mm256_set1_pd(rc);
+   __m256d ri = _mm256_set1_pd(rs);
+   while(i+4 <= end) {
+      double c[4], s[4];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      for(int l = 0; l < 4; l++)
+         exact_phase(i+l, bin, n, &c[l], &s[l]);
+      __m256d zr = _mm256_loadu_pd(c);
+      __m256d zi = _mm256_loadu_pd(s);
+      for(; i+4 <= block_end; i += 4) {
+         __m256d f = _mm256_fmadd_pd(vst, zi, _mm256_mul_pd(vct, zr));
+         _mm_storeu_ps(points+i, _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(points+i)), f)));
+         __m256d t = _mm256_fmsub_pd(zr, rr, _mm256_mul_pd(zi, ri));
+         zi = _mm256_fmadd_pd(zr, ri, _mm256_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_f_scalar(points, i, end, n, bin, st, ct);
+}
+
+// Stereo splits with shifts as in SSE2, other channel counts gather one
+// channel of eight frames at a time. The gather loads 32 bits for each 16
+// bit sample, so the last frame is left to the scalar tail.
+__attribute__((target("avx2,fma")))
+static void deinterleave_avx2(const int16_t *in, int frames, int channels, double **out) {
+   int i = 0;
+
+   if(channels == 2) {
+      double *l = out[0], *r = out[1];
+      for(; i+8 <= frames; i += 8) {
+         __m256i v  = _mm256_loadu_si256((const __m256i *)(in+i*2));
+         __m256i vl = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+         __m256i vr = _mm256_srai_epi32(v, 16);
+         _mm256_storeu_pd(l+i,   _mm256_cvtepi32_pd(_mm256_castsi256_si128(vl)));
+         _mm256_storeu_pd(l+i+4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(vl, 1)));
+         _mm256_storeu_pd(r+i,   _mm256_cvtepi32_pd(_mm256_castsi256_si128(vr)));
+         _mm256_storeu_pd(r+i+4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(vr, 1)));
+      }
+   } else {
+      __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(channels));
+      for(; i+8 < frames; i += 8) {
+         const int16_t *base = in+i*channels;
+         for(int ch = 0; ch < channels; ch++) {
+            __m256i v = _mm256_i32gather_epi32((const int *)(base+ch), idx, 2);
+            v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+            _mm256_storeu_pd(out[ch]+i,   _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)));
+            _mm256_storeu_pd(out[ch]+i+4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+         }
+      }
+   }
+   deinterleave_range(in, i, frames, channels, out);
+}
+
+static const struct kernels kernels_avx2 = {
+   "avx2", dot_sc_avx2, sum_sq_avx2, multiply_avx2, remove_sc_avx2, remove_sc_f_avx2,
+   deinterleave_avx2
+};
+
+//=========================================================================================
+// AVX-512, eight lanes
+//=========================================================================================
+__attribute__((target("avx512f,avx2,fma")))
+static void dot_sc_avx512(const double *points, const double *s_table, const double *c_table, int n, int bin, double *st, double *ct) {
+   __m512d vs = _mm512_setzero_pd();
+   __m512d vc = _mm512_setzero_pd();
+   __m256i vi, vstep, vn, vlast;
+   int lanes[8];
+   int i;
+
+   for(int l = 0; l < 8; l++)
+      lanes[l] = ((long long)l*bin) % n;
+   vi    = _mm256_loadu_si256((__m256i *)lanes);
+   vstep = _mm256_set1_epi32((8LL*bin) % n);
+   vn    = _mm256_set1_epi32(n);
+   vlast = _mm256_set1_epi32(n-1);
+
+   for(i = 0; i+8 <= n; i += 8) {
+      __m512d x = _mm512_loadu_pd(points+i);
+      vs = _mm512_fmadd_pd(x, _mm512_i32gather_pd(vi, s_table, 8), vs);
+      vc = _mm512_fmadd_pd(x, _mm512_i32gather_pd(vi, c_table, 8), vc);
+      vi = _mm256_add_epi32(vi, vstep);
+      vi = _mm256_sub_epi32(vi, _mm256_and_si256(_mm256_cmpgt_epi32(vi, vlast), vn));
+   }
+   *st = _mm512_reduce_add_pd(vs);
+   *ct = _mm512_reduce_add_pd(vc);
+   for(; i < n; i++) {
+      int index = ((long long)i*bin) % n;
+      *st += points[i]*s_table[index];
+      *ct += points[i]*c_table[index];
+   }
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static double sum_sq_avx512(const double *points, int n) {
+   __m512d a0 = _mm512_setzero_pd();
+   __m512d a1 = _mm512_setzero_pd();
+   int i;
+
+   for(i = 0; i+16 <= n; i += 16) {
+      __m512d x0 = _mm512_loadu_pd(points+i);
+      __m512d x1 = _mm512_loadu_pd(points+i+8);
+      a0 = _mm512_fmadd_pd(x0, x0, a0);
+      a1 = _mm512_fmadd_pd(x1, x1, a1);
+   }
+   return _mm512_reduce_add_pd(_mm512_add_pd(a0, a1)) + sum_sq_scalar(points+i, n-i);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static void multiply_avx512(double *points, const double *window, int n) {
+   int i;
+   for(i = 0; i+8 <= n; i += 8)
+      _mm512_storeu_pd(points+i, _mm512_mul_pd(_mm512_loadu_pd(points+i), _mm512_loadu_pd(window+i)));
+   multiply_scalar(points+i, window+i, n-i);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static void remove_sc_avx512(double *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m512d vst = _mm512_set1_pd(st);
+   __m512d vct = _mm512_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(8, bin, n, &rc, &rs);
+   __m512d rr = _mm512_set1_pd(rc);
+   __m512d ri = _mm512_set1_pd(rs);
+   while(i+8 <= end) {
+      double c[8], s[8];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      for(int l = 0; l < 8; l++)
+         exact_phase(i+l, bin, n, &c[l], &s[l]);
+      __m512d zr = _mm512_loadu_pd(c);
+      __m512d zi = _mm512_loadu_pd(s);
+      for(; i+8 <= block_end; i += 8) {
+         __m512d f = _mm512_fmadd_pd(vst, zi, _mm512_mul_pd(vct, zr));
+         _mm512_storeu_pd(points+i, _mm512_sub_pd(_mm512_loadu_pd(points+i), f));
+         __m512d t = _mm512_fmsub_pd(zr, rr, _mm512_mul_pd(zi, ri));
+         zi = _mm512_fmadd_pd(zr, ri, _mm512_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_scalar(points, i, end, n, bin, st, ct);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static void remove_sc_f_avx512(float *points, int begin, int end, int n, int bin, double st, double ct) {
+   __m512d vst = _mm512_set1_pd(st);
+   __m512d vct = _mm512_set1_pd(ct);
+   double rc, rs;
+   int i = begin;
+
+   exact_phase(8, bin, n, &rc, &rs);
+   __m512d rr = _mm512_set1_pd(rc);
+   __m512d ri = _mm512_set1_pd(rs);
+   while(i+8 <= end) {
+      double c[8], s[8];
+      int block_end = (end - i > RESEED) ? i + RESEED : end;
+      for(int l = 0; l < 8; l++)
+         exact_phase(i+l, bin, n, &c[l], &s[l]);
+      __m512d zr = _mm512_loadu_pd(c);
+      __m512d zi = _mm512_loadu_pd(s);
+      for(; i+8 <= block_end; i += 8) {
+         __m512d f = _mm512_fmadd_pd(vst, zi, _mm512_mul_pd(vct, zr));
+         _mm256_storeu_ps(points+i, _mm512_cvtpd_ps(_mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(points+i)), f)));
+         __m512d t = _mm512_fmsub_pd(zr, rr, _mm512_mul_pd(zi, ri));
+         zi = _mm512_fmadd_pd(zr, ri, _mm512_mul_pd(zi, rr));
+         zr = t;
+      }
+   }
+   remove_sc_f_scalar(points, i, end, n, bin, st, ct);
+}
+
+// The de-interleave is bound by loads and stores, the AVX2 one is used as is
+static const struct kernels kernels_avx512 = {
+   "avx512", dot_sc_avx512, sum_sq_avx512, multiply_avx512, remove_sc_avx512, remove_sc_f_avx512,
+   deinterleave_avx2
+};
+#endif
+
+//=========================================================================================
+const struct kernels *kernels_by_name(const char *name) {
+   if(strcmp(name, "scalar") == 0) return &kernels_scalar;
+#ifdef HAVE_X86
+   __builtin_cpu_init();
+   if(strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+      return &kernels_sse2;
+   if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return &kernels_avx2;
+   if(strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return &kernels_avx512;
+#endif
+   return NULL;
+}
+
+const struct kernels *kernels_select(void) {
+   const char *names[] = { "avx512", "avx2", "sse2", "scalar" };
+   const char *forced  = getenv("AUDIO_DISTORTION_KERNELS");
+   const struct kernels *k;
+
+   if(forced != NULL && (k = kernels_by_name(forced)) != NULL)
+      return k;
+
+   for(int i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+      if((k = kernels_by_name(names[i])) != NULL)
+         return k;
+   }
+   return &kernels_scalar;
+}
@@ -0,0 +1,24 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+#include <stdint.h>
+
+// The inner loops of the analysis, with a version for each instruction
+// set. kernels_select() picks the best one the CPU supports, which can be
+// overridden with AUDIO_DISTORTION_KERNELS=scalar|sse2|avx2|avx512.
+struct kernels {
+   const char *name;
+   // s = sum(points[i]*s_table[i*bin % n]), likewise c with c_table
+   void   (*dot_sc)(const double *points, const double *s_table, const double *c_table, int n, int bin, double *s, double *c);
+   double (*sum_sq)(const double *points, int n);
+   void   (*multiply)(double *points, const double *window, int n);
+   // points[i] -= st*sin(2*pi*i*bin/n) + ct*cos(2*pi*i*bin/n) for i in [begin, end)
+   void   (*remove_sc)(double *points, int begin, int end, int n, int bin, double st, double ct);
+   // The same on float points, the sine is still generated in double
+   void   (*remove_sc_f)(float *points, int begin, int end, int n, int bin, double st, double ct);
+   // out[ch][i] = in[i*channels+ch] for 'frames' interleaved frames
+   void   (*deinterleave)(const int16_t *in, int frames, int channels, double **out);
+};
+
+const struct kernels *kernels_select(void);
+const struct kernels *kernels_by_name(const char *name);
+#endif
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include "latency.h"
+#include "fft.h"
+
+struct latency {
+   int stimulus_length;
+   int capture_length;
+   double stimulus_energy;
+   int n;                        // FFT size, long enough that the correlation doesn't wrap
+   struct fft_plan *plan;
+   double *buffer;               // the capture, zero padded to n
+   double complex *stimulus;     // spectrum of the stimulus, conjugated
+   double complex *cross;        // cross spectrum of the last capture
+   double complex *corr;         // and the correlation
+   int best;                     // whole sample delay found by the last latency_find()
+};
+
+// Feedback taps for each order. A term x^t of the polynomial is bit
+// order-t of the register, which shifts right. Each polynomial is
+// primitive, so the register goes through every non-zero state.
+#define TAP(order, t)  (1u << ((order)-(t)))
+static const unsigned int mls_taps[] = {
+   [10] = TAP(10, 10) | TAP(10, 7),
+   [11] = TAP(11, 11) | TAP(11, 9),
+   [12] = TAP(12, 12) | TAP(12, 11) | TAP(12, 10) | TAP(12, 4),
+   [13] = TAP(13, 13) | TAP(13, 12) | TAP(13, 11) | TAP(13, 8),
+   [14] = TAP(14, 14) | TAP(14, 13) | TAP(14, 12) | TAP(14, 2),
+   [15] = TAP(15, 15) | TAP(15, 14),
+   [16] = TAP(16, 16) | TAP(16, 15) | TAP(16, 13) | TAP(16, 4),
+   [17] = TAP(17, 17) | TAP(17, 14),
+   [18] = TAP(18, 18) | TAP(18, 11),
+};
+
+int latency_mls(double *out, int order) {
+   unsigned int state = 1;
+
+   if(order < LATENCY_MLS_MIN || order > LATENCY_MLS_MAX)
+      return 0;
+   for(int i = 0; i < LATENCY_MLS_LENGTH(order); i++) {
+      out[i] = (state & 1) ? 1.0 : -1.0;
+      state = (state >> 1) | ((__builtin_popcount(state & mls_taps[order]) & 1) << (order-1));
+   }
+   return 1;
+}
+
+// The smallest size at least 'n' with only 2, 3 and 5 as factors, which the
+// FFT does quickest
+static int fft_size(int n) {
+   for(;; n++) {
+      int m = n;
+      while(m % 2 == 0) m /= 2;
+      while(m % 3 == 0) m /= 3;
+      while(m % 5 == 0) m /= 5;
+      if(m == 1)
+         return n;
+   }
+}
+
+//=========================================================================================
+struct latency *latency_new(const double *stimulus, int stimulus_length, int capture_length) {
+   struct latency *l;
+
+   if(stimulus_length < 2 || capture_length < stimulus_length)
+      return NULL;
+   l = calloc(1, sizeof(struct latency));
+   if(l == NULL)
+      return NULL;
+
+   l->stimulus_length = stimulus_length;
+   l->capture_length  = capture_length;
+   l->n        = fft_size(capture_length + stimulus_length);
+   l->plan     = fft_plan_new(l->n);
+   l->buffer   = calloc(l->n, sizeof(double));
+   l->stimulus = malloc(sizeof(double complex)*l->n);
+   l->cross    = malloc(sizeof(double complex)*l->n);
+   l->corr     = malloc(sizeof(double complex)*l->n);
+   if(l->plan == NULL || l->buffer == NULL || l->stimulus == NULL || l->cross == NULL || l->corr == NULL) {
+      latency_free(l);
+      return NULL;
+   }
+
+   memcpy(l->buffer, stimulus, sizeof(double)*stimulus_length);
+   fft_forward_real(l->plan, l->buffer, l->stimulus);
+   for(int k = 0; k < l->n; k++)
+      l->stimulus[k] = conj(l->stimulus[k]);
+   for(int i = 0; i < stimulus_length; i++)
+      l->stimulus_energy += stimulus[i]*stimulus[i];
+   return l;
+}
+
+void latency_free(struct latency *l) {
+   if(l == NULL)
+      return;
+   fft_plan_free(l->plan);
+   free(l->buffer);
+   free(l->stimulus);
+   free(l->cross);
+   free(l->corr);
+   free(l);
+}
+
+// The correlation at a fractional lag, band limited, and its first two
+// derivatives, summed straight from the cross spectrum
+static void correlation_at(struct latency *l, double lag, double *r, double *d1, double *d2) {
+   double w = 2*M_PI/l->n;
+   double complex step = cexp(I*w*lag), z = step;
+
+   *r  = creal(l->cross[0]);
+   *d1 = 0.0;
+   *d2 = 0.0;
+   for(int k = 1; k < l->n/2; k++) {
+      double complex c = l->cross[k]*z;
+      *r  += 2*creal(c);
+      *d1 -= 2*w*k*cimag(c);
+      *d2 -= 2*w*k*w*k*creal(c);
+      z *= step;
+   }
+   *r  /= l->n;
+   *d1 /= l->n;
+   *d2 /= l->n;
+}
+
+// corr[k] = sum(captured[i+k]*stimulus[i]), from the inverse FFT of the
+// cross spectrum. The peak is started from a parabola through it and its
+// neighbours, then found to a small fraction of a sample by Newton's
+// method on the band limited correlation.
+#define NEWTON_STEPS 4
+int latency_find(struct latency *l, const double *captured, struct latency_result *result) {
+   int last = l->capture_length - l->stimulus_length;
+   double energy = 0.0;
+   int best = 0;
+
+   memcpy(l->buffer, captured, sizeof(double)*l->capture_length);
+   memset(l->buffer + l->capture_length, 0, sizeof(double)*(l->n - l->capture_length));
+   fft_forward_real(l->plan, l->buffer, l->cross);
+   for(int k = 0; k < l->n; k++)
+      l->cross[k] *= l->stimulus[k];
+   fft_inverse(l->plan, l->cross, l->corr);
+
+   for(int k = 1; k <= last; k++) {
+      if(fabs(creal(l->corr[k])) > fabs(creal(l->corr[best])))
+         best = k;
+   }
+   double sign = creal(l->corr[best]) < 0 ? -1.0 : 1.0;
+   double c = sign*creal(l->corr[best]);
+   double delta = 0.0;
+   if(best > 0 && best < last) {
+      double a = sign*creal(l->corr[best-1]), b = sign*creal(l->corr[best+1]);
+      if(a-2*c+b < 0.0)
+         delta = 0.5*(a-b)/(a-2*c+b);
+   }
+   for(int i = 0; i < NEWTON_STEPS; i++) {
+      double r, d1, d2;
+      correlation_at(l, best + delta, &r, &d1, &d2);
+      if(d2*sign >= 0.0)
+         break;
+      delta -= d1/d2;
+      if(delta < -1.0 || delta > 1.0) {
+         delta = 0.0;
+         break;
+      }
+   }
+
+   for(int i = best; i < best + l->stimulus_length; i++)
+      energy += captured[i]*captured[i];
+   l->best          = best;
+   result->delay    = best + delta;
+   result->inverted = sign < 0;
+   result->peak     = energy > 0.0 ? c/sqrt(energy*l->stimulus_energy) : 0.0;
+   return energy > 0.0;
+}
+
+// The phase slope of the cross spectrum over the band. The cross spectrum
+// has the phase of the loopback's response, as the stimulus' own phase
+// cancels. The slope is averaged as the sum of the products of bins
+// GD_SPACING apart, so the phase never needs unwrapping and the noise of
+// each bin counts for 1/GD_SPACING as much as it would between neighbours.
+// The whole sample delay is taken out first, so what is left turns well
+// under half a cycle over GD_SPACING bins.
+#define GD_SPACING 32
+double latency_group_delay(struct latency *l, double low_hz, double high_hz, unsigned int rate) {
+   int lo = low_hz*l->n/rate, hi = high_hz*l->n/rate;
+   int m = GD_SPACING;
+   double complex rotate, sum = 0.0;
+
+   if(lo < 1)
+      lo = 1;
+   if(hi > l->n/2 - 1)
+      hi = l->n/2 - 1;
+   if(m > hi - lo)
+      m = hi - lo;
+   if(m < 1)
+      return l->best;
+   rotate = cexp(I*2*M_PI*l->best*m/l->n);
+   for(int k = lo; k+m <= hi; k++)
+      sum += l->cross[k+m]*conj(l->cross[k])*rotate;
+   return l->best - carg(sum)/(2*M_PI*m/l->n);
+}
@@ -0,0 +1,30 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Finds a known stimulus in a capture by cross-correlation, done with FFTs
+// so a whole capture costs a few milliseconds. The stimulus is a maximum
+// length sequence, whose correlation with itself is a single spike.
+struct latency;
+
+struct latency_result {
+   double delay;            // samples from the start of the capture, to a fraction of a sample
+   double peak;             // normalised correlation at the delay, 1 for a perfect copy
+   int inverted;            // the loopback flips the polarity
+};
+
+// The number of samples latency_mls() makes for 'order', 2^order - 1
+#define LATENCY_MLS_LENGTH(order) ((1 << (order)) - 1)
+#define LATENCY_MLS_MIN 10
+#define LATENCY_MLS_MAX 18
+
+// Fills 'out' with a maximum length sequence of +1 and -1, returns 0 for
+// an order outside LATENCY_MLS_MIN..LATENCY_MLS_MAX
+int latency_mls(double *out, int order);
+
+// For finding 'stimulus' in captures of 'capture_length' samples
+struct latency *latency_new(const double *stimulus, int stimulus_length, int capture_length);
+int latency_find(struct latency *l, const double *captured, struct latency_result *result);
+// The group delay in samples over a band, from the last latency_find()
+double latency_group_delay(struct latency *l, double low_hz, double high_hz, unsigned int rate);
+void latency_free(struct latency *l);
+#endif
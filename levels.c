@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "levels.h"
+
+#define LINE_MAX_LEN 512
+
+static int cache_path(char *path, int size, const char *suffix) {
+   const char *dir = getenv("XDG_CACHE_HOME");
+   int n;
+
+   if(dir != NULL && dir[0] != '\0') {
+      n = snprintf(path, size, "%s/audio_distortion.levels%s", dir, suffix);
+   } else {
+      dir = getenv("HOME");
+      if(dir == NULL)
+         return 0;
+      n = snprintf(path, size, "%s/.cache/audio_distortion.levels%s", dir, suffix);
+   }
+   return n > 0 && n < size;
+}
+
+// Each line is "playback_device capture_device rate volume_pb volume_cap"
+static int parse(const char *line, char *pb, char *cap, unsigned int *rate, int *volume_pb, int *volume_cap) {
+   return sscanf(line, "%255s %255s %u %i %i", pb, cap, rate, volume_pb, volume_cap) == 5;
+}
+
+int levels_load(const char *device_pb, const char *device_cap, unsigned int rate, int *volume_pb, int *volume_cap) {
+   char path[1024], line[LINE_MAX_LEN], pb[256], cap[256];
+   unsigned int r;
+   int v_pb, v_cap;
+   int found = 0;
+   FILE *f;
+
+   if(!cache_path(path, sizeof(path), ""))
+      return 0;
+   f = fopen(path, "r");
+   if(f == NULL)
+      return 0;
+
+   while(fgets(line, sizeof(line), f) != NULL) {
+      if(!parse(line, pb, cap, &r, &v_pb, &v_cap))
+         continue;
+      if(strcmp(pb, device_pb) == 0 && strcmp(cap, device_cap) == 0 && r == rate) {
+         *volume_pb  = v_pb;
+         *volume_cap = v_cap;
+         found = 1;
+      }
+   }
+   fclose(f);
+   return found;
+}
+
+// Rewrites the file with this pair's entry replaced, through a temporary
+// file so an interrupted run can't leave it half written
+static int save(const char *device_pb, const char *device_cap, unsigned int rate, int volume_pb, int volume_cap) {
+   char path[1024], tmp[1024], line[LINE_MAX_LEN], pb[256], cap[256];
+   unsigned int r;
+   int v_pb, v_cap;
+   FILE *in, *out;
+
+   if(strchr(device_pb, ' ') != NULL || strchr(device_cap, ' ') != NULL)
+      return 0;
+   if(!cache_path(path, sizeof(path), "") || !cache_path(tmp, sizeof(tmp), ".tmp"))
+      return 0;
+
+   out = fopen(tmp, "w");
+   if(out == NULL)
+      return 0;
+
+   in = fopen(path, "r");
+   if(in != NULL) {
+      while(fgets(line, sizeof(line), in) != NULL) {
+         if(!parse(line, pb, cap, &r, &v_pb, &v_cap))
+            continue;
+         if(strcmp(pb, device_pb) == 0 && strcmp(cap, device_cap) == 0 && r == rate)
+            continue;
+         fprintf(out, "%s %s %u %i %i\n", pb, cap, r, v_pb, v_cap);
+      }
+      fclose(in);
+   }
+   fprintf(out, "%s %s %u %i %i\n", device_pb, device_cap, rate, volume_pb, volume_cap);
+
+   if(fclose(out) != 0 || rename(tmp, path) != 0) {
+      remove(tmp);
+      return 0;
+   }
+   return 1;
+}
+
+// Device pairs tested at once share the file and the temporary name
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int levels_save(const char *device_pb, const char *device_cap, unsigned int rate, int volume_pb, int volume_cap) {
+   int ok;
+
+   pthread_mutex_lock(&save_lock);
+   ok = save(device_pb, device_cap, rate, volume_pb, volume_cap);
+   pthread_mutex_unlock(&save_lock);
+   return ok;
+}
@@ -0,0 +1,9 @@
+#ifndef LEVELS_H
+#define LEVELS_H
+
+// Remembers the calibrated mixer levels for each playback/capture device
+// pair and rate, in $XDG_CACHE_HOME/audio_distortion.levels (or under
+// ~/.cache), so repeat runs on the same setup can skip the level search.
+int levels_load(const char *device_pb, const char *device_cap, unsigned int rate, int *volume_pb, int *volume_cap);
+int levels_save(const char *device_pb, const char *device_cap, unsigned int rate, int volume_pb, int volume_cap);
+#endif
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "libaudiodistortion.h"
+#include "analysis.h"
+#include "pool.h"
+
+#if AD_MAX_HARMONICS != MAX_HARMONICS
+#error AD_MAX_HARMONICS must match MAX_HARMONICS
+#endif
+
+// Only the ad_ functions are exported from the shared library
+#define AD_API __attribute__((visibility("default")))
+
+struct ad_context {
+   struct ad_config config;
+   struct analysis *a;
+   struct pool *pool;
+   double *points;              // the caller's points, windowed in place
+   float *points_f;
+   struct ad_timing *timing;
+   struct analysis_timing stages;
+};
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+AD_API struct ad_context *ad_new(const struct ad_config *config) {
+   struct ad_context *ctx;
+
+   if(config->harmonics < 0 || config->harmonics > AD_MAX_HARMONICS)
+      return NULL;
+   ctx = calloc(1, sizeof(struct ad_context));
+   if(ctx == NULL)
+      return NULL;
+   ctx->config = *config;
+   if(config->threads != 1) {
+      ctx->pool = pool_new(config->threads);
+      if(ctx->pool == NULL)
+         goto fail;
+   }
+   if(config->use_float)
+      ctx->a = analysis_new_float(config->point_count, config->rate, ctx->pool);
+   else
+      ctx->a = analysis_new(config->point_count, config->rate, ctx->pool);
+   ctx->points = malloc(sizeof(double)*config->point_count);
+   if(config->use_float)
+      ctx->points_f = malloc(sizeof(float)*config->point_count);
+   if(ctx->a == NULL || ctx->points == NULL || (config->use_float && ctx->points_f == NULL))
+      goto fail;
+   analysis_set_notch(ctx->a, config->notch_mode);
+   return ctx;
+
+fail:
+   ad_free(ctx);
+   return NULL;
+}
+
+AD_API void ad_free(struct ad_context *ctx) {
+   if(ctx == NULL)
+      return;
+   analysis_free(ctx->a);
+   pool_free(ctx->pool);
+   free(ctx->points);
+   free(ctx->points_f);
+   free(ctx);
+}
+
+AD_API void ad_set_timing(struct ad_context *ctx, struct ad_timing *timing) {
+   ctx->timing = timing;
+   memset(&ctx->stages, 0, sizeof(ctx->stages));
+   analysis_set_timing(ctx->a, timing != NULL ? &ctx->stages : NULL);
+}
+
+static int harmonics(struct ad_context *ctx, const double *points, struct ad_result *result) {
+   struct harmonic h[MAX_HARMONICS];
+   double thd = 0.0, start = 0.0;
+   int count;
+
+   result->harmonic_count = 0;
+   result->thd            = 0.0;
+   result->thd_db         = 0.0;
+   if(ctx->config.harmonics == 0)
+      return 0;
+   if(ctx->timing != NULL)
+      start = now();
+   count = analysis_harmonics(ctx->a, points, ctx->config.frequency_hz, ctx->config.harmonics, h, &thd);
+   if(ctx->timing != NULL)
+      ctx->timing->harmonics += now()-start;
+   for(int k = 0; k < count; k++) {
+      result->harmonics[k].hz       = h[k].hz;
+      result->harmonics[k].level    = h[k].level;
+      result->harmonics[k].level_db = h[k].level_db;
+      result->harmonics[k].phase    = h[k].phase;
+   }
+   result->harmonic_count = count;
+   if(count == 0)
+      return 0;
+   result->thd    = thd;
+   result->thd_db = log10(thd)*20;
+   return 1;
+}
+
+AD_API int ad_harmonics(struct ad_context *ctx, const double *points, struct ad_result *result) {
+   return harmonics(ctx, points, result);
+}
+
+// Runs on ctx->points, which are overwritten
+static int run(struct ad_context *ctx, struct ad_result *result) {
+   struct analysis_result res;
+   int n = ctx->config.point_count;
+   int ok;
+
+   harmonics(ctx, ctx->points, result);
+   if(ctx->config.use_float) {
+      for(int i = 0; i < n; i++)
+         ctx->points_f[i] = ctx->points[i];
+      analysis_window_float(ctx->a, ctx->points_f);
+      ok = analysis_run_float(ctx->a, ctx->points_f, &res);
+   } else {
+      analysis_window(ctx->a, ctx->points);
+      ok = analysis_run(ctx->a, ctx->points, &res);
+   }
+   if(ctx->timing != NULL) {
+      ctx->timing->window   += ctx->stages.window;
+      ctx->timing->spectrum += ctx->stages.spectrum;
+      ctx->timing->notch    += ctx->stages.notch;
+      ctx->timing->rms      += ctx->stages.rms;
+      memset(&ctx->stages, 0, sizeof(ctx->stages));
+   }
+   if(!ok)
+      return 0;
+
+   result->peak_hz   = res.peak_hz;
+   result->signal    = res.signal;
+   result->signal_db = res.signal_db;
+   result->rms       = res.rms;
+   result->thd_n     = res.rms/res.signal;
+   result->thd_n_db  = log10(result->thd_n)*20;
+   return 1;
+}
+
+AD_API int ad_analyze(struct ad_context *ctx, const double *points, struct ad_result *result) {
+   memcpy(ctx->points, points, sizeof(double)*ctx->config.point_count);
+   return run(ctx, result);
+}
+
+AD_API int ad_analyze_s16(struct ad_context *ctx, const int16_t *frames, int channels, int channel, struct ad_result *result) {
+   if(channel < 0 || channel >= channels)
+      return 0;
+   for(int i = 0; i < ctx->config.point_count; i++)
+      ctx->points[i] = frames[i*channels+channel];
+   return run(ctx, result);
+}
+
+AD_API const double *ad_spectrum(struct ad_context *ctx, int *bins) {
+   *bins = analysis_bins(ctx->a);
+   return analysis_signal(ctx->a);
+}
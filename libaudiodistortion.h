@@ -0,0 +1,83 @@
+#ifndef LIBAUDIODISTORTION_H
+#define LIBAUDIODISTORTION_H
+#include <stdint.h>
+
+// THD+N and harmonic analysis of a captured test tone, for linking into
+// other programs. Samples are on a 16 bit scale, so a full scale sine peaks
+// at 32767. A context is set up once for a capture length and rate; after
+// that ad_analyze() and friends make no heap allocations, and any number
+// of contexts can be used from different threads at once.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AD_MAX_HARMONICS 32
+
+#define AD_NOTCH_BAND 0          // notch every bin within 50Hz of the peak
+#define AD_NOTCH_FIT  1          // remove a sine fitted at the estimated frequency
+
+struct ad_config {
+   int point_count;              // samples per analysis
+   unsigned int rate;
+   int notch_mode;               // AD_NOTCH_BAND or AD_NOTCH_FIT
+   int use_float;                // spectrum and notch on float samples
+   int harmonics;                // measure the fundamental and H2..Hn, 0 for none
+   double frequency_hz;          // the test tone, for the harmonics
+   int threads;                  // 1 for the calling thread only, 0 for one per CPU
+};
+
+struct ad_harmonic {
+   double hz;
+   double level;                 // RMS
+   double level_db;              // relative to a full scale sine
+   double phase;                 // radians, relative to the first sample
+};
+
+struct ad_result {
+   double peak_hz;
+   double signal;                // RMS of the fundamental
+   double signal_db;             // peak bin relative to full scale
+   double rms;                   // RMS of what is left once it is removed
+   double thd_n;                 // rms/signal
+   double thd_n_db;
+
+   int harmonic_count;           // 0 if no harmonics were asked for, or they are above Nyquist
+   double thd;                   // over H2..Hn, this and thd_db are 0 if harmonic_count is
+   double thd_db;
+   struct ad_harmonic harmonics[AD_MAX_HARMONICS];
+};
+
+// Seconds spent in each stage, added to by every call once set with
+// ad_set_timing(). Zero it to start again.
+struct ad_timing {
+   double harmonics;
+   double window;
+   double spectrum;              // FFT, spectrum in dB and the peak search
+   double notch;
+   double rms;
+};
+
+struct ad_context;
+
+struct ad_context *ad_new(const struct ad_config *config);
+void ad_free(struct ad_context *ctx);
+// NULL, the default, turns the timing off
+void ad_set_timing(struct ad_context *ctx, struct ad_timing *timing);
+
+// Full THD+N analysis, plus the harmonics if the config asks for them.
+// 'points' is not changed. Returns 0 on failure
+int ad_analyze(struct ad_context *ctx, const double *points, struct ad_result *result);
+// The same on one channel of interleaved 16 bit frames
+int ad_analyze_s16(struct ad_context *ctx, const int16_t *frames, int channels, int channel, struct ad_result *result);
+// Only the harmonics, much quicker than a full analysis. Returns 0 if
+// none were asked for or the fundamental is above Nyquist
+int ad_harmonics(struct ad_context *ctx, const double *points, struct ad_result *result);
+
+// The spectrum of the last ad_analyze(), in dB relative to full scale
+const double *ad_spectrum(struct ad_context *ctx, int *bins);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+// Converts the font PPM (black glyphs on white, 16 columns by 6 rows of
+// characters 32 to 127) into a C table of 8 bit coverage, written to stdout
+
+static int read_number(FILE *f) {
+   int c = getc(f);
+   int n = 0;
+
+   while(isspace(c) || c == '#') {
+      if(c == '#') {
+         while(c != '\n' && c != EOF)
+            c = getc(f);
+      }
+      c = getc(f);
+   }
+   if(!isdigit(c))
+      return -1;
+   while(isdigit(c)) {
+      n = n*10 + c-'0';
+      c = getc(f);
+   }
+   return n;
+}
+
+int main(int argc, char *argv[]) {
+   FILE *f;
+   int width, height, maxval, channels;
+   unsigned char *pixels;
+
+   if(argc != 2) {
+      fprintf(stderr,"Usage: %s font.ppm > font.h\n", argv[0]);
+      return 1;
+   }
+   f = fopen(argv[1], "rb");
+   if(f == NULL) {
+      fprintf(stderr,"Unable to open %s\n", argv[1]);
+      return 1;
+   }
+   if(getc(f) != 'P') {
+      fprintf(stderr,"%s is not a PPM\n", argv[1]);
+      return 1;
+   }
+   switch(getc(f)) {
+      case '5': channels = 1; break;
+      case '6': channels = 3; break;
+      default:
+         fprintf(stderr,"%s is not a binary PPM or PGM\n", argv[1]);
+         return 1;
+   }
+   width  = read_number(f);
+   height = read_number(f);
+   maxval = read_number(f);
+   if(width <= 0 || height <= 0 || maxval != 255 || width % 16 != 0 || height % 6 != 0) {
+      fprintf(stderr,"%s: unexpected size or depth\n", argv[1]);
+      return 1;
+   }
+   pixels = malloc((size_t)width*height*channels);
+   if(pixels == NULL || fread(pixels, channels, (size_t)width*height, f) != (size_t)width*height) {
+      fprintf(stderr,"Unable to read %s\n", argv[1]);
+      return 1;
+   }
+   fclose(f);
+
+   printf("// Generated from %s by mkfont, do not edit\n", argv[1]);
+   printf("#define FONT_ATLAS_WIDTH  %i\n", width);
+   printf("#define FONT_ATLAS_HEIGHT %i\n", height);
+   printf("static const uint8_t font_atlas[FONT_ATLAS_WIDTH*FONT_ATLAS_HEIGHT] = {\n");
+   for(int i = 0; i < width*height; i++) {
+      int sum = 0;
+      for(int c = 0; c < channels; c++)
+         sum += pixels[i*channels+c];
+      printf("%s%i,%s", i % 24 == 0 ? "   " : "", 255 - (sum+channels/2)/channels, i % 24 == 23 ? "\n" : "");
+   }
+   printf("\n};\n");
+   free(pixels);
+   return 0;
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <math.h>
+#include <complex.h>
+
+#include "monitor.h"
+
+// Bins either side of each tracked tone, and above DC, once the Hann window
+// is applied. That holds the main lobe of a tone on a bin with one to
+// spare. One more bin is tracked each side, as each windowed bin is made
+// from a bin and its two neighbours.
+#define BAND 2
+
+// How far the window may be moved from the length asked for, to hold a
+// whole number of cycles of the fundamental
+#define SNAP_RANGE 10      // percent
+
+struct monitor {
+   int window;
+   double *history;          // the last 'window' samples
+   int pos;
+   long filled;
+   int since_resync;
+
+   int k0;                   // bin of the fundamental
+   int bins;
+   int *bin;                 // bin number being tracked
+   int *harmonic;            // 0 for DC, 1 for the fundamental, 2.. for harmonics
+   double complex *x;        // sliding DFT of each tracked bin
+   double complex *twiddle;  // exp(2*pi*i*bin/window)
+
+   double energy;            // sum of squares over the window
+   double complex energy_x[2];  // sliding DFT of the squares, bins 1 and 2
+   double complex energy_twiddle[2];
+};
+
+// The length nearest to 'window' that holds the most nearly whole number of
+// cycles, so a fundamental that isn't a multiple of rate/window (-T 997.3,
+// say) still lands on a bin, and so do its harmonics.
+static int snap_window(unsigned int rate, int window, double fundamental_hz) {
+   int best = window;
+   double best_off = 1.0;
+
+   for(int d = 0; d <= window*SNAP_RANGE/100; d++) {
+      for(int sign = -1; sign <= 1; sign += 2) {
+         int n = window + sign*d;
+         double cycles = fundamental_hz*n/rate;
+         double off = fabs(cycles - floor(cycles + 0.5));
+         if(off < best_off) {
+            best_off = off;
+            best = n;
+         }
+      }
+   }
+   return best;
+}
+
+struct monitor *monitor_new(unsigned int rate, int window, double fundamental_hz, int harmonics) {
+   struct monitor *m;
+   int k0, tracked = (harmonics+1)*(2*BAND+3);
+
+   if(window < 8 || rate == 0 || fundamental_hz <= 0.0 || harmonics < 1)
+      return NULL;
+   window = snap_window(rate, window, fundamental_hz);
+   k0 = (int)(fundamental_hz*window/rate + 0.5);
+   // Below three bins the main lobes of the fundamental and DC run together
+   if(k0 < 3)
+      return NULL;
+
+   m = calloc(1, sizeof(struct monitor));
+   if(m == NULL)
+      return NULL;
+
+   m->window   = window;
+   m->k0       = k0;
+   m->history  = calloc(window, sizeof(double));
+   m->bin      = malloc(sizeof(int)*tracked);
+   m->harmonic = malloc(sizeof(int)*tracked);
+   m->x        = malloc(sizeof(double complex)*tracked);
+   m->twiddle  = malloc(sizeof(double complex)*tracked);
+   if(m->history == NULL || m->bin == NULL || m->harmonic == NULL || m->x == NULL || m->twiddle == NULL) {
+      monitor_free(m);
+      return NULL;
+   }
+   for(int j = 0; j < 2; j++)
+      m->energy_twiddle[j] = cexp(2*M_PI*I*(j+1)/window);
+
+   // Each bin goes to the nearest of DC and the harmonics, so bands that
+   // would overlap share their bins out rather than count one twice
+   for(int k = 0; k <= harmonics*k0+BAND+1 && k < (window+1)/2; k++) {
+      int h = (k + k0/2)/k0;
+      if(h > harmonics)
+         h = harmonics;
+      if(abs(k - h*k0) > BAND+1)
+         continue;
+      m->bin[m->bins]      = k;
+      m->harmonic[m->bins] = h;
+      m->x[m->bins]        = 0.0;
+      m->twiddle[m->bins]  = cexp(2*M_PI*I*k/window);
+      m->bins++;
+   }
+   return m;
+}
+
+void monitor_free(struct monitor *m) {
+   if(m == NULL)
+      return;
+   free(m->history);
+   free(m->bin);
+   free(m->harmonic);
+   free(m->x);
+   free(m->twiddle);
+   free(m);
+}
+
+// Recalculate everything from the history, so rounding in the running sums
+// can't build up. Done once per window, so the cost per sample is constant.
+static void resync(struct monitor *m) {
+   double energy = 0.0;
+
+   // history[pos] is the oldest sample
+   for(int n = 0; n < m->window; n++) {
+      double s = m->history[(m->pos+n) % m->window];
+      energy += s*s;
+   }
+   for(int j = 0; j < 2; j++) {
+      double complex z = 1.0, step = conj(m->energy_twiddle[j]);
+      m->energy_x[j] = 0.0;
+      for(int n = 0; n < m->window; n++) {
+         double s = m->history[(m->pos+n) % m->window];
+         m->energy_x[j] += s*s * z;
+         z *= step;
+      }
+   }
+   for(int j = 0; j < m->bins; j++) {
+      double complex z = 1.0, step = conj(m->twiddle[j]);
+      m->x[j] = 0.0;
+      for(int n = 0; n < m->window; n++) {
+         m->x[j] += m->history[(m->pos+n) % m->window] * z;
+         z *= step;
+      }
+   }
+   m->energy = energy;
+   m->since_resync = 0;
+}
+
+void monitor_push(struct monitor *m, const double *samples, int count) {
+   for(int i = 0; i < count; i++) {
+      double s   = samples[i];
+      double old = m->history[m->pos];
+
+      m->history[m->pos] = s;
+      m->pos = (m->pos+1) % m->window;
+      m->energy += s*s - old*old;
+      for(int j = 0; j < 2; j++)
+         m->energy_x[j] = (m->energy_x[j] + s*s - old*old) * m->energy_twiddle[j];
+      for(int j = 0; j < m->bins; j++)
+         m->x[j] = (m->x[j] + s - old) * m->twiddle[j];
+      m->filled++;
+
+      if(++m->since_resync == m->window)
+         resync(m);
+   }
+}
+
+// Returns 0 until a whole window has been seen
+int monitor_read(struct monitor *m, struct monitor_result *result) {
+   double n = m->window;
+   double fundamental = 0.0, harmonics = 0.0, dc = 0.0;
+   int counted = 0;
+
+   if(m->filled < m->window)
+      return 0;
+
+   // Everything is measured through a Hann window, 0.5 - 0.5*cos(), which
+   // squared is 3/8 - 0.5*cos() + 1/8*cos(2x), so the windowed energy comes
+   // from the DFT of the squares at bins 1 and 2. Power is then relative to
+   // 3/8, the mean of the window squared.
+   double total = (3.0/8*m->energy - 0.5*creal(m->energy_x[0]) + 1.0/8*creal(m->energy_x[1]))/(n*3/8);
+
+   // Each windowed bin is 0.5*X[k] - 0.25*(X[k-1] + X[k+1]), for those in a
+   // band with both neighbours tracked, X[-1] being the conjugate of X[1].
+   // Then Parseval, with each bin past DC also standing for its negative
+   // frequency twin.
+   for(int j = 0; j < m->bins-1; j++) {
+      double complex below;
+      if(abs(m->bin[j] - m->harmonic[j]*m->k0) > BAND || m->bin[j+1] != m->bin[j]+1)
+         continue;
+      if(m->bin[j] == 0)
+         below = conj(m->x[j+1]);
+      else if(j > 0 && m->bin[j-1] == m->bin[j]-1)
+         below = m->x[j-1];
+      else
+         continue;
+      double complex x = 0.5*m->x[j] - 0.25*(below + m->x[j+1]);
+      double p = (m->bin[j] == 0 ? 1 : 2)*creal(x*conj(x))/(n*n*3/8);
+      counted++;
+      if(m->harmonic[j] == 0)
+         dc += p;
+      else if(m->harmonic[j] == 1)
+         fundamental += p;
+      else
+         harmonics += p;
+   }
+   double noise = total - fundamental - harmonics - dc;
+   double full_scale = 32767.0*32767.0/2;
+   if(noise < 0)
+      noise = 0;
+
+   result->thd_n          = sqrt((harmonics + noise)/fundamental);
+   result->thd            = sqrt(harmonics/fundamental);
+   result->fundamental_db = 10*log10(fundamental/full_scale);
+   result->noise_floor_db = 10*log10(noise/((m->window/2 - counted)*full_scale));
+   return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+// Sliding window THD+N for continuous monitoring. Only the bins around the
+// fundamental and its harmonics are tracked, with a sliding DFT, and the
+// total power is a running sum, so each sample costs the same however
+// often results are read. The window is moved by up to 10% to hold a whole
+// number of cycles of the fundamental, and a Hann window is applied by
+// combining adjacent bins, so a tone that isn't on a bin doesn't leak out
+// of its band. Returns NULL if the fundamental is under three bins.
+struct monitor;
+
+struct monitor_result {
+   double thd_n;            // Ratio, not percent
+   double thd;              // Harmonics only
+   double fundamental_db;   // dBFS
+   double noise_floor_db;   // dBFS per bin, with fundamental, harmonics and DC removed
+};
+
+struct monitor *monitor_new(unsigned int rate, int window, double fundamental_hz, int harmonics);
+void monitor_push(struct monitor *m, const double *samples, int count);
+int monitor_read(struct monitor *m, struct monitor_result *result);
+void monitor_free(struct monitor *m);
+#endif
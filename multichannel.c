@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "multichannel.h"
+#include "plot.h"
+#include "pool.h"
+
+// Each worker keeps one analysis context and float buffer for all the
+// channels it takes
+struct worker {
+   struct analysis *a;
+   float *points_f;
+};
+
+struct multichannel {
+   double **points;
+   int point_count;
+   unsigned int rate;
+   int channels;
+   const struct multichannel_options *opt;
+   struct channel_result *results;
+   struct worker *workers;
+};
+
+static int worker_setup(struct multichannel *m, struct worker *w) {
+   if(w->a != NULL)
+      return 1;
+   // No pool, the parallelism is across channels
+   if(m->opt->use_float) {
+      w->a        = analysis_new_float(m->point_count, m->rate, NULL);
+      w->points_f = malloc(sizeof(float)*m->point_count);
+   } else {
+      w->a = analysis_new(m->point_count, m->rate, NULL);
+   }
+   if(w->a == NULL || (m->opt->use_float && w->points_f == NULL)) {
+      analysis_free(w->a);
+      free(w->points_f);
+      w->a        = NULL;
+      w->points_f = NULL;
+      return 0;
+   }
+   analysis_set_notch(w->a, m->opt->notch_mode);
+   return 1;
+}
+
+static int run(struct worker *w, double *points, int point_count, int use_float, struct analysis_result *res) {
+   if(use_float) {
+      for(int i = 0; i < point_count; i++)
+         w->points_f[i] = points[i];
+      analysis_window_float(w->a, w->points_f);
+      return analysis_run_float(w->a, w->points_f, res);
+   }
+   analysis_window(w->a, points);
+   return analysis_run(w->a, points, res);
+}
+
+static void analyse_channel(void *arg, int worker, int index) {
+   struct multichannel *m = arg;
+   const struct multichannel_options *opt = m->opt;
+   struct channel_result *r = &m->results[index];
+   struct worker *w = &m->workers[worker];
+   double *points = m->points[index];
+   struct harmonic harmonics[MAX_HARMONICS];
+   struct analysis *a;
+   double thd;
+
+   if(!worker_setup(m, w))
+      return;
+   a = w->a;
+
+   // The levels are taken before the points are windowed in place
+   if(opt->crosstalk) {
+      for(int k = 0; k < m->channels; k++) {
+         r->level_db[k] = -INFINITY;
+         if(analysis_harmonics(a, points, opt->tone_hz[k], 1, harmonics, &thd) > 0)
+            r->level_db[k] = harmonics[0].level_db;
+      }
+   }
+   if(opt->harmonics > 0 &&
+      analysis_harmonics(a, points, opt->tone_hz[index], opt->harmonics, harmonics, &thd) > 0)
+      r->thd = thd;
+
+   if(run(w, points, m->point_count, opt->use_float, &r->res)) {
+      r->ok = 1;
+      if(opt->plot) {
+         char name[32], text[100];
+         sprintf(name, "graph_ch%i.png", index+1);
+         sprintf(text,"ch%i thd+n %7.4f%%, peak %4.2f Hz", index+1, r->res.rms/r->res.signal*100, r->res.peak_hz);
+         plot(analysis_signal(a), analysis_bins(a), text, name);
+      }
+   }
+}
+
+int multichannel_run(double **points, int channels, int point_count, unsigned int rate,
+                     const struct multichannel_options *opt, struct pool *pool, struct channel_result *results) {
+   struct multichannel m;
+   int workers = pool != NULL ? pool_size(pool) : 1;
+   int failed = 0;
+
+   m.points      = points;
+   m.point_count = point_count;
+   m.rate        = rate;
+   m.channels    = channels;
+   m.opt         = opt;
+   m.results     = results;
+   memset(results, 0, sizeof(struct channel_result)*channels);
+   m.workers     = calloc(workers, sizeof(struct worker));
+   if(m.workers == NULL)
+      return channels;
+   pool_run(pool, channels, analyse_channel, &m);
+   for(int i = 0; i < workers; i++) {
+      analysis_free(m.workers[i].a);
+      free(m.workers[i].points_f);
+   }
+   free(m.workers);
+   for(int i = 0; i < channels; i++) {
+      if(!results[i].ok)
+         failed++;
+   }
+   return failed;
+}
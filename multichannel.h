@@ -0,0 +1,30 @@
+#ifndef MULTICHANNEL_H
+#define MULTICHANNEL_H
+#include "analysis.h"
+
+struct pool;
+
+#define MAX_CHANNELS 8
+
+// Analyses every channel of one capture at once, a task per channel on the
+// pool, with an analysis context per worker
+struct multichannel_options {
+   int notch_mode;
+   int use_float;
+   int harmonics;              // also measure THD over H2..Hn, 0 for none
+   int plot;                   // write graph_ch<n>.png for each channel
+   int crosstalk;              // measure every channel at every tone
+   const double *tone_hz;      // the tone played on each channel
+};
+
+struct channel_result {
+   int ok;
+   struct analysis_result res;
+   double thd;
+   double level_db[MAX_CHANNELS];  // at tone_hz[k], with 'crosstalk'
+};
+
+// Returns the number of channels that could not be analysed
+int multichannel_run(double **points, int channels, int point_count, unsigned int rate,
+                     const struct multichannel_options *opt, struct pool *pool, struct channel_result *results);
+#endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#include "multitone.h"
+#include "fft.h"
+
+// Bins either side of a product, the main lobe of the window. Tones get
+// TONE_BAND_HZ either side, like the band notch, as their leakage is far
+// above everything else.
+#define LOBE          3
+#define TONE_BAND_HZ  50.0
+
+#define OWNER_NONE  -1
+#define OWNER_DC     0      // then the tones from 1, then the products
+
+struct multitone {
+   int point_count;
+   unsigned int rate;
+   double bin_hz;
+   double scale;            // bin power to mean square, for a bin between DC and Nyquist
+   double max_rms;
+   struct fft_plan *plan;
+   double *window;
+   double *points;
+   double complex *spectrum;
+   double *signal;
+   int *owner;
+   double *distance;        // from the owner's frequency, Hz
+   double *power;           // per owner
+   int product_count;
+   struct multitone_product product[MULTITONE_MAX_PRODUCTS];
+};
+
+struct multitone *multitone_new(int point_count, unsigned int rate) {
+   struct multitone *mt;
+   int bins = point_count/2;
+
+   if(point_count < 2*(2*LOBE+1) || rate == 0)
+      return NULL;
+
+   mt = calloc(1, sizeof(struct multitone));
+   if(mt == NULL)
+      return NULL;
+
+   mt->point_count = point_count;
+   mt->rate        = rate;
+   mt->bin_hz      = (double)rate/point_count;
+   mt->plan        = fft_plan_new(point_count);
+   mt->window      = malloc(sizeof(double)*point_count);
+   mt->points      = malloc(sizeof(double)*point_count);
+   mt->spectrum    = malloc(sizeof(double complex)*point_count);
+   mt->signal      = malloc(sizeof(double)*bins);
+   mt->owner       = malloc(sizeof(int)*(bins+1));
+   mt->distance    = malloc(sizeof(double)*(bins+1));
+   mt->power       = malloc(sizeof(double)*(1+MULTITONE_MAX_TONES+MULTITONE_MAX_PRODUCTS));
+   if(mt->plan == NULL || mt->window == NULL || mt->points == NULL || mt->spectrum == NULL ||
+      mt->signal == NULL || mt->owner == NULL || mt->distance == NULL || mt->power == NULL) {
+      multitone_free(mt);
+      return NULL;
+   }
+
+   // The same window as the analysis
+   double sum_sq = 0.0;
+   for(int i = 0; i < point_count; i++) {
+      mt->window[i] = 0.42 - 0.5 * cos(2*M_PI*i/point_count) + 0.08 * cos(4*M_PI*i/point_count);
+      sum_sq += mt->window[i]*mt->window[i];
+   }
+   mt->scale   = 2/(point_count*sum_sq);
+   mt->max_rms = 32767*sqrt(sum_sq/point_count);
+   return mt;
+}
+
+void multitone_free(struct multitone *mt) {
+   if(mt == NULL)
+      return;
+   fft_plan_free(mt->plan);
+   free(mt->window);
+   free(mt->points);
+   free(mt->spectrum);
+   free(mt->signal);
+   free(mt->owner);
+   free(mt->distance);
+   free(mt->power);
+   free(mt);
+}
+
+double *multitone_signal(struct multitone *mt) {
+   return mt->signal;
+}
+
+int multitone_bins(struct multitone *mt) {
+   return mt->point_count/2;
+}
+
+//=========================================================================================
+// Every product with an order from 2 to 'order', lowest orders first so
+// they are the ones kept if there are too many. Products that land on a
+// tone can't be told apart from it and are left out, as are second ways
+// of making a frequency already listed.
+static void add_product(struct multitone *mt, const double *tone_hz, int tone_count, const signed char *m, int order) {
+   struct multitone_product *p;
+   double hz = 0.0;
+   int tones = 0;
+
+   for(int i = 0; i < tone_count; i++) {
+      hz += m[i]*tone_hz[i];
+      if(m[i] != 0)
+         tones++;
+   }
+   if(hz < (LOBE+1)*mt->bin_hz || hz >= mt->rate/2.0 - LOBE*mt->bin_hz)
+      return;
+   for(int i = 0; i < tone_count; i++)
+      if(fabs(hz - tone_hz[i]) < 2*LOBE*mt->bin_hz)
+         return;
+   for(int j = 0; j < mt->product_count; j++)
+      if(fabs(hz - mt->product[j].hz) < mt->bin_hz/2)
+         return;
+   if(mt->product_count == MULTITONE_MAX_PRODUCTS)
+      return;
+
+   p = &mt->product[mt->product_count++];
+   memset(p, 0, sizeof(*p));
+   memcpy(p->m, m, tone_count);
+   p->hz    = hz;
+   p->order = order;
+   p->tones = tones;
+}
+
+static void find_products(struct multitone *mt, const double *tone_hz, int tone_count, int order, signed char *m, int i, int left) {
+   if(i == tone_count) {
+      if(left == 0)
+         add_product(mt, tone_hz, tone_count, m, order);
+      return;
+   }
+   for(int k = -left; k <= left; k++) {
+      m[i] = k;
+      find_products(mt, tone_hz, tone_count, order, m, i+1, left - abs(k));
+   }
+   m[i] = 0;
+}
+
+static int by_frequency(const void *a, const void *b) {
+   const struct multitone_product *pa = a, *pb = b;
+   return (pa->hz > pb->hz) - (pa->hz < pb->hz);
+}
+
+// Gives bins within 'width' of 'hz' to 'id', unless something else is nearer
+static void claim(struct multitone *mt, double hz, int width, int id) {
+   int centre = floor(hz/mt->bin_hz + 0.5);
+
+   for(int k = centre-width; k <= centre+width; k++) {
+      if(k < 0 || k > mt->point_count/2)
+         continue;
+      double d = fabs(k*mt->bin_hz - hz);
+      if(mt->owner[k] == OWNER_NONE || d < mt->distance[k]) {
+         mt->owner[k]    = id;
+         mt->distance[k] = d;
+      }
+   }
+}
+
+//=========================================================================================
+int multitone_run(struct multitone *mt, const double *points, const double *tone_hz, int tone_count, int order, struct multitone_result *result) {
+   int point_count = mt->point_count;
+   int bins = point_count/2;
+   signed char m[MULTITONE_MAX_TONES];
+
+   if(tone_count < 1 || tone_count > MULTITONE_MAX_TONES)
+      return 0;
+   for(int i = 0; i < tone_count; i++)
+      if(tone_hz[i] <= 0.0 || tone_hz[i] >= mt->rate/2.0)
+         return 0;
+   if(order > MULTITONE_MAX_ORDER)
+      order = MULTITONE_MAX_ORDER;
+
+   mt->product_count = 0;
+   memset(m, 0, sizeof(m));
+   for(int o = 2; o <= order; o++)
+      find_products(mt, tone_hz, tone_count, o, m, 0, o);
+   qsort(mt->product, mt->product_count, sizeof(struct multitone_product), by_frequency);
+
+   for(int i = 0; i < point_count; i++)
+      mt->points[i] = points[i]*mt->window[i];
+   fft_forward_real(mt->plan, mt->points, mt->spectrum);
+
+   for(int k = 0; k <= bins; k++)
+      mt->owner[k] = OWNER_NONE;
+   claim(mt, 0.0, TONE_BAND_HZ/mt->bin_hz, OWNER_DC);
+   for(int i = 0; i < tone_count; i++)
+      claim(mt, tone_hz[i], TONE_BAND_HZ/mt->bin_hz, 1+i);
+   for(int j = 0; j < mt->product_count; j++)
+      claim(mt, mt->product[j].hz, LOBE, 1+tone_count+j);
+
+   double noise = 0.0;
+   memset(mt->power, 0, sizeof(double)*(1+tone_count+mt->product_count));
+   for(int k = 0; k <= bins; k++) {
+      double mag = cabs(mt->spectrum[k]);
+      double p   = mag*mag*mt->scale;
+      if(k == 0 || k == point_count-k)
+         p /= 2;
+      if(k < bins)
+         mt->signal[k] = log(mag/(point_count/2.0)/mt->max_rms)/log(10)*20;
+      if(mt->owner[k] == OWNER_NONE)
+         noise += p;
+      else
+         mt->power[mt->owner[k]] += p;
+   }
+
+   double signal = 0.0, harmonics = 0.0, imd = 0.0;
+   memset(result, 0, sizeof(*result));
+   result->tone_count = tone_count;
+   for(int i = 0; i < tone_count; i++) {
+      struct multitone_tone *t = &result->tone[i];
+      t->hz       = tone_hz[i];
+      t->level    = sqrt(mt->power[1+i]);
+      t->level_db = log(t->level*sqrt(2)/32767)/log(10)*20;
+      signal += mt->power[1+i];
+   }
+   for(int j = 0; j < mt->product_count; j++) {
+      struct multitone_product *p = &mt->product[j];
+      p->level    = sqrt(mt->power[1+tone_count+j]);
+      p->level_db = log(p->level*sqrt(2)/32767)/log(10)*20;
+      if(p->tones == 1)
+         harmonics += mt->power[1+tone_count+j];
+      else
+         imd += mt->power[1+tone_count+j];
+   }
+   result->product_count = mt->product_count;
+   result->product       = mt->product;
+   result->signal        = sqrt(signal);
+   result->harmonics     = sqrt(harmonics);
+   result->imd           = sqrt(imd);
+   result->noise         = sqrt(noise);
+   return 1;
+}
+
+// Positive terms first, so it reads "f2-f1" rather than "-f1+f2"
+void multitone_name(const struct multitone_product *p, int tone_count, char *out, int size) {
+   int n = 0;
+
+   out[0] = '\0';
+   for(int pass = 0; pass < 2; pass++) {
+      for(int i = 0; i < tone_count && n < size; i++) {
+         int k = p->m[i];
+         const char *sign = k < 0 ? "-" : n > 0 ? "+" : "";
+         if(k == 0 || (k > 0) != (pass == 0))
+            continue;
+         if(abs(k) > 1)
+            n += snprintf(out+n, size-n, "%s%if%i", sign, abs(k), i+1);
+         else
+            n += snprintf(out+n, size-n, "%sf%i", sign, i+1);
+      }
+   }
+}
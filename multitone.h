@@ -0,0 +1,50 @@
+#ifndef MULTITONE_H
+#define MULTITONE_H
+
+// Several tones played together and measured from one FFT of one capture:
+// the level of each tone, every harmonic and intermodulation product up to
+// a given order, and whatever is left over as noise. The power of each
+// component is summed over the bins it covers, so tones need not be on a
+// bin. Each bin is counted once, for whichever component is nearest.
+struct multitone;
+
+#define MULTITONE_MAX_TONES    8
+#define MULTITONE_MAX_ORDER    5
+#define MULTITONE_MAX_PRODUCTS 1024
+
+struct multitone_tone {
+   double hz;
+   double level;            // RMS
+   double level_db;         // Relative to a full scale sine
+};
+
+struct multitone_product {
+   double hz;               // sum of m[i]*tone_hz[i]
+   int order;               // sum of |m[i]|
+   int tones;               // how many of the m[i] are not 0, 1 for a harmonic
+   signed char m[MULTITONE_MAX_TONES];
+   double level;            // RMS
+   double level_db;         // Relative to a full scale sine
+};
+
+struct multitone_result {
+   int tone_count;
+   struct multitone_tone tone[MULTITONE_MAX_TONES];
+   int product_count;
+   const struct multitone_product *product;   // valid until the next multitone_run()
+   double signal;           // RMS of the tones together
+   double harmonics;        // RMS of the harmonics of each tone on its own
+   double imd;              // RMS of the products of two or more tones
+   double noise;            // RMS of everything else, DC left out
+};
+
+struct multitone *multitone_new(int point_count, unsigned int rate);
+// 'points' is left untouched. Returns 0 if no tone is below Nyquist.
+int multitone_run(struct multitone *mt, const double *points, const double *tone_hz, int tone_count, int order, struct multitone_result *result);
+// The spectrum of the last run in dB relative to a full scale sine, for plot()
+double *multitone_signal(struct multitone *mt);
+int multitone_bins(struct multitone *mt);
+// A product as "2f1-f2", with f1 the first tone
+void multitone_name(const struct multitone_product *p, int tone_count, char *out, int size);
+void multitone_free(struct multitone *mt);
+#endif
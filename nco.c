@@ -0,0 +1,69 @@
+#include <math.h>
+
+#include "nco.h"
+
+// 2*pi / 2^64, applied to the top 53 bits of the phase
+#define PHASE_TO_RADIANS  (2*M_PI/9007199254740992.0)
+
+uint64_t nco_step(double frequency_hz, unsigned int rate) {
+   double cycles = fmod(frequency_hz/rate, 1.0);
+   if(cycles < 0)
+      cycles += 1.0;
+   return (uint64_t)(cycles*18446744073709551616.0);
+}
+
+void nco_init(struct nco *o, uint64_t step) {
+   o->phase = 0;
+   nco_set_step(o, step);
+}
+
+void nco_set_step(struct nco *o, uint64_t step) {
+   double w = (step >> 11)*PHASE_TO_RADIANS;
+   o->step  = step;
+   o->rot_c = cos(w);
+   o->rot_s = sin(w);
+}
+
+static void block_start(const struct nco *o, double *zr, double *zi) {
+   double phase = (o->phase >> 11)*PHASE_TO_RADIANS;
+   *zr = cos(phase);
+   *zi = sin(phase);
+}
+
+void nco_sincos(struct nco *o, double *s, double *c, int n) {
+   while(n > 0) {
+      int block = n < NCO_BLOCK ? n : NCO_BLOCK;
+      double zr, zi;
+
+      block_start(o, &zr, &zi);
+      for(int i = 0; i < block; i++) {
+         s[i] = zi;
+         c[i] = zr;
+         double t = zr*o->rot_c - zi*o->rot_s;
+         zi = zr*o->rot_s + zi*o->rot_c;
+         zr = t;
+      }
+      o->phase += o->step*block;
+      s += block;
+      c += block;
+      n -= block;
+   }
+}
+
+void nco_tone(struct nco *o, int16_t *out, int frames, int stride, double amplitude) {
+   while(frames > 0) {
+      int block = frames < NCO_BLOCK ? frames : NCO_BLOCK;
+      double zr, zi;
+
+      block_start(o, &zr, &zi);
+      for(int i = 0; i < block; i++) {
+         *out = lrint(amplitude*zi);
+         out += stride;
+         double t = zr*o->rot_c - zi*o->rot_s;
+         zi = zr*o->rot_s + zi*o->rot_c;
+         zr = t;
+      }
+      o->phase += o->step*block;
+      frames -= block;
+   }
+}
@@ -0,0 +1,26 @@
+#ifndef NCO_H
+#define NCO_H
+#include <stdint.h>
+
+// Numerically controlled oscillator. The phase is a 64 bit fraction of a
+// cycle, so any frequency at any rate is hit to within rate/2^64 Hz and the
+// phase never drifts. Samples are made in short blocks, each started from
+// the exact phase and continued by complex rotation, so there are no tables.
+#define NCO_BLOCK 64
+
+struct nco {
+   uint64_t phase;
+   uint64_t step;
+   double rot_c;            // cos and sin of one step
+   double rot_s;
+};
+
+uint64_t nco_step(double frequency_hz, unsigned int rate);
+void nco_init(struct nco *o, uint64_t step);
+void nco_set_step(struct nco *o, uint64_t step);
+// The next 'n' values of sin and cos, advancing the phase
+void nco_sincos(struct nco *o, double *s, double *c, int n);
+// The next 'frames' samples of amplitude*sin, rounded, into out[0],
+// out[stride], ... so one channel of interleaved frames can be filled
+void nco_tone(struct nco *o, int16_t *out, int frames, int stride, double amplitude);
+#endif
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "font.h"
+#include "plot.h"
+
+#define WIDTH   3840
+#define HEIGHT  1080
+#define LEFT_MARGIN   200
+#define RIGHT_MARGIN   50
+#define TOP_MARGIN    100
+#define BOTTOM_MARGIN 100
+
+
+static char *labels[] = { "0dB ", "-20dB ", "-40dB ", "-60dB ", "-80dB ", "-100dB ", "-120dB ", "-140dB " };
+
+struct image *plot_image(const double *data, int count, char *bottom_text) {
+   struct image *img;
+   double min,max;
+   int last;
+
+   if(count < 2)
+      return NULL;
+   min = data[0];
+   max = data[1];
+   if(max == min)
+     max += 0.1;
+
+   for(int i = 0; i < count; i++) {
+     if(min > data[i]) 
+        min = data[i];
+     if(max < data[i]) 
+        max = data[i];
+   }
+   max = 0;
+   min = -140;
+   img = image_new(WIDTH, HEIGHT);
+   if(img == NULL) {
+     fprintf(stderr,"Out of RAM\n");
+     return NULL;
+   }
+   image_set_font(img, &font_ml);
+   image_set_colour(img, 0, 0, 0);
+   image_set_text_align(img, 0, 0);
+   image_text(img, WIDTH/2, TOP_MARGIN/2, "CODEC Loopback Frequency Spectrum");
+   image_text(img, WIDTH/2, HEIGHT-BOTTOM_MARGIN/2, bottom_text);
+   image_set_text_align(img, -1, 0);
+   int h = HEIGHT-TOP_MARGIN-BOTTOM_MARGIN;
+   for(int i = 0; i <= 7; i++)
+      image_text(img, LEFT_MARGIN, TOP_MARGIN+i*h/7, labels[i]);
+   for(int i = 1; i < 14; i++)
+      image_hline(img, LEFT_MARGIN, TOP_MARGIN+i*h/14, WIDTH-RIGHT_MARGIN-LEFT_MARGIN);
+
+   image_set_colour(img, 255, 0, 0);
+   for(int i = 0; i < count; i++) {
+     double d = data[i];
+     if(d < min) d = min;
+     if(d > max) d = max;
+     int x = (WIDTH-LEFT_MARGIN-RIGHT_MARGIN-1)*i/count+LEFT_MARGIN;
+     int y = (HEIGHT-BOTTOM_MARGIN-1)-(HEIGHT-TOP_MARGIN-BOTTOM_MARGIN-1)*(d-min)/(max-min);
+
+     // From the last point up to, but not including, this one
+     if(i > 0) {
+        if(y > last)
+           image_vline(img, x, last, y-last);
+        else
+           image_vline(img, x, y+1, last-y);
+     }
+     last = y;
+   }
+
+   image_set_colour(img, 0, 0, 0);
+   image_rectangle(img, LEFT_MARGIN, TOP_MARGIN-1, WIDTH-RIGHT_MARGIN-LEFT_MARGIN, 2);
+   image_rectangle(img, LEFT_MARGIN, HEIGHT-BOTTOM_MARGIN, WIDTH-RIGHT_MARGIN-LEFT_MARGIN, 2);
+   image_rectangle(img, LEFT_MARGIN-1, TOP_MARGIN, 2, HEIGHT-BOTTOM_MARGIN-TOP_MARGIN);
+   image_rectangle(img, WIDTH-RIGHT_MARGIN, TOP_MARGIN, 2, HEIGHT-BOTTOM_MARGIN-TOP_MARGIN);
+ 
+   return img;
+}
+
+void plot(const double *data, int count, char *bottom_text, char *filename) {
+   struct image *img = plot_image(data, count, bottom_text);
+
+   if(img == NULL)
+      return;
+   image_write(img, filename);
+   image_free(img);
+}
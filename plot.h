@@ -0,0 +1,11 @@
+#ifndef PLOT_H
+#define PLOT_H
+
+struct image;
+
+// Draw a spectrum in dB (0 to -140) and write it to 'filename', as PNG or
+// PPM depending on the name
+void plot(const double *data, int count, char *bottom_text, char *filename);
+// Just the drawing, the caller writes and frees the image
+struct image *plot_image(const double *data, int count, char *bottom_text);
+#endif
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+// A fixed set of worker threads. pool_for() splits a range into slices,
+// the calling thread works on slices alongside the workers and returns
+// once every slice has completed.
+//
+// pool_run() is for tasks of uneven cost. Each thread starts with an equal
+// share of the indexes and works through them from the front. Once its
+// own share is used up it steals the back half of another thread's.
+
+#define MODE_SLICES 0
+#define MODE_TASKS  1
+
+// The indexes [next, end) still to be run by one thread
+struct share {
+   pthread_mutex_t lock;
+   int next;
+   int end;
+};
+
+struct pool {
+   int threads;                 // including the calling thread
+   pthread_t *workers;
+   pthread_mutex_t submit;      // one pool_for() at a time
+   pthread_mutex_t lock;
+   pthread_cond_t  start;
+   pthread_cond_t  done;
+   unsigned generation;
+   int quit;
+
+   int mode;
+   pool_fn fn;
+   pool_task_fn task;
+   void *arg;
+   int count;
+   struct share *shares;        // one per thread, for pool_run()
+   int joined;
+   int slices;
+   int next_slice;
+   int finished;
+};
+
+// Called with pool->lock held, returns with it held
+static void run_slices(struct pool *pool) {
+   while(pool->next_slice < pool->slices) {
+      int slice  = pool->next_slice++;
+      int begin  = (long)pool->count*slice/pool->slices;
+      int end    = (long)pool->count*(slice+1)/pool->slices;
+      pool_fn fn = pool->fn;
+      void *arg  = pool->arg;
+
+      pthread_mutex_unlock(&pool->lock);
+      fn(arg, begin, end);
+      pthread_mutex_lock(&pool->lock);
+
+      pool->finished++;
+      if(pool->finished == pool->slices)
+         pthread_cond_signal(&pool->done);
+   }
+}
+
+// Take the next index from our own share, or failing that steal from
+// another. Returns -1 once there is nothing left anywhere.
+static int next_task(struct pool *pool, int self) {
+   struct share *own = &pool->shares[self];
+   int index = -1;
+
+   pthread_mutex_lock(&own->lock);
+   if(own->next < own->end)
+      index = own->next++;
+   pthread_mutex_unlock(&own->lock);
+   if(index >= 0)
+      return index;
+
+   for(int i = 1; i < pool->threads && index < 0; i++) {
+      struct share *victim = &pool->shares[(self+i) % pool->threads];
+      int begin = 0, end = 0;
+
+      pthread_mutex_lock(&victim->lock);
+      if(victim->next < victim->end) {
+         end   = victim->end;
+         begin = victim->next + (victim->end - victim->next)/2;
+         victim->end = begin;
+      }
+      pthread_mutex_unlock(&victim->lock);
+
+      if(begin < end) {
+         index = begin;
+         pthread_mutex_lock(&own->lock);
+         own->next = begin+1;
+         own->end  = end;
+         pthread_mutex_unlock(&own->lock);
+      }
+   }
+   return index;
+}
+
+// Called with pool->lock held, returns with it held
+static void run_tasks(struct pool *pool) {
+   int self = pool->joined++;
+   pool_task_fn task = pool->task;
+   void *arg = pool->arg;
+   int index;
+
+   pthread_mutex_unlock(&pool->lock);
+   while((index = next_task(pool, self)) >= 0)
+      task(arg, self, index);
+   pthread_mutex_lock(&pool->lock);
+
+   pool->finished++;
+   if(pool->finished == pool->threads)
+      pthread_cond_signal(&pool->done);
+}
+
+static void *worker(void *arg) {
+   struct pool *pool = arg;
+   unsigned seen;
+
+   pthread_mutex_lock(&pool->lock);
+   seen = pool->generation;
+   while(1) {
+      while(!pool->quit && pool->generation == seen)
+         pthread_cond_wait(&pool->start, &pool->lock);
+      if(pool->quit)
+         break;
+      seen = pool->generation;
+      if(pool->mode == MODE_TASKS)
+         run_tasks(pool);
+      else
+         run_slices(pool);
+   }
+   pthread_mutex_unlock(&pool->lock);
+   return NULL;
+}
+
+struct pool *pool_new(int threads) {
+   struct pool *pool;
+
+   if(threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads <= 0)
+      threads = 1;
+
+   pool = malloc(sizeof(struct pool));
+   if(pool == NULL)
+      return NULL;
+
+   pool->workers = malloc(sizeof(pthread_t)*threads);
+   pool->shares  = malloc(sizeof(struct share)*threads);
+   if(pool->workers == NULL || pool->shares == NULL) {
+      free(pool->workers);
+      free(pool->shares);
+      free(pool);
+      return NULL;
+   }
+
+   pthread_mutex_init(&pool->submit, NULL);
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->start, NULL);
+   pthread_cond_init(&pool->done, NULL);
+   pool->generation = 0;
+   pool->quit       = 0;
+   pool->slices     = 0;
+   pool->next_slice = 0;
+   pool->finished   = 0;
+
+   // If threads can't be started we just run with fewer of them
+   pool->threads = 1;
+   for(int i = 0; i < threads-1; i++) {
+      if(pthread_create(&pool->workers[i], NULL, worker, pool) != 0)
+         break;
+      pool->threads++;
+   }
+   for(int i = 0; i < pool->threads; i++)
+      pthread_mutex_init(&pool->shares[i].lock, NULL);
+   return pool;
+}
+
+int pool_size(struct pool *pool) {
+   return pool->threads;
+}
+
+void pool_for(struct pool *pool, int count, pool_fn fn, void *arg) {
+   if(count <= 0)
+      return;
+
+   if(pool == NULL || pool->threads == 1 || count == 1) {
+      fn(arg, 0, count);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->submit);
+   pthread_mutex_lock(&pool->lock);
+   pool->mode       = MODE_SLICES;
+   pool->fn         = fn;
+   pool->arg        = arg;
+   pool->count      = count;
+   pool->slices     = count < pool->threads ? count : pool->threads;
+   pool->next_slice = 0;
+   pool->finished   = 0;
+   pool->generation++;
+   pthread_cond_broadcast(&pool->start);
+
+   run_slices(pool);
+   while(pool->finished != pool->slices)
+      pthread_cond_wait(&pool->done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+   pthread_mutex_unlock(&pool->submit);
+}
+
+void pool_run(struct pool *pool, int count, pool_task_fn task, void *arg) {
+   if(count <= 0)
+      return;
+
+   if(pool == NULL || pool->threads == 1) {
+      for(int i = 0; i < count; i++)
+         task(arg, 0, i);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->submit);
+   pthread_mutex_lock(&pool->lock);
+   for(int i = 0; i < pool->threads; i++) {
+      pool->shares[i].next = (long)count*i/pool->threads;
+      pool->shares[i].end  = (long)count*(i+1)/pool->threads;
+   }
+   pool->mode     = MODE_TASKS;
+   pool->task     = task;
+   pool->arg      = arg;
+   pool->joined   = 0;
+   pool->finished = 0;
+   pool->generation++;
+   pthread_cond_broadcast(&pool->start);
+
+   run_tasks(pool);
+   while(pool->finished != pool->threads)
+      pthread_cond_wait(&pool->done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+   pthread_mutex_unlock(&pool->submit);
+}
+
+void pool_free(struct pool *pool) {
+   if(pool == NULL)
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+
+   for(int i = 0; i < pool->threads-1; i++)
+      pthread_join(pool->workers[i], NULL);
+
+   pthread_cond_destroy(&pool->done);
+   pthread_cond_destroy(&pool->start);
+   pthread_mutex_destroy(&pool->lock);
+   pthread_mutex_destroy(&pool->submit);
+   for(int i = 0; i < pool->threads; i++)
+      pthread_mutex_destroy(&pool->shares[i].lock);
+   free(pool->shares);
+   free(pool->workers);
+   free(pool);
+}
@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+struct pool;
+
+// 'fn' is called with disjoint [begin, end) slices that together cover [0, count)
+typedef void (*pool_fn)(void *arg, int begin, int end);
+// 'task' is called once for each index in [0, count), 'worker' is in
+// [0, pool_size()) and no two calls with the same worker run at once
+typedef void (*pool_task_fn)(void *arg, int worker, int index);
+
+struct pool *pool_new(int threads);
+int pool_size(struct pool *pool);
+void pool_for(struct pool *pool, int count, pool_fn fn, void *arg);
+void pool_run(struct pool *pool, int count, pool_task_fn task, void *arg);
+void pool_free(struct pool *pool);
+#endif
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *r, unsigned long frames, int channels) {
+   unsigned long size = 1;
+
+   while(size < frames)
+      size <<= 1;
+
+   r->data = malloc(sizeof(int16_t)*size*channels);
+   if(r->data == NULL)
+      return 0;
+   r->channels = channels;
+   r->frames   = size;
+   atomic_init(&r->head, 0);
+   atomic_init(&r->tail, 0);
+   atomic_init(&r->overruns, 0);
+   return 1;
+}
+
+void ring_free(struct ring *r) {
+   free(r->data);
+   r->data = NULL;
+}
+
+// Producer side, returns the number of frames actually stored
+unsigned long ring_write(struct ring *r, const int16_t *in, unsigned long frames) {
+   unsigned long head  = atomic_load_explicit(&r->head, memory_order_relaxed);
+   unsigned long tail  = atomic_load_explicit(&r->tail, memory_order_acquire);
+   unsigned long space = r->frames - (head - tail);
+   unsigned long index = head & (r->frames-1);
+   unsigned long n     = frames < space ? frames : space;
+   unsigned long first = n < r->frames-index ? n : r->frames-index;
+
+   memcpy(r->data + index*r->channels, in, sizeof(int16_t)*first*r->channels);
+   memcpy(r->data, in + first*r->channels, sizeof(int16_t)*(n-first)*r->channels);
+   atomic_store_explicit(&r->head, head+n, memory_order_release);
+   if(n != frames)
+      atomic_fetch_add_explicit(&r->overruns, frames-n, memory_order_relaxed);
+   return n;
+}
+
+// Consumer side, points 'out' at the frames that can be read in one piece
+unsigned long ring_peek(struct ring *r, const int16_t **out) {
+   unsigned long tail  = atomic_load_explicit(&r->tail, memory_order_relaxed);
+   unsigned long head  = atomic_load_explicit(&r->head, memory_order_acquire);
+   unsigned long index = tail & (r->frames-1);
+   unsigned long n     = head - tail;
+
+   if(n > r->frames-index)
+      n = r->frames-index;
+   *out = r->data + index*r->channels;
+   return n;
+}
+
+void ring_consume(struct ring *r, unsigned long frames) {
+   unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+   atomic_store_explicit(&r->tail, tail+frames, memory_order_release);
+}
@@ -0,0 +1,23 @@
+#ifndef RING_H
+#define RING_H
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Single producer, single consumer ring of interleaved 16 bit frames.
+// Lock free, so the audio thread never waits on the analysis side. When
+// the ring is full new frames are dropped and counted as overruns.
+struct ring {
+   int16_t *data;
+   int channels;
+   unsigned long frames;      // capacity, a power of two
+   atomic_ulong head;         // frames written, only moved by the producer
+   atomic_ulong tail;         // frames read, only moved by the consumer
+   atomic_ulong overruns;     // frames dropped because the ring was full
+};
+
+int ring_init(struct ring *r, unsigned long frames, int channels);
+void ring_free(struct ring *r);
+unsigned long ring_write(struct ring *r, const int16_t *in, unsigned long frames);
+unsigned long ring_peek(struct ring *r, const int16_t **out);
+void ring_consume(struct ring *r, unsigned long frames);
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+double stats_clock(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void stats_phase(double *phase, double *t) {
+   double now = stats_clock();
+   *phase += now - *t;
+   *t = now;
+}
+
+static void json_string(FILE *f, const char *s) {
+   fputc('"', f);
+   for(; *s; s++) {
+      if(*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if((unsigned char)*s < 0x20)
+         fprintf(f, "\\u%04x", *s);
+      else
+         fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+//=========================================================================================
+// One line per record, so a log of many runs can be read a line at a time
+int stats_write(const char *path, const struct run_stats *s, const struct run_measurement *m) {
+   double total = s->total > 0.0 ? s->total : stats_clock()-s->start;
+   FILE *f = stdout;
+
+   if(strcmp(path, "-") != 0) {
+      f = fopen(path, "a");
+      if(f == NULL) {
+         fprintf(stderr,"Unable to open %s\n", path);
+         return 0;
+      }
+   }
+
+   fprintf(f, "{\"time\": %li, \"device_pb\": ", (long)time(NULL));
+   json_string(f, m->device_pb != NULL ? m->device_pb : "");
+   fprintf(f, ", \"device_cap\": ");
+   json_string(f, m->device_cap != NULL ? m->device_cap : "");
+   fprintf(f, ", \"channel\": %i, \"rate\": %u, \"points\": %i, \"ok\": %s",
+           m->channel, m->rate, m->point_count, m->ok ? "true" : "false");
+   if(m->ok && m->analysed)
+      fprintf(f, ", \"peak_hz\": %.2f, \"signal_db\": %.3f, \"thd_n_db\": %.3f", m->peak_hz, m->signal_db, m->thd_n_db);
+   if(m->ok && m->harmonics > 0)
+      fprintf(f, ", \"thd_db\": %.3f", m->thd_db);
+   if(m->ok && m->tones > 0)
+      fprintf(f, ", \"tones\": %i, \"imd_db\": %.3f, \"noise_db\": %.3f", m->tones, m->imd_db, m->noise_db);
+   fprintf(f, ", \"ms\": {\"open\": %.3f, \"calibrate\": %.3f, \"settle\": %.3f, \"capture\": %.3f",
+           s->open*1e3, s->calibrate*1e3, s->settle*1e3, s->capture*1e3);
+   fprintf(f, ", \"harmonics\": %.3f, \"window\": %.3f, \"spectrum\": %.3f, \"notch\": %.3f, \"rms\": %.3f, \"analysis\": %.3f",
+           s->harmonics*1e3, s->window*1e3, s->spectrum*1e3, s->notch*1e3, s->rms*1e3, s->analysis*1e3);
+   fprintf(f, ", \"plot\": %.3f, \"write\": %.3f, \"total\": %.3f}", s->plot*1e3, s->write*1e3, total*1e3);
+   fprintf(f, ", \"calibrate_steps\": %i, \"xruns\": %lu, \"alsa_errors\": %lu, \"idle_wakeups\": %lu, \"dropped_frames\": %lu}\n",
+           s->calibrate_steps, s->xruns, s->alsa_errors, s->idle_wakeups, s->dropped_frames);
+
+   if(f != stdout)
+      fclose(f);
+   else
+      fflush(f);
+   return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Where the time of one test run goes, and how the audio behaved on the
+// way. Each phase costs a clock read at either end, so it is always on.
+// Times are in seconds from CLOCK_MONOTONIC.
+struct run_stats {
+   double start;
+   double open;             // opening the devices and starting the audio thread
+   double calibrate;        // calibrate_steps level measurements, mixer changes included
+   double settle;           // the tone playing before any of it is kept
+   double capture;          // the samples that are kept, or reading them from a file
+   double harmonics;
+   double window;
+   double spectrum;         // FFT, spectrum in dB and the peak search
+   double notch;
+   double rms;
+   double analysis;         // all of the analysis, the stages above included
+   double plot;             // drawing the graph
+   double write;            // and writing it out
+   double total;            // from start, left at 0 it is taken as up to stats_write()
+   int calibrate_steps;
+
+   // Counted by the audio thread
+   unsigned long xruns;
+   unsigned long alsa_errors;
+   unsigned long idle_wakeups;      // poll() returned with nothing to do
+   unsigned long dropped_frames;    // the ring was full, the reader fell behind
+};
+
+// What the run measured, for the same record
+struct run_measurement {
+   const char *device_pb;
+   const char *device_cap;
+   int channel;             // from 1
+   unsigned int rate;
+   int point_count;
+   int ok;
+   int analysed;            // 0 if only the harmonics were measured
+   double peak_hz;
+   double signal_db;
+   double thd_n_db;
+   int harmonics;           // 0 if thd_db wasn't measured
+   double thd_db;
+   int tones;               // with -t, harmonics is the highest product order
+   double imd_db;
+   double noise_db;
+};
+
+double stats_clock(void);
+// Adds the time since *t to *phase, and moves *t on to now
+void stats_phase(double *phase, double *t);
+// Appends the record to 'path' as one line of JSON, "-" for stdout
+int stats_write(const char *path, const struct run_stats *s, const struct run_measurement *m);
+#endif